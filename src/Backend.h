@@ -0,0 +1,96 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <linux/input.h>
+
+// Kernel side of the daemon: time, input devices, device node changes and the output device.
+// The system implementations are in SystemBackend.h; tools/simulate.cpp replaces them with
+// in-memory ones driven by a virtual clock.
+
+// Monotonic time in microseconds, CLOCK_MONOTONIC for the system clock.
+class Clock {
+public:
+    virtual ~Clock() = default;
+
+    virtual long long now_us() = 0;
+
+    virtual void sleep_us(long long us) = 0;
+};
+
+// What InputReader needs to know about an opened device.
+struct DeviceInfo {
+    std::string name;
+    int bustype;
+    int vendor;
+    int product;
+    int version;
+    bool keyboard; // has KEY_A
+    bool mouse;    // has BTN_LEFT
+};
+
+// Input devices read by InputReader.
+class InputBackend {
+public:
+    virtual ~InputBackend() = default;
+
+    // Returns a non-blocking descriptor, or -1 with errno set.
+    virtual int open(const std::string &path, DeviceInfo &info) = 0;
+
+    // Takes over a descriptor opened by a previous instance of the daemon, see Handoff.
+    // Returns `fd`, or -1 with errno set; the descriptor is closed on failure.
+    virtual int adopt(int fd, DeviceInfo &info) = 0;
+
+    virtual void close(int fd) = 0;
+
+    // Reads up to `max` events, returns 0 when there is nothing to read.
+    // After SYN_DROPPED the device state is resynced instead, as libevdev does.
+    virtual size_t read(int fd, input_event *events, size_t max) = 0;
+
+    // True if any key is held down, or if the state can't be read.
+    virtual bool keys_down(int fd) = 0;
+
+    virtual bool grab(int fd) = 0;
+};
+
+enum NodeChange {
+    NodeCreated,
+    NodeDeleted,
+    NodeChanged // attributes changed, e.g. udev has fixed the permissions
+};
+
+// Changes of /dev/input and the probe timer used by DeviceManager.
+class HotplugBackend {
+public:
+    virtual ~HotplugBackend() = default;
+
+    // Returns the descriptor that becomes readable on changes, -1 on failure.
+    virtual int init(std::string &err) = 0;
+
+    virtual int get_timer_fd() const = 0;
+
+    virtual bool list(std::vector<std::string> &paths, std::string &err) = 0;
+
+    // Takes the next pending change of an event node.
+    virtual bool next(NodeChange &change, std::string &path) = 0;
+
+    // Fires the timer after `delay_ms`, -1 disarms it.
+    virtual void set_timer(long long delay_ms) = 0;
+};
+
+// Virtual keyboard device written by VirtualKeyboard.
+class OutputBackend {
+public:
+    virtual ~OutputBackend() = default;
+
+    // `extended` also enables the key codes above KEY_OK.
+    virtual bool create(const DeviceInfo &info, bool extended, std::string &err) = 0;
+
+    // Takes over the device created by a previous instance of the daemon, see Handoff.
+    virtual bool adopt(int fd, std::string &err) = 0;
+
+    virtual int get_fd() const = 0;
+
+    // Writes complete frames with a single call.
+    virtual bool write(const input_event *events, size_t count) = 0;
+};
@@ -38,6 +38,11 @@ bool Config::open(const std::string &path) {
     return true;
 }
 
+bool Config::has(const std::string &section, const std::string &key) const {
+    auto s = data.find(section);
+    return s != data.end() && s->second.count(key) != 0;
+}
+
 bool Config::get_int(const std::string &section, const std::string &key, int &out, int def) const {
     out = def;
 
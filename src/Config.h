@@ -9,6 +9,8 @@ public:
 
     bool open(const std::string &path);
 
+    bool has(const std::string &section, const std::string &key) const;
+
     bool get_int(const std::string &section, const std::string &key, int &out, int def = 0) const;
 
     bool get_double(const std::string &section, const std::string &key, double &out, double def = 0.0) const;
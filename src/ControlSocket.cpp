@@ -0,0 +1,128 @@
+#include "ControlSocket.h"
+
+#include <cerrno>
+#include <cstring>
+#include <grp.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+// The client waits this long for the daemon to reply.
+static const int REPLY_TIMEOUT_MS = 1000;
+
+ControlSocket::~ControlSocket() {
+    close();
+}
+
+bool ControlSocket::open(const std::string &path, const std::string &group) {
+    err.clear();
+    close();
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        err = "Control socket path is too long: " + path;
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+
+    gid_t gid = 0;
+    if (!group.empty()) {
+        struct group *entry = getgrnam(group.c_str());
+        if (!entry) {
+            err = "Unknown control socket group: " + group;
+            return false;
+        }
+        gid = entry->gr_gid;
+    }
+
+    fd_ = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd_ == -1) {
+        err = "Failed to create control socket: " + std::string(strerror(errno));
+        return false;
+    }
+
+    // a socket file left by a daemon that was killed
+    unlink(path.c_str());
+    if (bind(fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1 ||
+        chmod(path.c_str(), group.empty() ? 0600 : 0660) == -1 ||
+        (gid != 0 && chown(path.c_str(), 0, gid) == -1)) {
+        err = "Failed to bind control socket " + path + ": " + std::string(strerror(errno));
+        ::close(fd_);
+        fd_ = -1;
+        unlink(path.c_str());
+        return false;
+    }
+
+    path_ = path;
+    return true;
+}
+
+void ControlSocket::close() {
+    if (fd_ != -1) ::close(fd_);
+    fd_ = -1;
+    if (!path_.empty()) unlink(path_.c_str());
+    path_.clear();
+}
+
+bool ControlSocket::receive(int &command) {
+    uint8_t buf[16];
+    from_len_ = sizeof(from_);
+    ssize_t len;
+    do {
+        len = recvfrom(fd_, buf, sizeof(buf), 0, reinterpret_cast<sockaddr *>(&from_), &from_len_);
+    } while (len == -1 && errno == EINTR);
+    if (len == -1) return false;
+
+    // empty or longer datagrams aren't commands
+    command = len == 1 ? buf[0] : -1;
+    return true;
+}
+
+void ControlSocket::reply(const ControlState &state) {
+    // unbound clients have no address to reply to
+    if (from_len_ <= sizeof(sa_family_t)) return;
+    sendto(fd_, &state, sizeof(state), MSG_DONTWAIT, reinterpret_cast<sockaddr *>(&from_), from_len_);
+}
+
+bool ControlSocket::request(const std::string &path, int command, ControlState &state) {
+    err.clear();
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        err = "Control socket path is too long: " + path;
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        err = "Failed to create socket: " + std::string(strerror(errno));
+        return false;
+    }
+
+    // binding to an empty address picks a unique abstract one, so the daemon can reply
+    sa_family_t family = AF_UNIX;
+    timeval timeout{REPLY_TIMEOUT_MS / 1000, (REPLY_TIMEOUT_MS % 1000) * 1000};
+    uint8_t byte = command;
+    if (bind(fd, reinterpret_cast<sockaddr *>(&family), sizeof(family)) == -1 ||
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1 ||
+        sendto(fd, &byte, 1, 0, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1) {
+        err = "Failed to send to " + path + ": " + std::string(strerror(errno));
+        ::close(fd);
+        return false;
+    }
+
+    ssize_t len = recv(fd, &state, sizeof(state), 0);
+    ::close(fd);
+    if (len == -1) {
+        err = "No reply from " + path + ": " + std::string(strerror(errno));
+        return false;
+    }
+    if (len != sizeof(state) || state.version != VERSION) {
+        err = "Unexpected reply from " + path;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define CONTROL_SOCKET "/run/easy-switcher.sock"
+
+// A request is a single command byte.
+enum ControlCommand : uint8_t {
+    CommandState,       // only asks for the state
+    CommandConvertWord,
+    CommandConvertAll,
+    CommandUndo,
+    CommandPause,       // typing isn't tracked until resumed, grabbed keyboards still pass through
+    CommandResume,
+    CommandClear        // forgets the typed text
+};
+
+enum ControlStatus : uint8_t {
+    StatusOk,
+    StatusUnknown, // not a command
+    StatusFailed   // nothing to undo, or paused
+};
+
+// Reply to every request, sent back if the client has bound an address.
+struct ControlState {
+    uint8_t version;
+    uint8_t status;
+    uint8_t paused;
+    uint8_t layout;
+    uint8_t layouts;      // 0 without keymaps
+    uint8_t reserved[3];
+    uint32_t buffer_size; // typed events
+    uint32_t cursor;
+    uint32_t conversions;
+    uint32_t devices;
+};
+
+// Unix datagram socket for commands from shortcuts, scripts and test rigs, see easy-switcher --control.
+// Requests are read in the event loop, so a command costs a recvfrom and a sendto besides its output.
+class ControlSocket {
+public:
+    static const uint8_t VERSION = 1;
+
+    std::string err;
+
+    ControlSocket() = default;
+
+    ControlSocket(const ControlSocket &) = delete;
+
+    ControlSocket &operator=(const ControlSocket &) = delete;
+
+    ~ControlSocket();
+
+    // Only root may send commands, or also the members of `group` if it isn't empty.
+    bool open(const std::string &path, const std::string &group);
+
+    void close();
+
+    int get_fd() const { return fd_; }
+
+    // Takes the next pending request, false if there is none.
+    bool receive(int &command);
+
+    // Replies to the request taken last.
+    void reply(const ControlState &state);
+
+    // Client side: sends `command` to the daemon and waits for the reply.
+    bool request(const std::string &path, int command, ControlState &state);
+
+private:
+    int fd_ = -1;
+    std::string path_;
+
+    // address of the last request, empty if the client can't be replied to
+    sockaddr_un from_{};
+    socklen_t from_len_ = 0;
+};
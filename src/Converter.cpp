@@ -1,7 +1,7 @@
 #include "Converter.h"
+#include "Trace.h"
 
-#include <iostream>
-#include <unordered_set>
+#include <cstring>
 #include <libevdev/libevdev.h>
 #include <linux/input-event-codes.h>
 
@@ -11,7 +11,7 @@ static const int K_REPEAT = 2;
 
 static const int ANY_SHIFT = -100; // special placeholder meaning "any shift"
 
-static const std::unordered_set<int> Keys = {
+static const int Keys[] = {
     KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7, KEY_8, KEY_9, KEY_0, KEY_MINUS, KEY_EQUAL,
     KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I, KEY_O, KEY_P, KEY_LEFTBRACE, KEY_RIGHTBRACE,
     KEY_A, KEY_S, KEY_D, KEY_F, KEY_G, KEY_H, KEY_J, KEY_K, KEY_L, KEY_SEMICOLON, KEY_APOSTROPHE, KEY_GRAVE,
@@ -20,14 +20,64 @@ static const std::unordered_set<int> Keys = {
     KEY_KP3, KEY_KP0, KEY_KPDOT, KEY_KPSLASH, KEY_ENTER, KEY_KPENTER
 };
 
-static const std::unordered_set<int> Shifts = {KEY_LEFTSHIFT, KEY_RIGHTSHIFT};
+static const int Shifts[] = {KEY_LEFTSHIFT, KEY_RIGHTSHIFT};
 
-static const std::unordered_set<int> BufKillers = {
-    BTN_LEFT, BTN_RIGHT, BTN_MIDDLE, KEY_TAB, KEY_LEFTCTRL, KEY_LEFTALT, KEY_RIGHTCTRL, KEY_RIGHTALT, KEY_HOME,
-    KEY_UP, KEY_PAGEUP, KEY_LEFT, KEY_RIGHT, KEY_END, KEY_DOWN, KEY_PAGEDOWN, KEY_INSERT
+static const int BufKillers[] = {
+    BTN_LEFT, BTN_RIGHT, BTN_MIDDLE, KEY_TAB, KEY_LEFTCTRL, KEY_LEFTALT, KEY_RIGHTCTRL, KEY_RIGHTALT,
+    KEY_UP, KEY_PAGEUP, KEY_DOWN, KEY_PAGEDOWN, KEY_INSERT
 };
 
-Converter::Converter() : conv_key(0), ls_keys{0, 0} {
+static const int CursorKeys[] = {KEY_LEFT, KEY_RIGHT, KEY_HOME, KEY_END};
+
+enum KeyClass : uint8_t {
+    ClassKey = 1,
+    ClassShift = 2,
+    ClassKiller = 4,
+    ClassCursor = 8
+};
+
+// Class bits of every key code, so that classifying a key is a single load.
+struct KeyClassTable {
+    uint8_t classes[KEY_CNT];
+
+    KeyClassTable() : classes{} {
+        for (int code: Keys) classes[code] |= ClassKey;
+        for (int code: Shifts) classes[code] |= ClassShift;
+        for (int code: BufKillers) classes[code] |= ClassKiller;
+        for (int code: CursorKeys) classes[code] |= ClassCursor;
+    }
+
+    bool has(int code, uint8_t bits) const {
+        return (unsigned) code < KEY_CNT && (classes[code] & bits) != 0;
+    }
+};
+
+static const KeyClassTable KeyClasses;
+
+// Bits of Converter::passive_.
+static const uint8_t PassiveReleased = 1;
+static const uint8_t PassiveAlways = 2;
+
+// Undo plans of short conversions fit into the reserved space,
+// only unusually long ones make a slot grow once.
+static const size_t UNDO_RESERVE = 1024;
+
+// A word is converted automatically when another layout scores this much higher per key,
+// in quarter bits of the model: 2 bits per key, 4 times more likely for each character.
+static const int AUTO_MARGIN = 8;
+static const size_t AUTO_MIN_KEYS = 3;
+
+Converter::Converter() : conv_key(0), undo_key(0), ls_keys{0, 0}, auto_convert(false),
+                         trigger_window(DEFAULT_TRIGGER_WINDOW), expand_window(DEFAULT_EXPAND_WINDOW),
+                         buffer_(BUFFER_SIZE), shifts_held_(0),
+                         history_head_(0), history_count_(0), edits_(0), layout_(0), ls_held_(false),
+                         word_keys_{}, word_scores_{}, word_size_(0), word_lost_(false), auto_pending_(false),
+                         trigger_us_(0),
+                         passive_{}, passive_keys_{-1, -1, -1, -1} {
+    text_.reserve(BUFFER_SIZE);
+    for (auto &conversion: history_) {
+        conversion.undo.reserve(UNDO_RESERVE);
+    }
 }
 
 Converter::~Converter() {
@@ -36,63 +86,108 @@ Converter::~Converter() {
 
 // Write key event to internal buffer
 // Returns true only if buffer is changed
-bool Converter::push(int code, int value) {
+bool Converter::push(int code, int value, long long time_us) {
+    TRACE3(converter_push, code, value, buffer_.size());
+    track_layout_switch(code, value);
+
+    // keep the history within its preallocated capacity
+    if (buffer_.full()) {
+        buffer_.erase_front(BUFFER_SIZE / 2);
+        history_count_ = 0;
+    }
+
+    if (is_shift(code) && !is_repeat(value)) {
+        shifts_held_ += is_down(value) ? 1 : -1;
+        if (shifts_held_ < 0) shifts_held_ = 0;
+    }
+
     // clear the buffer if a "killer" key (like Tab, Ctrl, mouse button, etc.) is pressed
     if (is_killer(code) && !is_repeat(value)) {
         clear_buffer();
         return true;
     }
 
-    // if the user-defined convert key is pressed, add it to the buffer without repeats
+    // cursor keys move within the buffer; selecting text with shift,
+    // or moving out of the text the buffer knows, clears it
+    if (is_cursor_key(code) && !is_up(value)) {
+        ++edits_;
+        word_lost_ = true;
+        if (shifts_held_ > 0 || !move_cursor(code)) clear_buffer();
+        return true;
+    }
+
+    // if the user-defined convert or undo key is pressed, add it to the buffer without repeats
     if (conv_key != 0 && code == conv_key && !is_repeat(value)) {
-        buffer_.push_back({code, value});
+        buffer_.insert({code, value, time_us});
+        return true;
+    }
+
+    if (undo_key != 0 && code == undo_key && !is_repeat(value)) {
+        buffer_.insert({code, value, time_us});
         return true;
     }
 
     // if a shift key is pressed, add it to the buffer without repeats
     if (is_shift(code) && !is_repeat(value)) {
-        buffer_.push_back({code, value});
+        buffer_.insert({code, value, time_us});
+        return true;
+    }
+
+    // delete removes the first non-shift key after the cursor
+    if (code == KEY_DELETE && !is_up(value)) {
+        ++edits_;
+        word_lost_ = true;
+        for (size_t i = buffer_.cursor(); i < buffer_.size(); ++i) {
+            if (!is_shift(buffer_[i].code)) {
+                buffer_.erase(i);
+                break;
+            }
+        }
         return true;
     }
 
-    // if backspace is pressed, remove the most recent non-shift key from the buffer.
+    // if backspace is pressed, remove the most recent non-shift key before the cursor.
     // ignore key-up events; backspace repeat is treated as key-down.
     // then remove trailing shift down/up pairs and artifacts.
     if (is_backspace(code) && !is_up(value)) {
+        ++edits_;
+        word_pop();
+
         // non-shift key
-        for (int i = buffer_.size() - 1; i >= 0; --i) {
-            if (!is_shift(buffer_[i].code)) {
-                buffer_.erase(buffer_.begin() + i);
+        for (size_t i = buffer_.cursor(); i > 0; --i) {
+            if (!is_shift(buffer_[i - 1].code)) {
+                buffer_.erase(i - 1);
                 break;
             }
         }
 
         // shift down/up
-        while (buffer_.size() >= 2) {
-            if (buffer_matches_pattern({
-                    {KEY_LEFTSHIFT, K_DOWN, true},
-                    {KEY_LEFTSHIFT, K_UP, true}
-                }) || buffer_matches_pattern({
-                    {KEY_RIGHTSHIFT, K_DOWN, true},
-                    {KEY_RIGHTSHIFT, K_UP, true}
-                })
-            ) {
-                buffer_.erase(buffer_.end() - 2, buffer_.end());
+        static const Pattern left_shift[] = {
+            {KEY_LEFTSHIFT, K_DOWN, true},
+            {KEY_LEFTSHIFT, K_UP, true}
+        };
+        static const Pattern right_shift[] = {
+            {KEY_RIGHTSHIFT, K_DOWN, true},
+            {KEY_RIGHTSHIFT, K_UP, true}
+        };
+        while (buffer_.cursor() >= 2) {
+            if (buffer_matches_pattern(left_shift) || buffer_matches_pattern(right_shift)) {
+                erase_before_cursor(2);
             } else {
                 break;
             }
         }
 
         // double shift down/up artifacts
-        while (buffer_.size() >= 4) {
-            if (buffer_matches_pattern({
-                    {ANY_SHIFT, K_DOWN, true},
-                    {ANY_SHIFT, K_DOWN, true},
-                    {ANY_SHIFT, K_UP, true},
-                    {ANY_SHIFT, K_UP, true}
-                })
-            ) {
-                buffer_.erase(buffer_.end() - 4, buffer_.end());
+        static const Pattern double_shift[] = {
+            {ANY_SHIFT, K_DOWN, true},
+            {ANY_SHIFT, K_DOWN, true},
+            {ANY_SHIFT, K_UP, true},
+            {ANY_SHIFT, K_UP, true}
+        };
+        while (buffer_.cursor() >= 4) {
+            if (buffer_matches_pattern(double_shift)) {
+                erase_before_cursor(4);
             } else {
                 break;
             }
@@ -105,7 +200,9 @@ bool Converter::push(int code, int value) {
     // if a regular key is pressed, add it to the buffer
     // ignore up, repeat is treated as down
     if (is_key(code) && !is_up(value)) {
-        buffer_.push_back({code, K_DOWN});
+        buffer_.insert({code, K_DOWN, time_us});
+        ++edits_;
+        word_push(code);
         return true;
     }
 
@@ -113,49 +210,116 @@ bool Converter::push(int code, int value) {
 }
 
 
-// Process the end of the buffer to check if it's time to convert.
+// Process the buffer before the cursor to check if it's time to convert.
 // If conversion is needed, also remove the processed tail.
 Action Converter::process() {
+    Action action = match();
+    TRACE2(converter_process, (int) action, buffer_.size());
+    return action;
+}
+
+// True if push() would ignore the event, found without calling it.
+static inline bool passive_event(const KeyEvent &event, const uint8_t *passive) {
+    uint8_t bit = event.value == K_UP ? PassiveReleased : PassiveAlways;
+    return (unsigned) event.code < KEY_CNT && (passive[event.code] & bit);
+}
+
+Action Converter::push_batch(const KeyEvent *events, size_t count, size_t &consumed) {
+    update_passive();
+
+    for (size_t i = 0; i < count; ++i) {
+        if (passive_event(events[i], passive_)) continue;
+        if (!push(events[i].code, events[i].value, events[i].time_us)) continue;
+        Action action = process();
+        if (action != None) {
+            consumed = i + 1;
+            return action;
+        }
+    }
+
+    consumed = count;
+    return None;
+}
+
+// Rebuilds passive_ if the configured keys changed. It follows the branches of push():
+// only the classified keys, delete and the configured keys change anything, and of their
+// releases only those of killers, shifts and the configured keys do.
+void Converter::update_passive() {
+    const int keys[4] = {conv_key, undo_key, ls_keys[0], ls_keys[1]};
+    if (memcmp(keys, passive_keys_, sizeof(keys)) == 0) return;
+    memcpy(passive_keys_, keys, sizeof(keys));
+
+    for (int code = 0; code < KEY_CNT; ++code) {
+        bool configured = code != 0 && (code == conv_key || code == undo_key ||
+                                        code == ls_keys[0] || code == ls_keys[1]);
+        bool released = configured || is_killer(code) || is_shift(code);
+        bool pressed = released || is_key(code) || is_cursor_key(code) || is_backspace(code) ||
+                       code == KEY_DELETE;
+        passive_[code] = (released ? 0 : PassiveReleased) | (pressed ? 0 : PassiveAlways);
+    }
+}
+
+Action Converter::match() {
     if (buffer_.empty()) {
         return None;
     };
 
+    if (auto_pending_) {
+        auto_pending_ = false;
+        return ConvertWord;
+    }
+
+    // undo key restores the text of the last conversion, if it wasn't edited since
+    if (undo_key != 0) {
+        const Pattern undo[] = {
+            {undo_key, K_DOWN, true},
+            {undo_key, K_UP, true}
+        };
+        if (buffer_matches_pattern(undo)) {
+            erase_before_cursor(2);
+            return can_undo() ? Undo : None;
+        }
+    }
+
     if (conv_key == 0) {
         // converters triggered by double shifts - default
 
         // 1. double shift without other shift pressed
-        if (buffer_matches_pattern({
+        static const Pattern word[] = {
             {ANY_SHIFT, K_DOWN, false},
             {ANY_SHIFT, K_DOWN, true},
             {ANY_SHIFT, K_UP, true},
             {ANY_SHIFT, K_DOWN, true},
             {ANY_SHIFT, K_UP, true}
-        })) {
+        };
+        if (buffer_matches_trigger(word)) {
+            trigger_us_ = buffer_[buffer_.cursor() - 1].time_us;
             trim_buffer();
             return ConvertWord;
         }
 
-        // 2. double shift with other shift pressed
-        if (buffer_matches_pattern({
-            {ANY_SHIFT, K_DOWN, true},
+        // 2. double shift with other shift pressed, held for as long as it takes
+        static const Pattern all[] = {
+            {ANY_SHIFT, K_DOWN, true, false},
             {ANY_SHIFT, K_DOWN, true},
             {ANY_SHIFT, K_UP, true},
             {ANY_SHIFT, K_DOWN, true},
             {ANY_SHIFT, K_UP, true},
-            {ANY_SHIFT, K_UP, true}
-        })) {
+            {ANY_SHIFT, K_UP, true, false}
+        };
+        if (buffer_matches_trigger(all)) {
             trim_buffer();
             return ConvertAll;
         }
 
         // 3. just switch layout with shifts, if buffer has no letters
-        if (buffer_.size() == 4 &&
-            buffer_matches_pattern({
-                {ANY_SHIFT, K_DOWN, true},
-                {ANY_SHIFT, K_UP, true},
-                {ANY_SHIFT, K_DOWN, true},
-                {ANY_SHIFT, K_UP, true}
-            })) {
+        static const Pattern layout[] = {
+            {ANY_SHIFT, K_DOWN, true},
+            {ANY_SHIFT, K_UP, true},
+            {ANY_SHIFT, K_DOWN, true},
+            {ANY_SHIFT, K_UP, true}
+        };
+        if (buffer_.size() == 4 && buffer_matches_trigger(layout)) {
             trim_buffer();
             return ConvertAll;
         }
@@ -163,43 +327,47 @@ Action Converter::process() {
         // converters triggered by a user-defined key
 
         // 1. user-defined key without shift pressed
-        if (buffer_matches_pattern({
+        const Pattern word[] = {
             {ANY_SHIFT, K_DOWN, false},
             {conv_key, K_DOWN, true},
             {conv_key, K_UP, true}
-        })) {
+        };
+        if (buffer_matches_pattern(word)) {
+            trigger_us_ = buffer_[buffer_.cursor() - 1].time_us;
             trim_buffer();
             return ConvertWord;
         }
 
         // 2. user-defined key with shift pressed
-        if (buffer_matches_pattern({
+        const Pattern all[] = {
             {ANY_SHIFT, K_DOWN, true},
             {conv_key, K_DOWN, true},
             {conv_key, K_UP, true},
             {ANY_SHIFT, K_UP, true}
-        })) {
+        };
+        if (buffer_matches_pattern(all)) {
             trim_buffer();
             return ConvertAll;
         }
 
         // 3. user-defined key with shift pressed and released before conv_key
-        if (buffer_matches_pattern({
+        const Pattern all_released[] = {
             {ANY_SHIFT, K_DOWN, true},
             {conv_key, K_DOWN, true},
             {ANY_SHIFT, K_UP, true},
             {conv_key, K_UP, true}
-        })) {
+        };
+        if (buffer_matches_pattern(all_released)) {
             trim_buffer();
             return ConvertAll;
         }
 
         // 4. just switch layout with user-defined key, if buffer has no letters
-        if (buffer_.size() == 2 &&
-            buffer_matches_pattern({
-                {conv_key, K_DOWN, true},
-                {conv_key, K_UP, true}
-            })) {
+        const Pattern layout[] = {
+            {conv_key, K_DOWN, true},
+            {conv_key, K_UP, true}
+        };
+        if (buffer_.size() == 2 && buffer_matches_pattern(layout)) {
             trim_buffer();
             return ConvertAll;
         }
@@ -208,132 +376,376 @@ Action Converter::process() {
     return None;
 }
 
-// Returns ready-to-emit buffer.
-// Doesn't modify internal buffer.
-std::vector<KeyEvent> Converter::convert(Action action) const {
-    std::vector<KeyEvent> result;
+// Fills `result` with ready-to-emit events.
+// Doesn't modify internal buffer. With `result` reserved for PLAN_SIZE events it never allocates.
+// Each conversion is remembered together with its undo plan; Undo emits that plan as is.
+void Converter::convert(Action action, std::vector<KeyEvent> &result) {
+    result.clear();
+    long long trigger_us = trigger_us_;
+    trigger_us_ = 0;
+
+    if (action == Undo) {
+        if (!can_undo()) return;
+        history_head_ = (history_head_ + HISTORY_SIZE - 1) % HISTORY_SIZE;
+        --history_count_;
+        result = history_[history_head_].undo;
+        layout_ = history_[history_head_].layout;
+        TRACE2(converter_plan, (int) action, result.size());
+        return;
+    }
 
-    // switch layout
-    result.push_back({ls_keys[0], K_DOWN});
-    if (ls_keys[1] != 0) {
-        result.push_back({ls_keys[1], K_DOWN});
-        result.push_back({ls_keys[1], K_UP});
+    if (action == ConvertWord && expand(trigger_us, result)) {
+        TRACE2(converter_plan, (int) action, result.size());
+        return;
     }
-    result.push_back({ls_keys[0], K_UP});
 
-    int start_index = 0;
+    size_t cursor = buffer_.cursor();
+    size_t start = 0;
+    size_t end = buffer_.size();
 
-    // find the last word if we are converting only the last word
+    // find the word before the cursor if we are converting only the last word,
+    // with the cursor inside the word it is converted up to the word's end
     if (action == ConvertWord) {
-        int i = buffer_.size() - 1;
+        size_t i = cursor;
 
         // skip trailing SPACE and ENTER keys
-        while (i >= 0 && (buffer_[i].code == KEY_SPACE ||
-                          buffer_[i].code == KEY_ENTER ||
-                          buffer_[i].code == KEY_KPENTER)) {
+        while (i > 0 && is_word_end(buffer_[i - 1].code)) {
             --i;
         }
 
         // move backwards until we hit a SPACE, ENTER, or the beginning
-        while (i >= 0 && (buffer_[i].code != KEY_SPACE &&
-                          buffer_[i].code != KEY_ENTER &&
-                          buffer_[i].code != KEY_KPENTER)) {
+        while (i > 0 && !is_word_end(buffer_[i - 1].code)) {
             --i;
         }
 
         // start of the last word
-        start_index = i + 1;
+        start = i;
+
+        end = cursor;
+        if (cursor == 0 || !is_word_end(buffer_[cursor - 1].code)) {
+            while (end < buffer_.size() && !is_word_end(buffer_[end].code)) {
+                ++end;
+            }
+        }
     }
 
-    // find the start of the string if we are converting the whole buffer
+    // find the line around the cursor if we are converting the whole buffer
     if (action == ConvertAll) {
-        int i = buffer_.size() - 1;
+        size_t i = cursor;
 
         // skip trailing ENTER keys
-        while (i >= 0 && (buffer_[i].code == KEY_ENTER ||
-                          buffer_[i].code == KEY_KPENTER)) {
+        while (i > 0 && is_line_end(buffer_[i - 1].code)) {
             --i;
         }
 
         // move backwards until we hit an ENTER key or reach the beginning
-        while (i >= 0 && (buffer_[i].code != KEY_ENTER &&
-                          buffer_[i].code != KEY_KPENTER)) {
+        while (i > 0 && !is_line_end(buffer_[i - 1].code)) {
             --i;
         }
 
         // start of the string
-        start_index = i + 1;
+        start = i;
+
+        end = cursor;
+        if (cursor == 0 || !is_line_end(buffer_[cursor - 1].code)) {
+            while (end < buffer_.size() && !is_line_end(buffer_[end].code)) {
+                ++end;
+            }
+        }
     }
 
+    text_.clear();
+    for (size_t i = start; i < end; ++i) {
+        text_.push_back(buffer_[i]);
+    }
 
-    // send a backspace for each key
-    for (int i = start_index; i < (int) buffer_.size(); ++i) {
+    // switch straight to the most likely layout for the text,
+    // the switch-only trigger has no text and moves to the next one
+    size_t count = layout_count();
+    size_t target = layouts.count() > 1
+                        ? layouts.choose(layout_, text_.data(), text_.size())
+                        : (layout_ + 1) % count;
+    size_t steps = (target + count - layout_) % count;
+    switch_layout(steps, result);
+    size_t text_start = result.size();
+
+    // send a backspace for each key before the cursor and a delete for each key after it
+    for (size_t i = start; i < end; ++i) {
         if (!is_shift(buffer_[i].code)) {
-            result.push_back({KEY_BACKSPACE, K_DOWN});
-            result.push_back({KEY_BACKSPACE, K_UP});
+            int erase = i < cursor ? KEY_BACKSPACE : KEY_DELETE;
+            result.push_back({erase, K_DOWN, 0});
+            result.push_back({erase, K_UP, 0});
         }
     }
 
-    // replay the buffer
-    for (int i = start_index; i < (int) buffer_.size(); ++i) {
-        result.push_back(buffer_[i]);
+    // replay the text
+    for (const auto &ev: text_) {
+        result.push_back(ev);
+        if (!is_shift(ev.code)) {
+            result.push_back({ev.code, K_UP, 0});
+        }
+    }
+
+    // and put the cursor back
+    for (size_t i = cursor; i < end; ++i) {
         if (!is_shift(buffer_[i].code)) {
-            result.push_back({buffer_[i].code, K_UP});
+            result.push_back({KEY_LEFT, K_DOWN, 0});
+            result.push_back({KEY_LEFT, K_UP, 0});
         }
     }
 
-    return result;
+    // switching back to the original layout and replaying the same keys restores the text,
+    // with two layouts the undo plan is the conversion itself
+    Conversion &conversion = history_[history_head_];
+    conversion.start = start;
+    conversion.end = buffer_.size();
+    conversion.edits = edits_;
+    conversion.layout = layout_;
+    conversion.source = layout_;
+    conversion.trigger_us = action == ConvertWord ? trigger_us : 0;
+    conversion.undo.clear();
+    switch_layout(count - steps, conversion.undo);
+    conversion.undo.insert(conversion.undo.end(), result.begin() + text_start, result.end());
+    history_head_ = (history_head_ + 1) % HISTORY_SIZE;
+    if (history_count_ < HISTORY_SIZE) ++history_count_;
+    layout_ = target;
+
+    TRACE2(converter_plan, (int) action, result.size());
 }
 
-// Returns readable buffer.
-std::string Converter::get_buffer_dump() const {
-    if (buffer_.empty()) return "(empty)";
+// A word trigger repeated soon after the last one widens that conversion by the word before it.
+// The cursor moves over the text converted already, so only the new word is erased and replayed,
+// in the layout the last conversion switched to. False if there is nothing to widen.
+bool Converter::expand(long long trigger_us, std::vector<KeyEvent> &result) {
+    if (expand_window <= 0 || trigger_us == 0 || !can_undo()) return false;
 
-    std::string out;
-    for (const auto &ev: buffer_) {
-        std::string state;
-        switch (ev.value) {
-            case K_DOWN: state = "DOWN";
-                break;
-            case K_UP: state = "UP";
-                break;
-            case K_REPEAT: state = "REPEAT";
-                break;
-            default: state = std::to_string(ev.value);
-                break;
+    const Conversion &last = history_[(history_head_ + HISTORY_SIZE - 1) % HISTORY_SIZE];
+    if (last.trigger_us == 0 || trigger_us - last.trigger_us > expand_window * 1000LL) return false;
+
+    // the word before the scope of the last conversion, on the same line
+    size_t i = last.start;
+    while (i > 0 && is_word_end(buffer_[i - 1].code) && !is_line_end(buffer_[i - 1].code)) {
+        --i;
+    }
+    size_t end = i;
+    while (i > 0 && !is_word_end(buffer_[i - 1].code)) {
+        --i;
+    }
+    size_t start = i;
+    if (start == end) return false;
+
+    size_t cursor = buffer_.cursor();
+    size_t moves = 0;
+    for (i = end; i < cursor; ++i) {
+        if (!is_shift(buffer_[i].code)) ++moves;
+    }
+
+    for (i = 0; i < moves; ++i) {
+        result.push_back({KEY_LEFT, K_DOWN, 0});
+        result.push_back({KEY_LEFT, K_UP, 0});
+    }
+    for (i = start; i < end; ++i) {
+        if (!is_shift(buffer_[i].code)) {
+            result.push_back({KEY_BACKSPACE, K_DOWN, 0});
+            result.push_back({KEY_BACKSPACE, K_UP, 0});
+        }
+    }
+    size_t replay_start = result.size();
+    for (i = start; i < end; ++i) {
+        result.push_back(buffer_[i]);
+        if (!is_shift(buffer_[i].code)) {
+            result.push_back({buffer_[i].code, K_UP, 0});
         }
+    }
+    size_t replay_end = result.size();
+    for (i = 0; i < moves; ++i) {
+        result.push_back({KEY_RIGHT, K_DOWN, 0});
+        result.push_back({KEY_RIGHT, K_UP, 0});
+    }
+
+    // the undo replays the word in the layout it was typed in and switches back
+    size_t count = layout_count();
+    size_t back = (last.source + count - layout_) % count;
+    Conversion &conversion = history_[history_head_];
+    conversion.source = last.source;
+    conversion.start = start;
+    conversion.end = buffer_.size();
+    conversion.edits = edits_;
+    conversion.layout = layout_;
+    conversion.trigger_us = trigger_us;
+    conversion.undo.assign(result.begin(), result.begin() + replay_start);
+    switch_layout(back, conversion.undo);
+    conversion.undo.insert(conversion.undo.end(), result.begin() + replay_start, result.begin() + replay_end);
+    switch_layout((count - back) % count, conversion.undo);
+    conversion.undo.insert(conversion.undo.end(), result.begin() + replay_end, result.end());
+    history_head_ = (history_head_ + 1) % HISTORY_SIZE;
+    if (history_count_ < HISTORY_SIZE) ++history_count_;
+    return true;
+}
+
+// Appends `steps` presses of the system layout switch.
+void Converter::switch_layout(size_t steps, std::vector<KeyEvent> &result) const {
+    for (size_t i = 0; i < steps; ++i) {
+        result.push_back({ls_keys[0], K_DOWN, 0});
+        if (ls_keys[1] != 0) {
+            result.push_back({ls_keys[1], K_DOWN, 0});
+            result.push_back({ls_keys[1], K_UP, 0});
+        }
+        result.push_back({ls_keys[0], K_UP, 0});
+    }
+}
+
+// Follows the layout switches the user makes, so conversions count switches from the right layout.
+void Converter::track_layout_switch(int code, int value) {
+    if (ls_keys[0] == 0 || is_repeat(value)) return;
 
-        std::string item;
+    if (ls_keys[1] == 0) {
+        if (code == ls_keys[0] && is_down(value)) layout_ = (layout_ + 1) % layout_count();
+    } else if (code == ls_keys[0]) {
+        ls_held_ = is_down(value);
+    } else if (code == ls_keys[1] && is_down(value) && ls_held_) {
+        layout_ = (layout_ + 1) % layout_count();
+    }
+}
+
+size_t Converter::layout_count() const {
+    return layouts.count() > 1 ? layouts.count() : 2;
+}
+
+size_t Converter::get_layout() const {
+    return layout_;
+}
+
+// Appends readable buffer to `out`, '|' marks the cursor when it isn't at the end.
+void Converter::get_buffer_dump(std::string &out) const {
+    if (buffer_.empty()) {
+        out += "(empty)";
+        return;
+    }
+
+    for (size_t i = 0; i < buffer_.size(); ++i) {
+        if (i == buffer_.cursor()) out += "| ";
+
+        const KeyEvent &ev = buffer_[i];
         if (const char *keyname = libevdev_event_code_get_name(EV_KEY, ev.code)) {
-            item = keyname;
-            if (item.rfind("KEY_", 0) == 0) {
-                item = item.substr(4);
-            }
+            out += strncmp(keyname, "KEY_", 4) == 0 ? keyname + 4 : keyname;
         } else {
-            item = std::to_string(ev.code);
+            out += std::to_string(ev.code);
         }
 
-        if (is_shift(ev.code) || ev.code == conv_key) {
-            item += "_" + state;
+        if (is_shift(ev.code) || ev.code == conv_key || ev.code == undo_key) {
+            switch (ev.value) {
+                case K_DOWN: out += "_DOWN";
+                    break;
+                case K_UP: out += "_UP";
+                    break;
+                case K_REPEAT: out += "_REPEAT";
+                    break;
+                default: out += "_" + std::to_string(ev.value);
+                    break;
+            }
         }
 
-        out += item + " ";
+        out += ' ';
     }
-
-    return out;
 }
 
 
 void Converter::clear_buffer() {
     buffer_.clear();
+    ++edits_;
+    word_reset();
+}
+
+void Converter::save(ConverterState &state) const {
+    state.layout = layout_;
+    state.cursor = buffer_.cursor();
+    state.size = buffer_.size();
+    for (size_t i = 0; i < buffer_.size(); ++i) {
+        state.events[i] = buffer_[i];
+    }
+}
+
+void Converter::restore(const ConverterState &state) {
+    clear_buffer();
+    history_count_ = 0;
+    shifts_held_ = 0;
+    ls_held_ = false;
+    layout_ = state.layout < layout_count() ? state.layout : 0;
+
+    size_t size = state.size < BUFFER_SIZE ? state.size : BUFFER_SIZE;
+    for (size_t i = 0; i < size; ++i) {
+        buffer_.insert(state.events[i]);
+    }
+    buffer_.move_cursor(state.cursor < size ? state.cursor : size);
+}
+
+// Keys of the keymap extend the word, others end it.
+void Converter::word_push(int code) {
+    if (!auto_convert || !layouts.has_models()) return;
+
+    int key = layouts.get_key(code);
+    if (key == NgramModel::BOUNDARY) {
+        word_end();
+        return;
+    }
+    if (word_lost_) return;
+    if (word_size_ == WORD_SIZE) {
+        word_lost_ = true;
+        return;
+    }
+
+    int a = word_size_ >= 2 ? word_keys_[word_size_ - 2] : NgramModel::BOUNDARY;
+    int b = word_size_ >= 1 ? word_keys_[word_size_ - 1] : NgramModel::BOUNDARY;
+    for (size_t layout = 0; layout < layouts.count(); ++layout) {
+        word_scores_[word_size_ + 1][layout] = word_scores_[word_size_][layout] + layouts.key_score(layout, a, b, key);
+    }
+    word_keys_[word_size_++] = key;
+}
+
+void Converter::word_pop() {
+    if (word_size_ > 0 && !word_lost_) --word_size_;
+}
+
+// Compares the finished word in the current layout with the others.
+void Converter::word_end() {
+    size_t size = word_size_;
+    bool lost = word_lost_;
+    word_reset();
+    if (lost || size < AUTO_MIN_KEYS || layout_ >= layouts.count()) return;
+
+    int a = word_keys_[size - 2];
+    int b = word_keys_[size - 1];
+    int current = word_scores_[size][layout_] + layouts.key_score(layout_, a, b, NgramModel::BOUNDARY);
+    for (size_t layout = 0; layout < layouts.count(); ++layout) {
+        if (layout == layout_) continue;
+        int score = word_scores_[size][layout] + layouts.key_score(layout, a, b, NgramModel::BOUNDARY);
+        if (score - current >= AUTO_MARGIN * (int) size) {
+            auto_pending_ = true;
+            return;
+        }
+    }
 }
 
+void Converter::word_reset() {
+    word_size_ = 0;
+    word_lost_ = false;
+}
+
+// The last conversion can be undone while its text is at the end of the buffer and unchanged.
+bool Converter::can_undo() const {
+    if (history_count_ == 0) return false;
+    const Conversion &last = history_[(history_head_ + HISTORY_SIZE - 1) % HISTORY_SIZE];
+    return last.edits == edits_ && last.end <= buffer_.size();
+}
+
+
 bool Converter::is_key(int code) const {
-    return Keys.count(code) != 0;
+    return KeyClasses.has(code, ClassKey);
 }
 
 bool Converter::is_shift(int code) const {
-    return Shifts.count(code) != 0;
+    return KeyClasses.has(code, ClassShift);
 }
 
 bool Converter::is_backspace(int code) const {
@@ -341,7 +753,19 @@ bool Converter::is_backspace(int code) const {
 }
 
 bool Converter::is_killer(int code) const {
-    return BufKillers.count(code) != 0;
+    return KeyClasses.has(code, ClassKiller);
+}
+
+bool Converter::is_cursor_key(int code) const {
+    return KeyClasses.has(code, ClassCursor);
+}
+
+bool Converter::is_word_end(int code) const {
+    return code == KEY_SPACE || is_line_end(code);
+}
+
+bool Converter::is_line_end(int code) const {
+    return code == KEY_ENTER || code == KEY_KPENTER;
 }
 
 bool Converter::is_up(int value) const {
@@ -362,13 +786,13 @@ bool Converter::is_repeat(int value) const {
 //   - ev.value : key state to match (K_DOWN, K_UP, etc.)
 //   - condition: expected match result (true if the event should match, false if it should *not* match)
 //
-// The function compares the last `pattern.size()` events in the buffer with the pattern.
+// The function compares the last `size` events in the buffer with the pattern.
 // Returns true only if all events match their corresponding pattern entries according to `condition`.
-bool Converter::buffer_matches_pattern(const std::vector<Pattern> &pattern) const {
-    if (buffer_.size() < pattern.size()) return false;
+bool Converter::buffer_matches_pattern(const Pattern *pattern, size_t size) const {
+    if (buffer_.cursor() < size) return false;
 
-    for (size_t i = 0; i < pattern.size(); ++i) {
-        const auto &ev = buffer_[buffer_.size() - pattern.size() + i];
+    for (size_t i = 0; i < size; ++i) {
+        const auto &ev = buffer_[buffer_.cursor() - size + i];
         const auto &p = pattern[i];
         if (((p.ev.code == ANY_SHIFT ? is_shift(ev.code) : ev.code == p.ev.code)
              && ev.value == p.ev.value) != p.condition) {
@@ -378,15 +802,79 @@ bool Converter::buffer_matches_pattern(const std::vector<Pattern> &pattern) cons
     return true;
 }
 
-// Removes trailing non-key events from the buffer,
+// Timed events of the pattern that must be there follow each other within the trigger window,
+// unless their times are unknown. A shift held around the taps isn't timed.
+bool Converter::pattern_in_window(const Pattern *pattern, size_t size) const {
+    if (trigger_window <= 0) return true;
+
+    long long window_us = trigger_window * 1000LL;
+    long long previous = 0;
+    for (size_t i = 0; i < size; ++i) {
+        if (!pattern[i].condition || !pattern[i].timed) continue;
+        long long time = buffer_[buffer_.cursor() - size + i].time_us;
+        if (previous != 0 && time != 0 && time - previous > window_us) return false;
+        previous = time;
+    }
+    return true;
+}
+
+// Removes non-key events right before the cursor,
 // but preserves a Shift release if it follows a regular key.
 void Converter::trim_buffer() {
-    while (!buffer_.empty() && !is_key(buffer_.back().code)) {
-        if (is_shift(buffer_.back().code) && is_up(buffer_.back().value)) {
-            if (buffer_.size() > 1 && is_key(buffer_[buffer_.size() - 2].code)) {
+    size_t cursor;
+    while ((cursor = buffer_.cursor()) > 0 && !is_key(buffer_[cursor - 1].code)) {
+        if (is_shift(buffer_[cursor - 1].code) && is_up(buffer_[cursor - 1].value)) {
+            if (cursor > 1 && is_key(buffer_[cursor - 2].code)) {
                 break;
             }
         }
-        buffer_.pop_back();
+        buffer_.erase_before();
     }
 }
+
+void Converter::erase_before_cursor(size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        buffer_.erase_before();
+    }
+}
+
+// Moves the cursor like the cursor key does in a text field.
+// A key is passed together with the shift presses before it and the shift releases after it,
+// so that text inserted next to it doesn't change case.
+// Returns false if the cursor leaves the text the buffer knows.
+bool Converter::move_cursor(int code) {
+    size_t pos = buffer_.cursor();
+    size_t size = buffer_.size();
+
+    switch (code) {
+        case KEY_LEFT:
+            while (pos > 0 && !is_key(buffer_[pos - 1].code)) --pos;
+            if (pos == 0) return false;
+            --pos;
+            while (pos > 0 && !is_key(buffer_[pos - 1].code) && is_down(buffer_[pos - 1].value)) --pos;
+            break;
+
+        case KEY_RIGHT:
+            while (pos < size && !is_key(buffer_[pos].code)) ++pos;
+            if (pos == size) return false;
+            ++pos;
+            while (pos < size && !is_key(buffer_[pos].code) && is_up(buffer_[pos].value)) ++pos;
+            break;
+
+        case KEY_HOME:
+            // the line may start before the buffer
+            while (pos > 0 && !is_line_end(buffer_[pos - 1].code)) --pos;
+            if (pos == 0) return false;
+            break;
+
+        case KEY_END:
+            while (pos < size && !is_line_end(buffer_[pos].code)) ++pos;
+            break;
+
+        default:
+            return false;
+    }
+
+    buffer_.move_cursor(pos);
+    return true;
+}
@@ -1,47 +1,117 @@
 #pragma once
 
+#include "GapBuffer.h"
+#include "Layouts.h"
+
+#include <cstdint>
 #include <vector>
 #include <string>
+#include <linux/input-event-codes.h>
 
 struct KeyEvent {
     int code;
     int value;
+    long long time_us; // kernel timestamp of typed events, 0 when unknown and in plans
 };
 
 struct Pattern {
     KeyEvent ev;
     bool condition;
+    bool timed; // part of the taps that must follow each other within the trigger window
 
-    Pattern(int code, int value, bool cond) : ev{code, value}, condition(cond) {
+    Pattern(int code, int value, bool cond, bool in_window = true) : ev{code, value, 0}, condition(cond),
+                                                                   timed(in_window) {
     }
 };
 
 enum Action {
     None,
     ConvertWord,
-    ConvertAll
+    ConvertAll,
+    Undo
 };
 
 
+// Maximum number of events kept in the history.
+// When it's full, the older half is dropped, so the history never reallocates.
+const size_t BUFFER_SIZE = 4096;
+
+// Maximum number of events convert() can produce: layout switches, then per event
+// a backspace or delete press/release, a replayed press/release and a cursor move back.
+const size_t PLAN_SIZE = 4 * (MAX_LAYOUTS - 1) + BUFFER_SIZE * 6;
+
+// Number of recent conversions that can be undone.
+const size_t HISTORY_SIZE = 8;
+
+// Longest word scored for automatic conversion, in keys.
+const size_t WORD_SIZE = 32;
+
+// Double taps of shift are well within this, a shift tapped again seconds later isn't a trigger.
+const int DEFAULT_TRIGGER_WINDOW = 500;
+
+// Expanding is opt-in: by default a quick second trigger converts the same word back.
+const int DEFAULT_EXPAND_WINDOW = 0;
+
+// A conversion that can be undone while the text it produced is still intact.
+struct Conversion {
+    size_t start;                 // first converted event in the buffer
+    size_t end;                   // buffer size right after the conversion
+    unsigned long edits;          // text edits counter at the time of conversion
+    size_t layout;                // layout before the conversion
+    size_t source;                // layout the text was typed in, before the first of expanded conversions
+    long long trigger_us;         // time of the word trigger, 0 for other conversions
+    std::vector<KeyEvent> undo;   // precomputed plan that restores the original text
+};
+
+// Typed text and layout carried over a restart, see Handoff.
+struct ConverterState {
+    uint32_t layout;
+    uint32_t cursor;
+    uint32_t size;
+    KeyEvent events[BUFFER_SIZE];
+};
+
 class Converter {
 public:
     int conv_key;
+    int undo_key;
     int ls_keys[2];
+    Layouts layouts; // two layouts without keymaps when none are loaded
+    bool auto_convert; // convert words on their own at word boundaries, needs n-gram models
+    int trigger_window; // ms, longest gap between the events of a double-shift trigger, 0 for any
+    int expand_window; // ms, a word trigger this soon after the last one also converts the word before, 0 never
 
     Converter();
 
     ~Converter();
 
-    bool push(int code, int value);
+    bool push(int code, int value, long long time_us = 0);
+
+    // Pushes events in order and processes the buffer after each one that changes it,
+    // up to the first action, which is returned with `consumed` set past its event.
+    // Events push() would ignore are skipped with a table lookup, without a call into it.
+    Action push_batch(const KeyEvent *events, size_t count, size_t &consumed);
 
     Action process();
 
-    std::vector<KeyEvent> convert(Action action) const;
+    void convert(Action action, std::vector<KeyEvent> &result);
 
-    std::string get_buffer_dump() const;
+    void get_buffer_dump(std::string &out) const;
 
     void clear_buffer();
 
+    void save(ConverterState &state) const;
+
+    // Conversions made before the restart can't be undone after it.
+    void restore(const ConverterState &state);
+
+    // Index of the active layout, assuming the first one was active at startup.
+    size_t get_layout() const;
+
+    size_t get_buffer_size() const { return buffer_.size(); }
+
+    size_t get_cursor() const { return buffer_.cursor(); }
+
     bool is_key(int code) const;
 
     bool is_shift(int code) const;
@@ -50,6 +120,12 @@ public:
 
     bool is_killer(int code) const;
 
+    bool is_cursor_key(int code) const;
+
+    bool is_word_end(int code) const;
+
+    bool is_line_end(int code) const;
+
     bool is_up(int value) const;
 
     bool is_down(int value) const;
@@ -57,9 +133,73 @@ public:
     bool is_repeat(int value) const;
 
 private:
-    std::vector<KeyEvent> buffer_;
+    Action match();
+
+    // typed events around the text cursor, which follows the cursor keys
+    GapBuffer<KeyEvent> buffer_;
+    std::vector<KeyEvent> text_; // copy of the converted text, for scoring
+    int shifts_held_;
 
-    bool buffer_matches_pattern(const std::vector<Pattern> &pattern) const;
+    // conversions ring, the most recent one is at history_head_ - 1
+    Conversion history_[HISTORY_SIZE];
+    size_t history_head_;
+    size_t history_count_;
+    unsigned long edits_; // changes of the typed text, shifts and triggers don't count
+
+    size_t layout_;
+    bool ls_held_; // first key of the layout switch combination is down
+
+    // the word being typed and the model scores of its prefixes in each layout,
+    // kept as it is typed so that every key costs the same
+    int word_keys_[WORD_SIZE];
+    int word_scores_[WORD_SIZE + 1][MAX_LAYOUTS];
+    size_t word_size_;
+    bool word_lost_; // too long or edited away from its end, so it isn't scored
+    bool auto_pending_; // the word just ended is more likely in another layout
+    long long trigger_us_; // time of the word trigger matched last, taken by convert()
+
+    // per key code, whether push() ignores it when released and whether it ignores it at all
+    uint8_t passive_[KEY_CNT];
+    int passive_keys_[4]; // convert, undo and layout switch keys the table was built for
+
+    void update_passive();
+
+    void word_push(int code);
+
+    void word_pop();
+
+    void word_end();
+
+    void word_reset();
+
+    bool move_cursor(int code);
+
+    void erase_before_cursor(size_t count);
+
+    size_t layout_count() const;
+
+    void switch_layout(size_t steps, std::vector<KeyEvent> &result) const;
+
+    void track_layout_switch(int code, int value);
+
+    bool can_undo() const;
+
+    bool expand(long long trigger_us, std::vector<KeyEvent> &result);
+
+    bool buffer_matches_pattern(const Pattern *pattern, size_t size) const;
+
+    template<size_t N>
+    bool buffer_matches_pattern(const Pattern (&pattern)[N]) const {
+        return buffer_matches_pattern(pattern, N);
+    }
+
+    bool pattern_in_window(const Pattern *pattern, size_t size) const;
+
+    // The pattern matches and its events were typed in quick succession.
+    template<size_t N>
+    bool buffer_matches_trigger(const Pattern (&pattern)[N]) const {
+        return buffer_matches_pattern(pattern, N) && pattern_in_window(pattern, N);
+    }
 
     void trim_buffer();
 };
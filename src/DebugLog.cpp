@@ -0,0 +1,188 @@
+#include "DebugLog.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+
+// How often the writer thread drains the ring.
+static const int DRAIN_INTERVAL_MS = 20;
+
+static int64_t now_us() {
+    timespec now{};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+DebugLog::DebugLog() = default;
+
+DebugLog::~DebugLog() {
+    close();
+}
+
+bool DebugLog::open(const std::string &path) {
+    err.clear();
+
+    // appended to, so the records leading up to a restart are kept; each start adds a header
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ == -1) {
+        err = "Failed to open debug log " + path + ": " + std::string(strerror(errno));
+        return false;
+    }
+
+    stop_ = false;
+    writer_ = std::thread(&DebugLog::write_loop, this);
+    return true;
+}
+
+// Writes out everything logged so far and closes the file.
+void DebugLog::close() {
+    if (fd_ == -1) return;
+
+    stop_ = true;
+    if (writer_.joinable()) writer_.join();
+    if (dropped_ > 0) {
+        LogRecord marker = dropped_marker();
+        write_all(&marker, sizeof(marker));
+    }
+    ::close(fd_);
+    fd_ = -1;
+}
+
+void DebugLog::header(int conv_key, int undo_key, const int ls_keys[2]) {
+    LogRecord record{};
+    record.time_us = now_us();
+    record.type = LogHeader;
+    record.code = conv_key;
+    record.value = undo_key;
+    record.fd = ls_keys[0];
+    record.size = ls_keys[1];
+    strncpy(record.text, LOG_MAGIC, sizeof(record.text) - 1);
+    push(record);
+}
+
+void DebugLog::layouts(const std::string &list, bool auto_convert) {
+    LogRecord record{};
+    record.time_us = now_us();
+    record.type = LogLayouts;
+    record.value = auto_convert;
+    strncpy(record.text, list.c_str(), sizeof(record.text) - 1);
+    push(record);
+}
+
+void DebugLog::triggers(int window, int expand_window) {
+    LogRecord record{};
+    record.time_us = now_us();
+    record.type = LogTriggers;
+    record.value = window;
+    record.size = expand_window;
+    push(record);
+}
+
+void DebugLog::device(int fd, const std::string &name) {
+    LogRecord record{};
+    record.time_us = now_us();
+    record.type = LogDevice;
+    record.fd = fd;
+    strncpy(record.text, name.c_str(), sizeof(record.text) - 1);
+    push(record);
+}
+
+void DebugLog::removed(int fd) {
+    LogRecord record{};
+    record.time_us = now_us();
+    record.type = LogRemoved;
+    record.fd = fd;
+    push(record);
+}
+
+void DebugLog::input(int fd, const input_event &ev) {
+    LogRecord record{};
+    record.time_us = ev.time.tv_sec * 1000000LL + ev.time.tv_usec;
+    record.type = LogInput;
+    record.code = ev.code;
+    record.value = ev.value;
+    record.fd = fd;
+    push(record);
+}
+
+void DebugLog::control(int command) {
+    LogRecord record{};
+    record.time_us = now_us();
+    record.type = LogControl;
+    record.code = command;
+    push(record);
+}
+
+void DebugLog::plan(int action, size_t size) {
+    LogRecord record{};
+    record.time_us = now_us();
+    record.type = LogPlan;
+    record.value = action;
+    record.size = size;
+    push(record);
+}
+
+// Never blocks: when the writer falls behind, records are counted as dropped.
+// Once there is room again, a LogDropped marker goes in first, where the lost records were.
+void DebugLog::push(const LogRecord &record) {
+    if (fd_ == -1) return;
+
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t room = RING_SIZE - (head - tail_.load(std::memory_order_acquire));
+    if (room < (dropped_ > 0 ? 2u : 1u)) {
+        if (dropped_++ == 0) dropped_us_ = record.time_us;
+        return;
+    }
+
+    if (dropped_ > 0) {
+        ring_[head++ & (RING_SIZE - 1)] = dropped_marker();
+        dropped_ = 0;
+    }
+    ring_[head & (RING_SIZE - 1)] = record;
+    head_.store(head + 1, std::memory_order_release);
+}
+
+LogRecord DebugLog::dropped_marker() const {
+    LogRecord record{};
+    record.time_us = dropped_us_;
+    record.type = LogDropped;
+    record.size = dropped_;
+    return record;
+}
+
+void DebugLog::write_loop() {
+    while (!stop_.load()) {
+        drain();
+        usleep(DRAIN_INTERVAL_MS * 1000);
+    }
+    drain();
+}
+
+void DebugLog::drain() {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    size_t head = head_.load(std::memory_order_acquire);
+
+    // the ring wraps at most once, so it's written in up to two parts
+    while (tail != head) {
+        size_t start = tail & (RING_SIZE - 1);
+        size_t count = std::min(head - tail, RING_SIZE - start);
+        write_all(&ring_[start], count * sizeof(LogRecord));
+        tail += count;
+        tail_.store(tail, std::memory_order_release);
+    }
+}
+
+// Short writes are continued, a record cut in the middle would shift all the following ones.
+void DebugLog::write_all(const void *data, size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    while (size > 0) {
+        ssize_t len = write(fd_, bytes, size);
+        if (len == -1 && errno == EINTR) continue;
+        if (len <= 0) return;
+        bytes += len;
+        size -= len;
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <linux/input.h>
+
+// First record of every log, and of every start of the daemon appended to it; its text holds LOG_MAGIC.
+#define LOG_MAGIC "easy-switcher log 1"
+
+enum LogType : uint16_t {
+    LogHeader,  // code: convert key, value: undo key, fd and size: layout switch keys
+    LogDevice,  // device added, text: its name
+    LogRemoved, // device removed
+    LogInput,   // key event taken from a device, before it is given to the converter
+    LogPlan,    // value: action, size: number of output events
+    LogDropped, // size: number of records lost because the ring was full
+    LogLayouts, // text: the 'layouts' setting, value: auto-convert, follows the header when it is set
+    LogControl, // code: command of the control socket, other than a state query
+    LogTriggers // value: trigger window, size: expand window, in ms, follows the header, logs without it had none
+};
+
+// Fixed-size record, written to the file as is.
+struct LogRecord {
+    int64_t time_us; // CLOCK_MONOTONIC, kernel timestamp for input events
+    uint16_t type;
+    uint16_t code;
+    int32_t value;
+    int32_t fd;
+    uint32_t size;
+    char text[40];
+};
+
+// Binary debug log. The input thread only copies records into a lock-free ring,
+// a background thread drains it to the file, so logging doesn't change the timing.
+// Key names and buffer dumps are rendered later by easy-switcher --decode-log.
+class DebugLog {
+public:
+    static const size_t RING_SIZE = 4096; // records, power of two
+
+    std::string err;
+
+    DebugLog();
+
+    ~DebugLog();
+
+    bool open(const std::string &path);
+
+    void close();
+
+    bool enabled() const { return fd_ != -1; }
+
+    void header(int conv_key, int undo_key, const int ls_keys[2]);
+
+    void layouts(const std::string &list, bool auto_convert);
+
+    void triggers(int window, int expand_window);
+
+    void device(int fd, const std::string &name);
+
+    void removed(int fd);
+
+    void input(int fd, const input_event &ev);
+
+    void control(int command);
+
+    void plan(int action, size_t size);
+
+private:
+    int fd_ = -1;
+
+    // single producer (input thread), single consumer (writer thread)
+    LogRecord ring_[RING_SIZE];
+    std::atomic<size_t> head_{0};
+    std::atomic<size_t> tail_{0};
+    unsigned long dropped_ = 0; // records lost since the ring was full, owned by the producer
+    int64_t dropped_us_ = 0;    // time of the first of them
+    std::atomic<bool> stop_{false};
+    std::thread writer_;
+
+    void push(const LogRecord &record);
+
+    LogRecord dropped_marker() const;
+
+    void write_loop();
+
+    void drain();
+
+    void write_all(const void *data, size_t size);
+};
@@ -1,86 +1,47 @@
 #include "DeviceManager.h"
+#include "SystemBackend.h"
 
-#include <cstring>
-#include <dirent.h>
-#include <unistd.h>
-#include <sys/inotify.h>
+#include <algorithm>
+
+static const long long PARKED = -1;     // retries exhausted, waits for IN_ATTRIB
+static const long long HANDED_OUT = -2; // returned by fetch(), waits for a retry() or is done
 
 DeviceManager::DeviceManager()
-    : inotify_fd_(-1) {
+    : hotplug(&system_hotplug()), clock(&system_clock()) {
 }
 
 DeviceManager::~DeviceManager() {
-    if (inotify_fd_ != -1) {
-        close(inotify_fd_);
-    }
     while (!events_.empty()) events_.pop();
 }
 
 int DeviceManager::init() {
     err.clear();
 
-    inotify_fd_ = inotify_init1(IN_NONBLOCK);
-    if (inotify_fd_ == -1) {
-        err = "Failed to initialize inotify: " + std::string(strerror(errno));
-        return -1;
-    }
-
-
-    int wd = inotify_add_watch(inotify_fd_, INPUT_DEVICE_DIR.c_str(), IN_CREATE | IN_DELETE);
-    if (wd == -1) {
-        err = "Failed to add inotify watch on " + INPUT_DEVICE_DIR + ": " + std::string(strerror(errno));
-        close(inotify_fd_);
-        inotify_fd_ = -1;
-        return -1;
-    }
-
-    DIR *dir = opendir(INPUT_DEVICE_DIR.c_str());
-    if (!dir) {
-        err = "Failed to open input devices directory " + INPUT_DEVICE_DIR + ": " + std::string(strerror(errno));
-        return -1;
-    }
+    int fd = hotplug->init(err);
+    if (fd == -1) return -1;
 
-    dirent *entry;
-    while ((entry = readdir(dir)) != nullptr) {
-        std::string name(entry->d_name);
-        if (name.find("event") != 0) continue;
+    std::vector<std::string> paths;
+    if (!hotplug->list(paths, err)) return -1;
 
-        std::string path = INPUT_DEVICE_DIR + name;
+    for (const auto &path: paths) {
         bool connected = true;
-
         events_.emplace(connected, path);
     }
-    closedir(dir);
 
-    return inotify_fd_;
+    return fd;
+}
+
+// Returns the descriptor of the timer that fires when delayed probes are due.
+// It must be watched together with the descriptor returned by init().
+int DeviceManager::get_timer_fd() const {
+    return hotplug->get_timer_fd();
 }
 
 bool DeviceManager::fetch(std::string &path, bool &connected) {
     err.clear();
 
     if (events_.empty()) {
-        alignas(inotify_event) char buf[4096];
-        ssize_t len = read(inotify_fd_, buf, sizeof(buf));
-        if (len <= 0) {
-            // No events available, just ignore
-            return false;
-        }
-
-        for (char *ptr = buf; ptr < buf + len;) {
-            auto *event = (struct inotify_event *) ptr;
-            bool is_created = (event->mask & IN_CREATE) != 0;
-            bool is_deleted = (event->mask & IN_DELETE) != 0;
-            if ((is_created || is_deleted) &&
-                !(event->mask & IN_ISDIR) &&
-                event->len > 0 &&
-                std::string(event->name).find("event") == 0)
-            {
-                std::string name = INPUT_DEVICE_DIR + event->name;
-                events_.emplace(is_created, name);
-            }
-
-            ptr += sizeof(struct inotify_event) + event->len;
-        }
+        update();
     }
 
     if (!events_.empty()) {
@@ -94,6 +55,106 @@ bool DeviceManager::fetch(std::string &path, bool &connected) {
     return false;
 }
 
+// Probe the node again later, after it failed to open.
+// Returns false when retries are exhausted; the node is probed again only on IN_ATTRIB then.
+bool DeviceManager::retry(const std::string &path) {
+    for (auto &probe: probes_) {
+        if (probe.path == path) {
+            ++probe.attempts;
+            if (probe.attempts > MAX_RETRIES) {
+                probe.due_ms = PARKED;
+                arm_timer();
+                return false;
+            }
+            probe.due_ms = now_ms() + ((long long) RETRY_MS << (probe.attempts - 1));
+            arm_timer();
+            return true;
+        }
+    }
+
+    probes_.push_back({path, 1, now_ms() + RETRY_MS, 0});
+    arm_timer();
+    return true;
+}
+
 bool DeviceManager::empty() {
     return events_.empty();
 }
+
+// Collect new inotify events and move probes that are due to the events queue.
+// Called only when the queue is empty, so every probe handed out before has been tried by then.
+void DeviceManager::update() {
+    // probes handed out last time and not retried have succeeded or were rejected
+    for (size_t i = 0; i < probes_.size();) {
+        if (probes_[i].due_ms == HANDED_OUT) {
+            probes_.erase(probes_.begin() + i);
+        } else {
+            ++i;
+        }
+    }
+
+    NodeChange change;
+    std::string path;
+    while (hotplug->next(change, path)) {
+        if (change == NodeDeleted) {
+            bool pending = false;
+            for (size_t i = 0; i < probes_.size(); ++i) {
+                if (probes_[i].path == path) {
+                    probes_.erase(probes_.begin() + i);
+                    pending = true;
+                    break;
+                }
+            }
+            // a node that was never opened needs no removal
+            if (!pending) events_.emplace(false, path);
+        } else if (change == NodeCreated) {
+            schedule(path, now_ms(), false);
+        } else {
+            schedule(path, now_ms(), true);
+        }
+    }
+
+    // all due probes are handed out at once, as one batch
+    long long now = now_ms();
+    for (auto &probe: probes_) {
+        if (probe.due_ms >= 0 && probe.due_ms <= now) {
+            events_.emplace(true, probe.path);
+            // keep the attempts counter in case the caller asks for a retry
+            probe.due_ms = HANDED_OUT;
+        }
+    }
+
+    arm_timer();
+}
+
+// New nodes are always probed, and each of them restarts the debounce window of the other
+// new nodes, so a storm of nodes is probed together once it calms down, or at the deadline
+// of its first node if it doesn't.
+// IN_ATTRIB only speeds up nodes that are waiting for a retry.
+void DeviceManager::schedule(const std::string &path, long long now, bool attrib) {
+    long long due_ms = now + DEBOUNCE_MS;
+    bool found = false;
+    for (auto &probe: probes_) {
+        if (probe.path == path) {
+            if (probe.due_ms == PARKED || probe.due_ms > due_ms) probe.due_ms = due_ms;
+            found = true;
+        } else if (!attrib && probe.attempts == 0 && probe.due_ms >= 0) {
+            probe.due_ms = std::min(due_ms, probe.deadline_ms);
+        }
+    }
+
+    if (!found && !attrib) probes_.push_back({path, 0, due_ms, now + MAX_DEBOUNCE_MS});
+}
+
+long long DeviceManager::now_ms() {
+    return clock->now_us() / 1000;
+}
+
+void DeviceManager::arm_timer() {
+    long long next = -1;
+    for (const auto &probe: probes_) {
+        if (probe.due_ms >= 0 && (next == -1 || probe.due_ms < next)) next = probe.due_ms;
+    }
+
+    hotplug->set_timer(next != -1 ? next - now_ms() : -1);
+}
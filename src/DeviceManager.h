@@ -1,10 +1,21 @@
 #pragma once
 
+#include "Backend.h"
+
 #include <string>
 #include <queue>
+#include <vector>
 
 const std::string INPUT_DEVICE_DIR = "/dev/input/";
 
+// Newly created nodes are probed after a short debounce window, so a burst of hot-plug
+// events is handled in one batch, though never later than MAX_DEBOUNCE_MS after they appeared.
+// Nodes that fail to open are retried with backoff.
+const int DEBOUNCE_MS = 50;
+const int MAX_DEBOUNCE_MS = 500;
+const int RETRY_MS = 100;
+const int MAX_RETRIES = 5;
+
 class DeviceManager {
 public:
     DeviceManager();
@@ -13,13 +24,35 @@ public:
 
     std::string err;
 
+    HotplugBackend *hotplug;
+    Clock *clock;
+
     int init();
 
+    int get_timer_fd() const;
+
     bool fetch(std::string &path, bool &connected);
 
+    bool retry(const std::string &path);
+
     bool empty();
 
 private:
-    int inotify_fd_;
+    struct Probe {
+        std::string path;
+        int attempts;
+        long long due_ms;
+        long long deadline_ms; // latest due time of a new node, however long the burst goes on
+    };
+
     std::queue<std::pair<bool, std::string> > events_;
+    std::vector<Probe> probes_;
+
+    void update();
+
+    void schedule(const std::string &path, long long now, bool attrib);
+
+    long long now_ms();
+
+    void arm_timer();
 };
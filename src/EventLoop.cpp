@@ -20,13 +20,13 @@ EventLoop::~EventLoop() {
 bool EventLoop::init() {
     err.clear();
 
-    epoll_fd_ = epoll_create1(0);
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
     if (epoll_fd_ == -1) {
         err = "Failed to initialize loop: " + std::string(strerror(errno));
         return false;
     }
 
-    stop_command_fd_ = eventfd(0, EFD_NONBLOCK);
+    stop_command_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
     if (stop_command_fd_ == -1) {
         err = "Failed to create stop command: " + std::string(strerror(errno));
         close(epoll_fd_);
@@ -69,6 +69,12 @@ bool EventLoop::add_handler(int fd, Callback cb) {
         return false;
     }
 
+    if (fd == running_fd_) {
+        running_changed_ = true;
+        replacement_ = std::move(cb);
+        return true;
+    }
+    if ((size_t) fd >= callbacks_.size()) callbacks_.resize(fd + 1);
     callbacks_[fd] = std::move(cb);
     return true;
 }
@@ -76,7 +82,18 @@ bool EventLoop::add_handler(int fd, Callback cb) {
 void EventLoop::remove_handler(int fd) {
     if (epoll_fd_ == -1 || fd < 0) return;
     epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
-    callbacks_.erase(fd);
+    if (fd == running_fd_) {
+        running_changed_ = true;
+        replacement_ = nullptr;
+        return;
+    }
+    if ((size_t) fd < callbacks_.size()) callbacks_[fd] = nullptr;
+}
+
+// Set a callback invoked once per loop iteration,
+// after the handlers of all ready descriptors have run.
+void EventLoop::set_batch_handler(BatchCallback cb) {
+    batch_callback_ = std::move(cb);
 }
 
 bool EventLoop::run(int timeout_ms) {
@@ -112,11 +129,21 @@ bool EventLoop::run(int timeout_ms) {
                 break;
             }
 
-            auto it = callbacks_.find(fd);
-            if (it != callbacks_.end()) {
-                it->second(fd);
+            if ((size_t) fd < callbacks_.size() && callbacks_[fd]) {
+                running_fd_ = fd;
+                callbacks_[fd](fd);
+                running_fd_ = -1;
+                if (running_changed_) {
+                    running_changed_ = false;
+                    callbacks_[fd] = std::move(replacement_);
+                    replacement_ = nullptr;
+                }
             }
         }
+
+        if (!stop_ && batch_callback_) {
+            batch_callback_();
+        }
     }
 
     return true;
@@ -1,12 +1,13 @@
 #pragma once
 
+#include <deque>
 #include <functional>
-#include <unordered_map>
 #include <string>
 
 class EventLoop {
 public:
     using Callback = std::function<void(int)>;
+    using BatchCallback = std::function<void()>;
 
     EventLoop();
 
@@ -18,6 +19,8 @@ public:
 
     void remove_handler(int fd);
 
+    void set_batch_handler(BatchCallback cb);
+
     bool run(int timeout_ms = -1);
 
     void stop();
@@ -29,5 +32,14 @@ private:
     int stop_command_fd_ = -1;
     bool stop_ = false;
 
-    std::unordered_map<int, Callback> callbacks_;
+    // indexed by fd; a deque, so growing it when a handler adds descriptors
+    // leaves the callback that is running in place
+    std::deque<Callback> callbacks_;
+    BatchCallback batch_callback_;
+
+    // The running callback is called in place, so removing or replacing its own handler
+    // is deferred until it returns: `replacement_` is then stored in its slot.
+    int running_fd_ = -1;
+    bool running_changed_ = false;
+    Callback replacement_;
 };
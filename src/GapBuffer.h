@@ -0,0 +1,66 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+// Sequence with a cursor, stored around a gap at the cursor position.
+// Inserting and erasing at the cursor is O(1), moving the cursor costs the distance moved.
+// The capacity is fixed at construction, so it never allocates afterwards.
+template<typename T>
+class GapBuffer {
+public:
+    explicit GapBuffer(size_t capacity) : data_(capacity), gap_start_(0), gap_end_(capacity) {
+    }
+
+    size_t size() const { return gap_start_ + data_.size() - gap_end_; }
+
+    bool empty() const { return size() == 0; }
+
+    bool full() const { return gap_start_ == gap_end_; }
+
+    // Number of elements before the cursor.
+    size_t cursor() const { return gap_start_; }
+
+    const T &operator[](size_t i) const { return data_[i < gap_start_ ? i : i + gap_end_ - gap_start_]; }
+
+    // Inserts before the cursor, the buffer must not be full.
+    void insert(const T &value) { data_[gap_start_++] = value; }
+
+    // Erases the element before the cursor.
+    void erase_before() { --gap_start_; }
+
+    void erase(size_t i) {
+        if (i < gap_start_) {
+            std::move(data_.begin() + i + 1, data_.begin() + gap_start_, data_.begin() + i);
+            --gap_start_;
+        } else {
+            size_t p = i + gap_end_ - gap_start_;
+            std::move_backward(data_.begin() + gap_end_, data_.begin() + p, data_.begin() + p + 1);
+            ++gap_end_;
+        }
+    }
+
+    void move_cursor(size_t pos) {
+        while (gap_start_ > pos) data_[--gap_end_] = data_[--gap_start_];
+        while (gap_start_ < pos) data_[gap_start_++] = data_[gap_end_++];
+    }
+
+    // Drops the first `count` elements.
+    void erase_front(size_t count) {
+        size_t before = std::min(count, gap_start_);
+        std::move(data_.begin() + before, data_.begin() + gap_start_, data_.begin());
+        gap_start_ -= before;
+        gap_end_ += count - before;
+    }
+
+    void clear() {
+        gap_start_ = 0;
+        gap_end_ = data_.size();
+    }
+
+private:
+    std::vector<T> data_;
+    size_t gap_start_;
+    size_t gap_end_;
+};
@@ -0,0 +1,201 @@
+#include "Handoff.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+// Socket buffer taken by a queued message besides its data, an estimate on the safe side.
+static const size_t MESSAGE_OVERHEAD = 1024;
+
+// Bytes of a state that holds `size` events, the unused rest of the buffer isn't sent.
+static size_t state_size(uint32_t size) {
+    return offsetof(ConverterState, events) + size * sizeof(KeyEvent);
+}
+
+Handoff::~Handoff() {
+    close();
+}
+
+bool Handoff::send(int &resume_fd) {
+    err.clear();
+    close();
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1) {
+        err = "Failed to create handoff socket: " + std::string(strerror(errno));
+        return false;
+    }
+    send_fd_ = fds[0];
+    resume_fd_ = fds[1];
+
+    // Nobody reads before exec, so every message must fit in the send buffer at once, and the
+    // default one takes only about a hundred devices. SO_SNDBUFFORCE goes past net.core.wmem_max.
+    uint32_t used = std::min<uint32_t>(converter.size, BUFFER_SIZE);
+    int buffer_size = (devices.size() + 4) * (sizeof(Record) + MESSAGE_OVERHEAD) + state_size(used);
+    if (setsockopt(send_fd_, SOL_SOCKET, SO_SNDBUFFORCE, &buffer_size, sizeof(buffer_size)) == -1 &&
+        setsockopt(send_fd_, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size)) == -1) {
+        err = "Failed to size handoff socket: " + std::string(strerror(errno));
+        close();
+        return false;
+    }
+
+    // the size of the state tells a new image built with other limits that it can't take it
+    bool ok = send_record(RecordStart, sizeof(ConverterState), "", -1) &&
+              send_record(RecordOutput, output_extended, "", output_fd);
+    for (size_t i = 0; ok && i < devices.size(); ++i) {
+        ok = send_record(RecordDevice, devices[i].grabbed, devices[i].path, devices[i].fd);
+    }
+    ok = ok && send_record(RecordConverter, 0, "", -1, &converter, state_size(used)) &&
+         send_record(RecordEnd, 0, "", -1);
+    if (!ok) {
+        close();
+        return false;
+    }
+
+    // the sending end is closed by exec, so the new image sees the end of the messages
+    if (fcntl(resume_fd_, F_SETFD, 0) == -1) {
+        err = "Failed to pass handoff socket: " + std::string(strerror(errno));
+        close();
+        return false;
+    }
+    resume_fd = resume_fd_;
+    return true;
+}
+
+bool Handoff::send_record(RecordType type, uint32_t value, const std::string &path, int fd,
+                          const void *data, size_t size) {
+    Record record{};
+    memcpy(record.magic, HANDOFF_MAGIC, sizeof(record.magic));
+    record.type = type;
+    record.value = value;
+    snprintf(record.path, sizeof(record.path), "%s", path.c_str());
+
+    iovec iov[2] = {{&record, sizeof(record)}, {const_cast<void *>(data), size}};
+    msghdr msg{};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = data ? 2 : 1;
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    if (fd != -1) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    // never blocks, nobody reads the other end before exec; the buffer is sized to take everything
+    if (sendmsg(send_fd_, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+        err = "Failed to send handoff: " + std::string(strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool Handoff::receive(int fd) {
+    err.clear();
+    close();
+    resume_fd_ = fd;
+    received_ = true;
+
+    std::vector<char> buf(sizeof(Record) + sizeof(ConverterState));
+    bool started = false;
+    while (true) {
+        iovec iov{buf.data(), buf.size()};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t len = recvmsg(resume_fd_, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (len == -1 && errno == EINTR) continue;
+        if (len == -1) {
+            err = "Failed to receive handoff: " + std::string(strerror(errno));
+            return false;
+        }
+
+        int received = -1;
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&received, CMSG_DATA(cmsg), sizeof(int));
+        }
+
+        if (len == 0) {
+            err = "Handoff ended early";
+            return false;
+        }
+
+        Record record{};
+        if ((size_t) len < sizeof(record) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+            if (received != -1) ::close(received);
+            err = "Invalid handoff message";
+            return false;
+        }
+        memcpy(&record, buf.data(), sizeof(record));
+        record.path[sizeof(record.path) - 1] = '\0';
+
+        if (memcmp(record.magic, HANDOFF_MAGIC, sizeof(record.magic)) != 0 ||
+            (!started && (record.type != RecordStart || record.value != sizeof(ConverterState)))) {
+            if (received != -1) ::close(received);
+            err = "Handoff from an incompatible version";
+            return false;
+        }
+
+        switch (record.type) {
+            case RecordStart:
+                started = true;
+                break;
+            case RecordOutput:
+                output_fd = received;
+                output_extended = record.value != 0;
+                break;
+            case RecordDevice:
+                if (received != -1) devices.push_back({record.path, received, record.value != 0});
+                break;
+            case RecordConverter:
+                // only the events in use are sent, the rest of the buffer stays zeroed
+                if ((size_t) len >= sizeof(record) + state_size(0)) {
+                    uint32_t size;
+                    memcpy(&size, buf.data() + sizeof(record) + offsetof(ConverterState, size), sizeof(size));
+                    if (size <= BUFFER_SIZE && (size_t) len == sizeof(record) + state_size(size)) {
+                        converter = ConverterState{};
+                        memcpy(&converter, buf.data() + sizeof(record), state_size(size));
+                    }
+                }
+                break;
+            case RecordEnd:
+                ::close(resume_fd_);
+                resume_fd_ = -1;
+                return true;
+            default:
+                if (received != -1) ::close(received);
+                break;
+        }
+    }
+}
+
+void Handoff::close() {
+    if (send_fd_ != -1) ::close(send_fd_);
+    if (resume_fd_ != -1) ::close(resume_fd_);
+    send_fd_ = -1;
+    resume_fd_ = -1;
+
+    if (received_) {
+        if (output_fd != -1) ::close(output_fd);
+        for (const auto &device: devices) {
+            if (device.fd != -1) ::close(device.fd);
+        }
+        output_fd = -1;
+        devices.clear();
+        received_ = false;
+    }
+}
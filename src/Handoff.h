@@ -0,0 +1,71 @@
+#pragma once
+
+#include "Converter.h"
+
+#include <string>
+#include <vector>
+
+#define HANDOFF_MAGIC "ESHANDO1"
+
+struct HandoffDevice {
+    std::string path;
+    int fd;
+    bool grabbed;
+};
+
+// Open devices and typed text of a running daemon, handed over to a new image of it on restart,
+// so that restarts and upgrades don't close the keyboards: grabs stay, the virtual keyboard stays
+// the same device and keys typed meanwhile wait in the kernel.
+//
+// Everything is queued as messages on a Unix socket pair, descriptors as SCM_RIGHTS, before exec;
+// queued descriptors stay open on their own. The new image gets the other end and reads them back.
+class Handoff {
+public:
+    std::string err;
+
+    int output_fd = -1;
+    bool output_extended = false; // the virtual keyboard has the key codes above KEY_OK
+    std::vector<HandoffDevice> devices;
+    ConverterState converter{};
+
+    Handoff() = default;
+
+    Handoff(const Handoff &) = delete;
+
+    Handoff &operator=(const Handoff &) = delete;
+
+    ~Handoff();
+
+    // Queues the descriptors and the state above, `resume_fd` is the end to keep across exec.
+    bool send(int &resume_fd);
+
+    // Reads what the previous instance has sent, the descriptors are owned until adopted.
+    bool receive(int fd);
+
+    // Closes the sockets and the received descriptors that are still owned.
+    // Descriptors taken over by someone else must be set to -1 before.
+    void close();
+
+private:
+    enum RecordType : uint32_t {
+        RecordStart,
+        RecordOutput,
+        RecordDevice,
+        RecordConverter,
+        RecordEnd
+    };
+
+    struct Record {
+        char magic[8];
+        uint32_t type;
+        uint32_t value;
+        char path[64];
+    };
+
+    int send_fd_ = -1;
+    int resume_fd_ = -1;
+    bool received_ = false;
+
+    bool send_record(RecordType type, uint32_t value, const std::string &path, int fd,
+                     const void *data = nullptr, size_t size = 0);
+};
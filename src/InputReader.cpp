@@ -1,48 +1,52 @@
 #include "InputReader.h"
+#include "SystemBackend.h"
+#include "Trace.h"
 
-#include <fcntl.h>
-#include <unistd.h>
+#include <cerrno>
 #include <cstring>
 
-InputReader::InputReader() = default;
+// Returns N for /dev/input/eventN, -1 for any other path.
+static int node_number(const std::string &path) {
+    size_t pos = path.rfind("/event");
+    if (pos == std::string::npos || pos + 6 >= path.size() || path.size() - pos > 12) return -1;
+
+    int node = 0;
+    for (size_t i = pos + 6; i < path.size(); ++i) {
+        if (path[i] < '0' || path[i] > '9') return -1;
+        node = node * 10 + (path[i] - '0');
+    }
+    return node;
+}
+
+InputReader::InputReader() : input(&system_input()) {}
 
 InputReader::~InputReader() {
-    for (auto &entry: devices_) {
-        if (entry.second.dev) libevdev_free(entry.second.dev);
-        close(entry.first);
+    for (auto &device: slots_) {
+        if (device.fd != -1) input->close(device.fd);
     }
 }
 
 bool InputReader::init() {
     err.clear();
+    slots_.reserve(64);
+    ready_.reserve(64);
     return true;
 }
 
-std::string InputReader::make_device_uid(libevdev *dev) {
-    if (!dev) return "";
-
-    int bus = libevdev_get_id_bustype(dev);
-    int vendor = libevdev_get_id_vendor(dev);
-    int product = libevdev_get_id_product(dev);
-    int version = libevdev_get_id_version(dev);
-
-    const char *name = libevdev_get_name(dev);
-    std::size_t hash = std::hash<std::string>{}(name ? name : "");
+std::string InputReader::make_device_uid(const DeviceInfo &info) {
+    std::size_t hash = std::hash<std::string>{}(info.name);
 
     char buf[64];
     std::snprintf(buf, sizeof(buf),
                   "%04x:%04x:%04x:%04x:%016zx",
-                  bus, vendor, product, version, hash);
+                  info.bustype, info.vendor, info.product, info.version, hash);
 
     return buf;
 }
 
 std::string InputReader::get_device_uid(int fd) {
-    auto it = devices_.find(fd);
-    if (it != devices_.end()) {
-        return it->second.uid;
-    }
-    return "";
+    Device *device = find(fd);
+    return device ? device->uid : "";
 }
 
 std::string InputReader::get_key_name(int code) {
@@ -58,78 +62,139 @@ std::string InputReader::get_key_state(int value) {
         default: return "UNKNOWN";
     }
 }
+
 std::string InputReader::get_device_name(int fd) {
-    auto it = devices_.find(fd);
-    if (it != devices_.end() && it->second.dev) {
-        return it->second.name;
-    }
-    return "";
+    Device *device = find(fd);
+    return device ? device->name : "";
 }
 
 int InputReader::get_device_fd(const std::string &path) {
-    for (const auto &entry: devices_) {
-        if (entry.second.path == path) {
-            return entry.first;
-        }
-    }
-    return -1;
+    int slot = find_slot(path);
+    return slot != -1 ? slots_[slot].fd : -1;
 }
 
 int InputReader::add_device(const std::string &path) {
     err.clear();
+    can_retry = false;
 
-    int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK);
+    DeviceInfo info{};
+    int fd = input->open(path, info);
     if (fd < 0) {
         err = "Failed to open device " + path + ": " + std::string(strerror(errno));
+        can_retry = true;
         return -1;
     }
 
-    libevdev *dev = nullptr;
-    int rc = libevdev_new_from_fd(fd, &dev);
-    if (rc < 0) {
-        err = "Failed to init " + path + ": " + std::string(strerror(-rc));
-        close(fd);
+    return insert_device(path, fd, info, false);
+}
+
+// Only keyboards without a pointer are grabbed: the virtual keyboard passes through keys alone,
+// so the buttons and movement of a keyboard with a touchpad would be lost.
+static bool grabbable(const DeviceInfo &info) {
+    return info.keyboard && !info.mouse;
+}
+
+// A device handed over by the previous instance is still grabbed if it was;
+// if grabbing is now off, it is reopened, closing the descriptor releases the grab.
+int InputReader::adopt_device(const std::string &path, int fd, bool grabbed) {
+    err.clear();
+    can_retry = false;
+
+    DeviceInfo info{};
+    if (input->adopt(fd, info) < 0) {
+        err = "Failed to adopt device " + path + ": " + std::string(strerror(errno));
         return -1;
     }
 
-    if (!(libevdev_has_event_type(dev, EV_KEY) &&
-          (libevdev_has_event_code(dev, EV_KEY, KEY_A) ||
-           libevdev_has_event_code(dev, EV_KEY, BTN_LEFT)))) {
+    if (grabbed && !(grab && grabbable(info))) {
+        input->close(fd);
+        return add_device(path);
+    }
+
+    return insert_device(path, fd, info, grabbed);
+}
+
+int InputReader::insert_device(const std::string &path, int fd, const DeviceInfo &info, bool grabbed) {
+    if (!info.keyboard && !info.mouse) {
         err = "Device is not keyboard or mouse";
-        libevdev_free(dev);
-        close(fd);
+        input->close(fd);
         return -1;
     }
 
-    std::string uid = make_device_uid(dev);
-    std::string name = libevdev_get_name(dev);
+    std::string uid = make_device_uid(info);
 
     if (blacklist_.count(uid)) {
-        err = "Device is blacklisted, " + name + ", UID=" + uid;
-        libevdev_free(dev);
-        close(fd);
+        err = "Device is blacklisted, " + info.name + ", UID=" + uid;
+        input->close(fd);
         return -1;
     }
 
-    devices_[fd] = {dev, path, uid, name};
+    int slot;
+    if (!free_.empty()) {
+        slot = free_.back();
+        free_.pop_back();
+    } else {
+        slot = (int) slots_.size();
+        slots_.emplace_back();
+    }
+
+    Device &device = slots_[slot];
+    device.fd = fd;
+    snprintf(device.path, sizeof(device.path), "%s", path.c_str());
+    snprintf(device.uid, sizeof(device.uid), "%s", uid.c_str());
+    snprintf(device.name, sizeof(device.name), "%s", info.name.c_str());
+    device.grab_pending = false;
+    device.grabbed = grabbed;
+    device.dropping = false;
+    device.ungrabbed_events = 0;
+    device.event_queue.clear();
+    ++count_;
+
+    if ((size_t) fd >= by_fd_.size()) by_fd_.resize(fd + 1, -1);
+    by_fd_[fd] = slot;
+
+    int node = node_number(path);
+    if (node != -1) {
+        if ((size_t) node >= by_node_.size()) by_node_.resize(node + 1, -1);
+        by_node_[node] = slot;
+    }
+
+    // mice and keyboards with a pointer keep working directly
+    if (grab && grabbable(info) && !grabbed) {
+        device.grab_pending = true;
+        try_grab(device);
+    }
+
     return fd;
 }
 
 bool InputReader::remove_device(const std::string &path) {
     err.clear();
 
-    for (auto it = devices_.begin(); it != devices_.end(); ++it) {
-        if (it->second.path == path) {
-            int fd = it->first;
-            if (it->second.dev) libevdev_free(it->second.dev);
-            close(fd);
-            devices_.erase(it);
-            return true;
+    int slot = find_slot(path);
+    if (slot == -1) {
+        err = "Device not found: " + path;
+        return false;
+    }
+
+    Device &device = slots_[slot];
+    for (size_t i = 0; i < ready_.size(); ++i) {
+        if (ready_[i] == slot) {
+            ready_[i] = ready_.back();
+            ready_.pop_back();
+            break;
         }
     }
 
-    err = "Device not found: " + path;
-    return false;
+    int node = node_number(path);
+    if (node != -1 && (size_t) node < by_node_.size()) by_node_[node] = -1;
+    by_fd_[device.fd] = -1;
+
+    input->close(device.fd);
+    device.fd = -1;
+    free_.push_back(slot);
+    --count_;
+    return true;
 }
 
 void InputReader::add_to_blacklist(const std::string &uid) {
@@ -139,55 +204,188 @@ void InputReader::add_to_blacklist(const std::string &uid) {
 bool InputReader::fetch(int fd, int &code, int &value) {
     err.clear();
 
-    auto it = devices_.find(fd);
-    if (it == devices_.end()) {
+    Device *found = find(fd);
+    if (!found) {
         err = "Invalid file descriptor";
         return false;
     }
 
-    Device &device = it->second;
-    input_event ev{};
-    int rc;
-
+    Device &device = *found;
     if (device.event_queue.empty()) {
-        while (true) {
-            rc = libevdev_next_event(device.dev, LIBEVDEV_READ_FLAG_NORMAL, &ev);
-
-            if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
-                if (ev.type == EV_KEY) device.event_queue.push_back(ev);
-                else continue;
-            } else if (rc == LIBEVDEV_READ_STATUS_SYNC) {
-                while (true) {
-                    rc = libevdev_next_event(device.dev, LIBEVDEV_READ_FLAG_SYNC, &ev);
-                    if (rc == LIBEVDEV_READ_STATUS_SYNC || rc == LIBEVDEV_READ_STATUS_SUCCESS) {
-                        if (ev.type == EV_KEY) device.event_queue.push_back(ev);
-                        else continue;
-                    } else break;
-                }
-            } else break;
-        }
+        read_events(device);
     }
 
     if (!device.event_queue.empty()) {
-        ev = device.event_queue.front();
-        device.event_queue.pop_front();
+        const input_event &ev = device.event_queue.front();
+        TRACE5(input_fetch, fd, ev.code, ev.value, ev.time.tv_sec, ev.time.tv_usec);
         code = ev.code;
         value = ev.value;
+        device.event_queue.pop_front();
+        if (device.ungrabbed_events > 0) --device.ungrabbed_events;
         return true;
     }
 
     return false;
 }
 
+// Drain the device into its queue without handing out any events.
+// Events are later taken in timestamp order across all devices with fetch_next(fd, code, value).
+// Returns true if the device has queued events.
+bool InputReader::read(int fd) {
+    Device *device = find(fd);
+    if (!device) return false;
+
+    bool was_empty = device->event_queue.empty();
+    read_events(*device);
+
+    if (device->event_queue.empty()) return false;
+    if (was_empty) ready_.push_back(by_fd_[fd]);
+    return true;
+}
+
+// Take the oldest queued event across all devices passed to read().
+// The per-device queues are already in order, so this is a k-way merge by kernel timestamp.
+// `grabbed` is set if the event was taken from a grabbed device and must be passed through.
+bool InputReader::fetch_next(int &fd, input_event &ev, bool &grabbed) {
+    if (ready_.empty()) return false;
+
+    size_t oldest = 0;
+    for (size_t i = 1; i < ready_.size(); ++i) {
+        const timeval &a = slots_[ready_[i]].event_queue.front().time;
+        const timeval &b = slots_[ready_[oldest]].event_queue.front().time;
+        if (a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_usec < b.tv_usec)) {
+            oldest = i;
+        }
+    }
+
+    Device &device = slots_[ready_[oldest]];
+    ev = device.event_queue.front();
+    fd = device.fd;
+    device.event_queue.pop_front();
+    TRACE5(input_fetch, fd, ev.code, ev.value, ev.time.tv_sec, ev.time.tv_usec);
+
+    if (device.ungrabbed_events > 0) {
+        --device.ungrabbed_events;
+        grabbed = false;
+    } else {
+        grabbed = device.grabbed;
+    }
+
+    if (device.event_queue.empty()) {
+        ready_[oldest] = ready_.back();
+        ready_.pop_back();
+    }
+
+    return true;
+}
+
+// Returns the number of events that can still be queued for the device.
+size_t InputReader::room(int fd) {
+    Device *device = find(fd);
+    if (!device) return EventQueue::SIZE;
+    return EventQueue::SIZE - device->event_queue.size();
+}
+
+// Queue raw events read from the device by the caller (io_uring backend) instead of libevdev.
+// The caller must check room() first. After SYN_DROPPED the rest of the frame is skipped.
+bool InputReader::push_events(int fd, const input_event *events, size_t count) {
+    Device *found = find(fd);
+    if (!found) return false;
+
+    Device &device = *found;
+    bool was_empty = device.event_queue.empty();
+
+    for (size_t i = 0; i < count && !device.event_queue.full(); ++i) {
+        const input_event &ev = events[i];
+        if (ev.type == EV_SYN && ev.code == SYN_DROPPED) {
+            device.dropping = true;
+            continue;
+        }
+        if (device.dropping) {
+            if (ev.type == EV_SYN && ev.code == SYN_REPORT) device.dropping = false;
+            continue;
+        }
+        queue_event(device, ev);
+    }
+
+    if (device.grab_pending) {
+        try_grab(device);
+    }
+
+    if (device.event_queue.empty()) return false;
+    if (was_empty) ready_.push_back(by_fd_[fd]);
+    return true;
+}
+
+// Grabbed devices also queue their SYN_REPORTs, so their frames can be passed through as is.
+void InputReader::queue_event(Device &device, const input_event &ev) {
+    if (ev.type == EV_KEY || (device.grabbed && ev.type == EV_SYN && ev.code == SYN_REPORT)) {
+        device.event_queue.push_back(ev);
+    }
+}
+
+// Reading stops when the queue is full; the rest stays in the kernel until the next wakeup.
+void InputReader::read_events(Device &device) {
+    input_event events[EventQueue::SIZE];
+
+    while (!device.event_queue.full()) {
+        size_t count = input->read(device.fd, events, EventQueue::SIZE - device.event_queue.size());
+        if (count == 0) break;
+        for (size_t i = 0; i < count; ++i) {
+            queue_event(device, events[i]);
+        }
+    }
+
+    if (device.grab_pending) {
+        try_grab(device);
+    }
+}
+
+// Grab the device only while none of its keys is held down.
+// Otherwise the system would never see the release of that key and it would get stuck.
+void InputReader::try_grab(Device &device) {
+    if (input->keys_down(device.fd)) return;
+
+    device.grab_pending = false;
+    if (input->grab(device.fd)) {
+        device.grabbed = true;
+        device.ungrabbed_events = device.event_queue.size();
+    }
+}
+
 bool InputReader::empty() {
-    return devices_.empty();
+    return count_ == 0;
 }
 
 void InputReader::flush() {
-    for (auto &entry: devices_) {
+    ready_.clear();
+    for (auto &device: slots_) {
+        if (device.fd == -1) continue;
+        device.event_queue.clear();
+        device.ungrabbed_events = 0;
         int code, value;
-        while (fetch(entry.first, code, value)) {
+        while (fetch(device.fd, code, value)) {
             // do nothing
         }
     }
 }
+
+Device *InputReader::find(int fd) {
+    if (fd < 0 || (size_t) fd >= by_fd_.size() || by_fd_[fd] == -1) return nullptr;
+    return &slots_[by_fd_[fd]];
+}
+
+// Nodes are looked up by their number, other paths fall back to a scan.
+int InputReader::find_slot(const std::string &path) const {
+    int node = node_number(path);
+    if (node != -1) {
+        if ((size_t) node >= by_node_.size()) return -1;
+        int slot = by_node_[node];
+        return slot != -1 && path == slots_[slot].path ? slot : -1;
+    }
+
+    for (size_t slot = 0; slot < slots_.size(); ++slot) {
+        if (slots_[slot].fd != -1 && path == slots_[slot].path) return (int) slot;
+    }
+    return -1;
+}
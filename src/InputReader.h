@@ -1,17 +1,55 @@
 #pragma once
 
-#include <deque>
+#include "Backend.h"
+
 #include <string>
-#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 #include <libevdev/libevdev.h>
 
+// Fixed-size FIFO of input events, so reading devices never allocates.
+struct EventQueue {
+    static const size_t SIZE = 64;
+
+    input_event events[SIZE];
+    size_t head = 0;
+    size_t count = 0;
+
+    bool empty() const { return count == 0; }
+
+    bool full() const { return count == SIZE; }
+
+    size_t size() const { return count; }
+
+    const input_event &front() const { return events[head]; }
+
+    void push_back(const input_event &ev) {
+        events[(head + count) % SIZE] = ev;
+        ++count;
+    }
+
+    void pop_front() {
+        head = (head + 1) % SIZE;
+        --count;
+    }
+
+    void clear() {
+        head = 0;
+        count = 0;
+    }
+};
+
+// Per-device state is kept inline and small, so hundreds of devices stay cheap.
 struct Device {
-    libevdev *dev;
-    std::string path;
-    std::string uid;
-    std::string name;
-    std::deque<input_event> event_queue;
+    int fd;                  // -1 for a free slot
+    char path[64];
+    char uid[40];
+    char name[80];
+    bool grab_pending;
+    bool grabbed;
+    bool dropping;           // SYN_DROPPED seen in pushed events, skipping until SYN_REPORT
+    size_t ungrabbed_events; // queued events that were read before the grab
+    EventQueue event_queue;
 };
 
 class InputReader {
@@ -21,10 +59,15 @@ public:
     ~InputReader();
 
     std::string err;
+    bool can_retry = false; // the last add_device() failure may go away, e.g. udev hasn't set permissions yet
+
+    bool grab = false;
+
+    InputBackend *input;
 
     bool init();
 
-    std::string make_device_uid(libevdev *dev);
+    std::string make_device_uid(const DeviceInfo &info);
 
     std::string get_device_uid(int fd);
 
@@ -38,17 +81,54 @@ public:
 
     int add_device(const std::string &path);
 
+    // Takes over a device opened by the previous instance, see Handoff.
+    int adopt_device(const std::string &path, int fd, bool grabbed);
+
     bool remove_device(const std::string &path);
 
     void add_to_blacklist(const std::string &uid);
 
     bool fetch(int fd, int &code, int &value);
 
+    bool read(int fd);
+
+    size_t room(int fd);
+
+    bool push_events(int fd, const input_event *events, size_t count);
+
+    bool fetch_next(int &fd, input_event &ev, bool &grabbed);
+
     bool empty();
 
     void flush();
 
+    size_t get_device_count() const { return count_; }
+
+    // Device slots, free ones have fd -1.
+    const std::vector<Device> &get_devices() const { return slots_; }
+
 private:
-    std::unordered_map<int, Device> devices_;
+    // Slot map of devices: slots are reused after removal and keep their index, though the vector
+    // may move them as it grows, so they are referred to by index. Lookups by fd and by
+    // /dev/input/eventN number are plain array accesses.
+    std::vector<Device> slots_;
+    std::vector<int> free_;
+    std::vector<int> by_fd_;
+    std::vector<int> by_node_;
+    size_t count_ = 0;
+
     std::unordered_set<std::string> blacklist_;
+    std::vector<int> ready_; // slots with queued events
+
+    Device *find(int fd);
+
+    int find_slot(const std::string &path) const;
+
+    int insert_device(const std::string &path, int fd, const DeviceInfo &info, bool grabbed);
+
+    void read_events(Device &device);
+
+    void queue_event(Device &device, const input_event &ev);
+
+    void try_grab(Device &device);
 };
@@ -0,0 +1,302 @@
+#include "Layouts.h"
+#include "Converter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include <linux/input-event-codes.h>
+
+// Keys in the order of a keymap line.
+static const int KeyOrder[] = {
+    KEY_GRAVE, KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7, KEY_8, KEY_9, KEY_0, KEY_MINUS, KEY_EQUAL,
+    KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I, KEY_O, KEY_P, KEY_LEFTBRACE, KEY_RIGHTBRACE,
+    KEY_BACKSLASH,
+    KEY_A, KEY_S, KEY_D, KEY_F, KEY_G, KEY_H, KEY_J, KEY_K, KEY_L, KEY_SEMICOLON, KEY_APOSTROPHE,
+    KEY_Z, KEY_X, KEY_C, KEY_V, KEY_B, KEY_N, KEY_M, KEY_COMMA, KEY_DOT, KEY_SLASH
+};
+
+static_assert(sizeof(KeyOrder) / sizeof(KeyOrder[0]) == 47, "keymap lines have 47 keys");
+
+// Decodes UTF-8, returns false on malformed input.
+static bool decode(const std::string &text, std::u32string &out) {
+    out.clear();
+    for (size_t i = 0; i < text.size();) {
+        unsigned char c = text[i];
+        size_t len = c < 0x80 ? 1 : (c & 0xe0) == 0xc0 ? 2 : (c & 0xf0) == 0xe0 ? 3 : (c & 0xf8) == 0xf0 ? 4 : 0;
+        if (len == 0 || i + len > text.size()) return false;
+
+        char32_t ch = len == 1 ? c : c & (0x7f >> len);
+        for (size_t k = 1; k < len; ++k) {
+            unsigned char next = text[i + k];
+            if ((next & 0xc0) != 0x80) return false;
+            ch = (ch << 6) | (next & 0x3f);
+        }
+        out += ch;
+        i += len;
+    }
+    return true;
+}
+
+// Letters of the Latin, Greek and Cyrillic scripts, enough for the layouts of these languages.
+static bool is_letter(char32_t ch) {
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+           (ch >= 0xc0 && ch <= 0x24f && ch != 0xd7 && ch != 0xf7) ||
+           (ch >= 0x370 && ch <= 0x3ff) || (ch >= 0x400 && ch <= 0x52f);
+}
+
+Layouts::Layouts() {
+    memset(index_, NO_KEY, sizeof(index_));
+    for (size_t i = 0; i < KEYS; ++i) {
+        index_[KeyOrder[i]] = i;
+    }
+}
+
+bool Layouts::load(const std::string &list) {
+    err.clear();
+    count_ = 0;
+
+    std::stringstream ss(list);
+    std::string entry;
+    while (std::getline(ss, entry, ',')) {
+        entry.erase(0, entry.find_first_not_of(" \t"));
+        entry.erase(entry.find_last_not_of(" \t") + 1);
+        if (entry.empty()) continue;
+
+        if (!load_keymap(entry)) {
+            count_ = 0;
+            return false;
+        }
+    }
+
+    if (count_ < 2) {
+        err = "At least 2 layouts are needed";
+        count_ = 0;
+        return false;
+    }
+    return true;
+}
+
+bool Layouts::load_keymap(const std::string &entry) {
+    err.clear();
+
+    std::string path = entry.find('/') == std::string::npos
+                           ? std::string(LAYOUTS_DIR) + "/" + entry + ".map"
+                           : entry;
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        err = "Failed to open " + path + ": " + std::string(strerror(errno));
+        return false;
+    }
+
+    std::string lines[3];
+    size_t found = 0;
+    std::string line;
+    while (found < 3 && std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        lines[found++] = line;
+    }
+    if (found < 3) {
+        err = "Invalid keymap " + path + ": expected 3 lines";
+        return false;
+    }
+
+    std::string name = entry.substr(entry.find_last_of('/') + 1);
+    name = name.substr(0, name.find('.'));
+    if (!add(name, lines[0], lines[1], lines[2])) {
+        err = "Invalid keymap " + path + ": " + err;
+        return false;
+    }
+
+    // the model is optional, without it the letter frequencies are used
+    std::string model = path;
+    if (model.size() > 4 && model.compare(model.size() - 4, 4, ".map") == 0) model.erase(model.size() - 4);
+    models_[count_ - 1].open(model + ".ngram");
+    return true;
+}
+
+bool Layouts::add(const std::string &name, const std::string &keys, const std::string &shifted,
+                  const std::string &letters) {
+    err.clear();
+    if (count_ == MAX_LAYOUTS) {
+        err = "too many layouts, " + std::to_string(MAX_LAYOUTS) + " at most";
+        return false;
+    }
+
+    std::u32string lines[3];
+    if (!decode(keys, lines[0]) || !decode(shifted, lines[1]) || !decode(letters, lines[2])) {
+        err = "not a valid UTF-8 text";
+        return false;
+    }
+    if (lines[0].size() != KEYS || lines[1].size() != KEYS) {
+        err = "key lines must have " + std::to_string(KEYS) + " characters";
+        return false;
+    }
+
+    // frequent letters weigh more, so the text reads as the language rather than just as letters
+    const std::u32string &frequency = lines[2];
+    size_t layout = count_;
+    for (size_t key = 0; key < KEYS; ++key) {
+        for (int shift = 0; shift < 2; ++shift) {
+            char32_t ch = lines[shift][key];
+            chars_[layout][key][shift] = ch;
+            weights_[layout][key][shift] = 0;
+            if (!is_letter(ch)) continue;
+
+            size_t rank = frequency.find(ch);
+            if (rank == std::u32string::npos) rank = frequency.find(lines[0][key]);
+            weights_[layout][key][shift] = rank == std::u32string::npos
+                                               ? 1
+                                               : 1 + (MAX_WEIGHT - 1) * (frequency.size() - rank) / frequency.size();
+        }
+    }
+
+    names_[layout] = name;
+    models_[layout].close();
+    ++count_;
+    return true;
+}
+
+bool Layouts::has_models() const {
+    if (count_ == 0) return false;
+    for (size_t i = 0; i < count_; ++i) {
+        if (!models_[i].loaded()) return false;
+    }
+    return true;
+}
+
+char32_t Layouts::get_char(size_t layout, int code, bool shift) const {
+    if (layout >= count_ || code < 0 || code > 255 || index_[code] == NO_KEY) return 0;
+    return chars_[layout][index_[code]][shift];
+}
+
+size_t Layouts::choose(size_t current, const KeyEvent *keys, size_t size) const {
+    if (count_ < 2) return (current + 1) % 2;
+
+    size_t best = (current + 1) % count_;
+    int best_score = score(best, keys, size);
+    for (size_t step = 2; step < count_; ++step) {
+        size_t layout = (current + step) % count_;
+        int s = score(layout, keys, size);
+        if (s > best_score) {
+            best = layout;
+            best_score = s;
+        }
+    }
+    return best;
+}
+
+int Layouts::score(size_t layout, const KeyEvent *keys, size_t size) const {
+    int result = 0;
+
+    if (has_models()) {
+        int a = NgramModel::BOUNDARY, b = NgramModel::BOUNDARY;
+        for (size_t i = 0; i < size; ++i) {
+            if (keys[i].code == KEY_LEFTSHIFT || keys[i].code == KEY_RIGHTSHIFT) continue;
+            int c = get_key(keys[i].code);
+            if (c == NgramModel::BOUNDARY && b == NgramModel::BOUNDARY) continue;
+            result += key_score(layout, a, b, c);
+            a = b;
+            b = c;
+        }
+        if (b != NgramModel::BOUNDARY) result += key_score(layout, a, b, NgramModel::BOUNDARY);
+        return result;
+    }
+
+    int shifts = 0;
+    for (size_t i = 0; i < size; ++i) {
+        int code = keys[i].code;
+        if (code == KEY_LEFTSHIFT || code == KEY_RIGHTSHIFT) {
+            shifts += keys[i].value ? 1 : -1;
+            if (shifts < 0) shifts = 0;
+            continue;
+        }
+        if (code < 0 || code > 255 || index_[code] == NO_KEY) continue;
+        result += weights_[layout][index_[code]][shifts > 0];
+    }
+    return result;
+}
+
+// Counts trigrams of key positions in the text, characters outside the keymap being word boundaries,
+// and writes interpolated trigram, bigram and unigram probabilities.
+bool Layouts::build_model(size_t layout, std::istream &corpus, std::ostream &out) {
+    err.clear();
+    const int K = NgramModel::KEYS;
+    const int B = NgramModel::BOUNDARY;
+
+    std::unordered_map<char32_t, int> keys;
+    for (int shift = 0; shift < 2; ++shift) {
+        for (size_t key = 0; key < KEYS; ++key) {
+            keys.emplace(chars_[layout][key][shift], key);
+        }
+    }
+
+    std::vector<double> trigrams(K * K * K), bigrams(K * K), unigrams(K);
+    double total = 0;
+    std::string line;
+    std::u32string text;
+    while (std::getline(corpus, line)) {
+        if (!decode(line, text)) continue;
+        text += U'\n';
+
+        int a = B, b = B;
+        for (char32_t ch: text) {
+            auto it = keys.find(ch);
+            int c = it == keys.end() ? B : it->second;
+            if (c == B && b == B) continue;
+            ++trigrams[(a * K + b) * K + c];
+            ++bigrams[b * K + c];
+            ++unigrams[c];
+            ++total;
+            a = b;
+            b = c;
+        }
+    }
+    if (total == 0) {
+        err = "The text has no characters of the layout";
+        return false;
+    }
+
+    NgramModel::Header header{};
+    memcpy(header.magic, NGRAM_MAGIC, sizeof(header.magic));
+    header.keys = K;
+    header.order = 3;
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+    std::vector<double> contexts(K * K), previous(K);
+    for (int ab = 0; ab < K * K; ++ab) {
+        for (int c = 0; c < K; ++c) {
+            contexts[ab] += trigrams[ab * K + c];
+            previous[ab % K] += trigrams[ab * K + c];
+        }
+    }
+
+    std::vector<int8_t> scores(K * K * K);
+    for (int ab = 0; ab < K * K; ++ab) {
+        int b = ab % K;
+        for (int c = 0; c < K; ++c) {
+            double p = 0.05 / K + 0.1 * unigrams[c] / total;
+            double weight = 0.15;
+            if (previous[b] > 0) {
+                p += 0.25 * bigrams[b * K + c] / previous[b];
+                weight += 0.25;
+            }
+            if (contexts[ab] > 0) {
+                p += 0.6 * trigrams[ab * K + c] / contexts[ab];
+                weight += 0.6;
+            }
+            double bits = std::log2(p / weight) * 4;
+            scores[ab * K + c] = (int8_t) std::max(-127.0, std::round(bits));
+        }
+    }
+    out.write(reinterpret_cast<const char *>(scores.data()), scores.size());
+
+    if (!out) {
+        err = "Failed to write the model";
+        return false;
+    }
+    return true;
+}
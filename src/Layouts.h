@@ -0,0 +1,83 @@
+#pragma once
+
+#include "NgramModel.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+struct KeyEvent;
+
+// Maximum number of layouts the system switch cycles through.
+const size_t MAX_LAYOUTS = 8;
+
+// Keymaps of layouts given by name are read from here, as <name>.map.
+const char LAYOUTS_DIR[] = "/usr/share/easy-switcher/layouts";
+
+// Characters produced by the keys in each layout, compiled from keymap files
+// into one flat table, and a guess of the layout the text was meant for.
+//
+// A keymap file has three lines, '#' lines are comments:
+// unshifted and shifted characters of the keys `1234567890-=qwertyuiop[]\asdfghjkl;'zxcvbnm,./
+// in this order, then the letters of the language from the most to the least frequent.
+// An n-gram model of the language may lie next to the keymap, as <name>.ngram;
+// when all layouts have one, text is scored with the models instead of the letter frequencies.
+class Layouts {
+public:
+    std::string err;
+
+    Layouts();
+
+    // Comma separated names or paths of keymap files, in the order the layout switch cycles through them.
+    bool load(const std::string &list);
+
+    // Adds one layout from a name or a path of its keymap file, and its model if there is one.
+    bool load_keymap(const std::string &entry);
+
+    bool add(const std::string &name, const std::string &keys, const std::string &shifted,
+             const std::string &letters);
+
+    size_t count() const { return count_; }
+
+    bool has_models() const;
+
+    // Position of the key in a keymap line, NgramModel::BOUNDARY for other keys.
+    int get_key(int code) const {
+        return code < 0 || code > 255 || index_[code] == NO_KEY ? NgramModel::BOUNDARY : index_[code];
+    }
+
+    // Model score of key `c` after keys `a` and `b` in the layout, see NgramModel.
+    int key_score(size_t layout, int a, int b, int c) const { return models_[layout].score(a, b, c); }
+
+    const std::string &name(size_t layout) const { return names_[layout]; }
+
+    // Character of the key in the layout, 0 if the key isn't in the keymap.
+    char32_t get_char(size_t layout, int code, bool shift) const;
+
+    // The most likely layout for the typed keys other than `current`.
+    // Ties go to the layout that comes first after `current` in the switch order.
+    size_t choose(size_t current, const KeyEvent *keys, size_t size) const;
+
+    // How much the keys look like text in the layout, higher is more likely.
+    int score(size_t layout, const KeyEvent *keys, size_t size) const;
+
+    // Writes an n-gram model of the layout's language, learned from a UTF-8 text in it.
+    bool build_model(size_t layout, std::istream &corpus, std::ostream &out);
+
+private:
+    static const size_t KEYS = 47;
+    static const size_t NO_KEY = 0xff;
+    static const int MAX_WEIGHT = 100;
+
+    std::string names_[MAX_LAYOUTS];
+    size_t count_ = 0;
+    NgramModel models_[MAX_LAYOUTS];
+
+    // [layout][key][shift], key being the position in the keymap line
+    char32_t chars_[MAX_LAYOUTS][KEYS][2] = {};
+    // [layout][key][shift], weight of the letter by its frequency, 0 for other characters
+    uint8_t weights_[MAX_LAYOUTS][KEYS][2] = {};
+    // key code to position in the keymap line, NO_KEY for other keys
+    uint8_t index_[256];
+};
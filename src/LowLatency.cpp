@@ -0,0 +1,91 @@
+#include "LowLatency.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sched.h>
+#include <sys/mman.h>
+
+static std::atomic<bool> counting(false);
+static std::atomic<unsigned long> allocation_count(0);
+
+// Count heap allocations once counting is on, so the daemon can report allocations on the hot path.
+void *operator new(std::size_t size) {
+    if (counting.load(std::memory_order_relaxed)) allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void *p, std::size_t) noexcept {
+    std::free(p);
+}
+
+// Touch the stack the event loop will use, so it is already mapped when memory gets locked.
+static void prefault_stack() {
+    const size_t STACK_SIZE = 256 * 1024;
+    volatile char stack[STACK_SIZE];
+    for (size_t i = 0; i < STACK_SIZE; i += 4096) {
+        stack[i] = 0;
+    }
+    (void) stack[0];
+}
+
+// Lock the daemon in memory, then optionally switch to the realtime scheduler and pin it to a CPU.
+// Must be called after all hot path buffers are allocated.
+bool LowLatency::apply() {
+    err.clear();
+
+    prefault_stack();
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+        err = "Failed to lock memory: " + std::string(strerror(errno));
+        return false;
+    }
+
+    if (priority > 0) {
+        sched_param param{};
+        param.sched_priority = priority;
+        if (sched_setscheduler(0, SCHED_FIFO, &param) == -1) {
+            err = "Failed to set realtime priority " + std::to_string(priority) + ": " + std::string(strerror(errno));
+            return false;
+        }
+    }
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+            err = "Failed to pin to CPU " + std::to_string(cpu) + ": " + std::string(strerror(errno));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void LowLatency::count_allocations() {
+    counting.store(true, std::memory_order_relaxed);
+}
+
+// Returns the number of heap allocations made since count_allocations().
+unsigned long LowLatency::allocations() {
+    return allocation_count.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <string>
+
+class LowLatency {
+public:
+    std::string err;
+
+    int priority = 0; // SCHED_FIFO priority, 0 keeps the default scheduler
+    int cpu = -1;     // CPU to pin the daemon to, -1 keeps the default affinity
+
+    bool apply();
+
+    // Heap allocations are counted only after this, so other modes don't pay for the counter.
+    static void count_allocations();
+
+    static unsigned long allocations();
+};
@@ -0,0 +1,55 @@
+#include "NgramModel.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+NgramModel::~NgramModel() {
+    close();
+}
+
+bool NgramModel::open(const std::string &path) {
+    err.clear();
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        err = "Failed to open " + path + ": " + std::string(strerror(errno));
+        return false;
+    }
+
+    struct stat st{};
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size != FILE_SIZE) {
+        err = "Invalid n-gram model " + path + ": wrong size";
+        ::close(fd);
+        return false;
+    }
+
+    void *map = mmap(nullptr, FILE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        err = "Failed to map " + path + ": " + std::string(strerror(errno));
+        return false;
+    }
+
+    const Header *header = static_cast<const Header *>(map);
+    if (memcmp(header->magic, NGRAM_MAGIC, sizeof(header->magic)) != 0 ||
+        header->keys != KEYS || header->order != 3) {
+        err = "Invalid n-gram model " + path + ": wrong header";
+        munmap(map, FILE_SIZE);
+        return false;
+    }
+
+    map_ = map;
+    scores_ = reinterpret_cast<const int8_t *>(header + 1);
+    return true;
+}
+
+void NgramModel::close() {
+    if (map_) munmap(map_, FILE_SIZE);
+    map_ = nullptr;
+    scores_ = nullptr;
+}
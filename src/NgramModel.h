@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#define NGRAM_MAGIC "ESNGRAM1"
+
+// Trigram model of a language over the key positions of its layout, written by --build-model.
+// The file is mapped as is: a header, then the log2 probability of each key after two others
+// in quarter bits, so opening parses nothing and only the pages in use take memory.
+class NgramModel {
+public:
+    static const int KEYS = 48;     // 47 text keys of a keymap line and the word boundary
+    static const int BOUNDARY = 47;
+
+    struct Header {
+        char magic[8];
+        uint32_t keys;
+        uint32_t order;
+    };
+
+    static const size_t FILE_SIZE = sizeof(Header) + KEYS * KEYS * KEYS;
+
+    std::string err;
+
+    NgramModel() = default;
+
+    NgramModel(const NgramModel &) = delete;
+
+    NgramModel &operator=(const NgramModel &) = delete;
+
+    ~NgramModel();
+
+    bool open(const std::string &path);
+
+    void close();
+
+    bool loaded() const { return scores_ != nullptr; }
+
+    // Score of key `c` after keys `a` and `b`.
+    int score(int a, int b, int c) const { return scores_[(a * KEYS + b) * KEYS + c]; }
+
+private:
+    void *map_ = nullptr;
+    const int8_t *scores_ = nullptr;
+};
@@ -0,0 +1,218 @@
+#include "Pipeline.h"
+#include "SystemBackend.h"
+
+#include <iostream>
+
+Pipeline::Pipeline(InputReader &reader, VirtualKeyboard &vk, Converter &conv)
+    : clock(&system_clock()), reader_(reader), vk_(vk), conv_(conv) {
+}
+
+// Must be called before typing starts, so that processing never allocates.
+void Pipeline::reserve() {
+    passthrough_.reserve(PASSTHROUGH_SIZE);
+    plan_.reserve(PLAN_SIZE);
+    if (debug_text) dump_.reserve(BUFFER_SIZE * 16);
+}
+
+void Pipeline::flush_passthrough() {
+    if (passthrough_.empty()) return;
+
+    if (!vk_.write_events(passthrough_.data(), passthrough_.size()) && debug_mode) {
+        std::cout << "Failed to pass through " << passthrough_.size() << " events" << std::endl;
+    }
+
+    long long now = clock->now_us();
+    for (const auto &ev: passthrough_) {
+        if (ev.type != EV_KEY) continue;
+        long long us = now - (ev.time.tv_sec * 1000000LL + ev.time.tv_usec);
+        passthrough_latency.count++;
+        passthrough_latency.total_us += us;
+        if (us > passthrough_latency.max_us) passthrough_latency.max_us = us;
+    }
+
+    passthrough_.clear();
+}
+
+// Runs once per loop iteration, after all ready devices have been read,
+// so events from several devices reach the converter in timestamp order.
+void Pipeline::process() {
+    bool logging = debug_log && debug_log->enabled();
+
+    int device_fd;
+    input_event ev{};
+    bool grabbed;
+    while (reader_.fetch_next(device_fd, ev, grabbed)) {
+        if (grabbed) {
+            // the convert and undo keys only trigger actions and never reach applications, unless paused
+            if (paused || !(ev.type == EV_KEY && ev.code != 0 &&
+                            (ev.code == conv_.conv_key || ev.code == conv_.undo_key))) {
+                passthrough_.push_back(ev);
+                if (passthrough_.size() == PASSTHROUGH_SIZE) flush_passthrough();
+            }
+        }
+
+        if (ev.type != EV_KEY || paused) continue;
+        if (logging) debug_log->input(device_fd, ev);
+
+        int code = ev.code;
+        int value = ev.value;
+        if (counters) counters->start();
+        bool changed = conv_.push(code, value, ev.time.tv_sec * 1000000LL + ev.time.tv_usec);
+        if (changed && debug_text) {
+            std::cout << "Input event: " << reader_.get_key_name(code) << " "
+                    << reader_.get_key_state(value) << " from: "
+                    << reader_.get_device_name(device_fd) << std::endl;
+            dump_.clear();
+            conv_.get_buffer_dump(dump_);
+            std::cout << "Buffer: " << dump_ << std::endl;
+        }
+        Action action_needed = changed ? conv_.process() : None;
+        if (counters) counters->stop(StageCounters::StageConvert);
+
+        if (action_needed != None) {
+            if (debug_text) {
+                std::cout << (action_needed == Undo ? "Undo" : "Convert")
+                        << " pattern detected, processing..." << std::endl;
+            }
+            perform(action_needed);
+        }
+    }
+
+    flush_passthrough();
+}
+
+// Builds the plan for the action and writes it out.
+void Pipeline::perform(Action action) {
+    bool logging = debug_log && debug_log->enabled();
+
+    flush_passthrough();
+    if (counters) counters->start();
+    conv_.convert(action, plan_);
+    if (counters) counters->stop(StageCounters::StagePlan);
+    // an undo without history or a convert of an empty buffer has nothing to write
+    if (!plan_.empty()) ++conversions;
+    if (logging) debug_log->plan(action, plan_.size());
+    if (uring) {
+        if (counters) counters->start();
+        bool written = uring->write_plan(vk_.get_fd(), plan_, vk_.delay);
+        if (counters) counters->stop(StageCounters::StageWrite);
+        if (!written && debug_mode) std::cout << "Failed to write some of the output" << std::endl;
+    }
+    for (const auto &out: plan_) {
+        if (!uring) vk_.emit_key(out.code, out.value);
+        if (debug_text) {
+            std::cout << "Output: " << reader_.get_key_name(out.code) << " "
+                    << reader_.get_key_state(out.value) << std::endl;
+        }
+    }
+    // grabbed keyboards can't interfere with the output,
+    // so keys typed meanwhile are passed through after it instead of being dropped
+    if (!reader_.grab) {
+        if (uring) uring->fetch(reader_);
+        reader_.flush();
+    }
+    if (debug_text) {
+        if (conv_.layouts.count() > 0) {
+            std::cout << "Layout: " << conv_.layouts.name(conv_.get_layout()) << std::endl;
+        }
+        dump_.clear();
+        conv_.get_buffer_dump(dump_);
+        std::cout << "Buffer: " << dump_ << std::endl;
+    }
+}
+
+// Commands act on the text typed so far, as if their trigger had just been typed.
+// The converter is updated first, so keys read from now on come after the command's output.
+void Pipeline::command(int cmd, ControlState &state) {
+    bool logging = debug_log && debug_log->enabled();
+    state = ControlState{};
+    state.version = ControlSocket::VERSION;
+    state.status = StatusOk;
+
+    // keys read before a conversion go first, in the log too, so that a replay of it matches
+    bool converting = cmd == CommandConvertWord || cmd == CommandConvertAll || cmd == CommandUndo;
+    if (converting && !paused) {
+        if (uring) uring->fetch(reader_);
+        process();
+    }
+
+    if (cmd < CommandState || cmd > CommandClear) {
+        state.status = StatusUnknown;
+    } else if (cmd != CommandState) {
+        if (logging) debug_log->control(cmd);
+        if (debug_mode) std::cout << "Control command " << cmd << std::endl;
+    }
+
+    switch (cmd) {
+        case CommandConvertWord:
+        case CommandConvertAll:
+        case CommandUndo:
+            if (paused) {
+                state.status = StatusFailed;
+                break;
+            }
+            perform(cmd == CommandConvertWord ? ConvertWord : cmd == CommandConvertAll ? ConvertAll : Undo);
+            if (plan_.empty()) state.status = StatusFailed;
+            break;
+        case CommandPause:
+            paused = true;
+            conv_.clear_buffer();
+            break;
+        case CommandResume:
+            paused = false;
+            break;
+        case CommandClear:
+            conv_.clear_buffer();
+            break;
+        default:
+            break;
+    }
+
+    state.paused = paused;
+    state.layout = conv_.get_layout();
+    state.layouts = conv_.layouts.count();
+    state.buffer_size = conv_.get_buffer_size();
+    state.cursor = conv_.get_cursor();
+    state.conversions = conversions;
+    state.devices = reader_.get_device_count();
+}
+
+// Probes devices that are due in one batch: new nodes after their debounce window
+// and nodes that failed to open before, when their retry time comes.
+void Pipeline::probe(DeviceManager &manager) {
+    bool connected;
+    std::string path;
+
+    while (manager.fetch(path, connected)) {
+        if (connected) {
+            // IN_ATTRIB may report a node that is already open
+            if (reader_.get_device_fd(path) != -1) continue;
+
+            int device_fd = reader_.add_device(path);
+            if (device_fd != -1) {
+                if (watch && !watch(device_fd, true)) {
+                    reader_.remove_device(path);
+                } else {
+                    std::string uid = reader_.get_device_uid(device_fd);
+                    std::string name = reader_.get_device_name(device_fd);
+                    if (debug_log && debug_log->enabled()) debug_log->device(device_fd, name);
+                    if (debug_mode)
+                        std::cout << "Added device " << path << ": " << name << ", UID=" << uid <<
+                                std::endl;
+                }
+            } else if (reader_.can_retry && manager.retry(path)) {
+                if (debug_mode) std::cout << "Will retry device " << path << ": " << reader_.err << std::endl;
+            } else {
+                if (debug_mode) std::cout << "Skipped device " << path << ": " << reader_.err << std::endl;
+            }
+        } else {
+            int device_fd = reader_.get_device_fd(path);
+            if (device_fd != -1) {
+                if (watch) watch(device_fd, false);
+                reader_.remove_device(path);
+                if (debug_log && debug_log->enabled()) debug_log->removed(device_fd);
+                if (debug_mode) std::cout << "Removed device: " << path << std::endl;
+            }
+        }
+    }
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "Backend.h"
+#include "ControlSocket.h"
+#include "Converter.h"
+#include "DebugLog.h"
+#include "DeviceManager.h"
+#include "InputReader.h"
+#include "StageCounters.h"
+#include "UringBackend.h"
+#include "VirtualKeyboard.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+struct LatencyStats {
+    unsigned long count = 0;
+    long long total_us = 0;
+    long long max_us = 0;
+};
+
+// Input to output path of the daemon: events of all devices in timestamp order,
+// passthrough of grabbed keyboards, the converter and its output.
+// The same code runs in the daemon and in the simulator (tools/simulate.cpp).
+class Pipeline {
+public:
+    // events of grabbed keyboards waiting to be written to the virtual keyboard
+    static const size_t PASSTHROUGH_SIZE = 256;
+
+    // Called when a device is opened or closed, so it can be watched for input.
+    // Returning false from `added` rejects the device.
+    using WatchCallback = std::function<bool(int fd, bool added)>;
+
+    Pipeline(InputReader &reader, VirtualKeyboard &vk, Converter &conv);
+
+    Clock *clock;
+    UringBackend *uring = nullptr; // writes the output instead of vk when set
+    DebugLog *debug_log = nullptr;
+    StageCounters *counters = nullptr;
+    bool debug_mode = false;       // device changes are printed
+    bool debug_text = false;       // every event is printed
+    bool paused = false;           // typing isn't given to the converter
+    WatchCallback watch;
+
+    LatencyStats passthrough_latency;
+    unsigned long conversions = 0;
+
+    void reserve();
+
+    void process();
+
+    void probe(DeviceManager &manager);
+
+    // Runs a command of the control socket, `state` is filled in after it.
+    void command(int cmd, ControlState &state);
+
+private:
+    InputReader &reader_;
+    VirtualKeyboard &vk_;
+    Converter &conv_;
+
+    // conversion output and debug text, reserved at startup so that typing never allocates
+    std::vector<input_event> passthrough_;
+    std::vector<KeyEvent> plan_;
+    std::string dump_;
+
+    void flush_passthrough();
+
+    void perform(Action action);
+};
@@ -0,0 +1,122 @@
+#include "StageCounters.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+static const char *const StageNames[] = {"read", "convert", "plan", "write", "sleep"};
+
+static const char *const CounterNames[] = {"cycles", "instructions", "cache misses", "context switches"};
+
+StageCounters::StageCounters() : leader_(-1), fds_{-1, -1, -1, -1}, index_{-1, -1, -1, -1}, members_(0),
+                                 start_{}, totals_{}, calls_{} {
+}
+
+StageCounters::~StageCounters() {
+    close();
+}
+
+bool StageCounters::open() {
+    err.clear();
+    close();
+
+    static const uint32_t Types[COUNTERS] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_SOFTWARE
+    };
+    static const uint64_t Configs[COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_SW_CONTEXT_SWITCHES
+    };
+
+    // kernel time is counted too, syscalls are a part of the cost of a stage
+    int error = 0;
+    for (int i = 0; i < COUNTERS; ++i) {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = Types[i];
+        attr.config = Configs[i];
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.disabled = leader_ == -1;
+        attr.exclude_hv = 1;
+
+        int fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, leader_, PERF_FLAG_FD_CLOEXEC);
+        if (fd == -1) {
+            error = errno;
+            continue;
+        }
+        if (leader_ == -1) leader_ = fd;
+        fds_[i] = fd;
+        index_[i] = members_++;
+    }
+
+    if (leader_ == -1) {
+        err = "Failed to open performance counters: " + std::string(strerror(error));
+        return false;
+    }
+
+    ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+}
+
+void StageCounters::close() {
+    for (int i = 0; i < COUNTERS; ++i) {
+        if (fds_[i] != -1) ::close(fds_[i]);
+        fds_[i] = -1;
+        index_[i] = -1;
+    }
+    leader_ = -1;
+    members_ = 0;
+}
+
+bool StageCounters::read_values(uint64_t *values) {
+    uint64_t buf[1 + COUNTERS];
+    ssize_t size = (ssize_t) ((1 + members_) * sizeof(uint64_t));
+    if (::read(leader_, buf, size) != size) return false;
+
+    for (int i = 0; i < COUNTERS; ++i) {
+        values[i] = index_[i] != -1 ? buf[1 + index_[i]] : 0;
+    }
+    return true;
+}
+
+void StageCounters::start() {
+    if (leader_ == -1) return;
+    read_values(start_);
+}
+
+void StageCounters::stop(Stage stage, size_t calls) {
+    if (leader_ == -1) return;
+
+    uint64_t now[COUNTERS];
+    if (!read_values(now)) return;
+    for (int i = 0; i < COUNTERS; ++i) {
+        totals_[stage][i] += now[i] - start_[i];
+    }
+    calls_[stage] += calls;
+}
+
+void StageCounters::print(std::ostream &out) const {
+    out << "Stage counters, totals and per call:" << "\n";
+    for (int stage = 0; stage < STAGES; ++stage) {
+        out << "  " << std::left << std::setw(8) << StageNames[stage] << std::right
+                << calls_[stage] << " calls";
+        for (int i = 0; i < COUNTERS; ++i) {
+            if (index_[i] == -1) continue;
+            out << ", " << CounterNames[i] << " " << totals_[stage][i];
+            if (calls_[stage] > 0) out << " (" << totals_[stage][i] / calls_[stage] << ")";
+        }
+        if (index_[Cycles] != -1 && index_[Instructions] != -1 && totals_[stage][Cycles] > 0) {
+            std::streamsize precision = out.precision();
+            out << ", IPC " << std::fixed << std::setprecision(2)
+                    << (double) totals_[stage][Instructions] / totals_[stage][Cycles];
+            out.unsetf(std::ios::fixed);
+            out.precision(precision);
+        }
+        out << "\n";
+    }
+    out.flush();
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// Hardware and scheduler counters of the daemon's thread, accounted per stage of the hot path,
+// to tell whether a stage is slow on compute, on memory, on syscalls or on the scheduler.
+// The counters are one perf_event_open group, so each start() and stop() is a single read().
+// Counters the CPU or the hypervisor doesn't have are left out.
+class StageCounters {
+public:
+    enum Stage {
+        StageRead,    // device reads
+        StageConvert, // Converter push and pattern matching
+        StagePlan,    // building a conversion plan
+        StageWrite,   // uinput writes
+        StageSleep    // delays between output events
+    };
+
+    enum Counter {
+        Cycles,
+        Instructions,
+        CacheMisses,
+        ContextSwitches
+    };
+
+    static const int STAGES = 5;
+    static const int COUNTERS = 4;
+
+    std::string err;
+
+    StageCounters();
+
+    StageCounters(const StageCounters &) = delete;
+
+    StageCounters &operator=(const StageCounters &) = delete;
+
+    ~StageCounters();
+
+    bool open();
+
+    void close();
+
+    bool enabled() const { return leader_ != -1; }
+
+    // Starts measuring, until stop().
+    void start();
+
+    // Adds what was counted since start() to the stage, as `calls` more calls of it.
+    void stop(Stage stage, size_t calls = 1);
+
+    // Totals and per call averages of each stage.
+    void print(std::ostream &out) const;
+
+private:
+    int leader_;
+    int fds_[COUNTERS];
+    int index_[COUNTERS]; // position in the group's read, -1 if the counter isn't available
+    int members_;
+
+    uint64_t start_[COUNTERS];
+    uint64_t totals_[STAGES][COUNTERS];
+    uint64_t calls_[STAGES];
+
+    bool read_values(uint64_t *values);
+};
@@ -0,0 +1,159 @@
+#include "StreamFilter.h"
+#include "SystemBackend.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <unistd.h>
+
+StreamFilter::StreamFilter(Converter &conv) : clock(&system_clock()), conv_(conv), in_(BATCH) {
+    spans_.reserve(BATCH);
+    keys_.reserve(BATCH);
+    key_index_.reserve(BATCH);
+    plan_.reserve(PLAN_SIZE);
+}
+
+bool StreamFilter::run(int in_fd, int out_fd) {
+    err.clear();
+    out_fd_ = out_fd;
+    closed_ = false;
+
+    char *bytes = reinterpret_cast<char *>(in_.data());
+    const size_t capacity = in_.size() * sizeof(input_event);
+    size_t pending = 0; // bytes of a record split by the last read
+
+    while (true) {
+        ssize_t len = read(in_fd, bytes + pending, capacity - pending);
+        if (len == -1 && errno == EINTR) continue;
+        if (len == -1) {
+            err = "Failed to read input events: " + std::string(strerror(errno));
+            return false;
+        }
+        if (len == 0) {
+            if (pending != 0) err = "Input ended within an event";
+            return pending == 0;
+        }
+
+        // everything read is passed on before the next read blocks
+        size_t total = pending + len;
+        size_t count = total / sizeof(input_event);
+        if (!process(count) || !flush()) return closed_;
+
+        pending = total % sizeof(input_event);
+        memmove(bytes, bytes + count * sizeof(input_event), pending);
+    }
+}
+
+// Key events are taken out of the read buffer and pushed as a batch; at a trigger,
+// the events read up to it are written out before its conversion.
+bool StreamFilter::process(size_t count) {
+    keys_.clear();
+    key_index_.clear();
+    for (size_t i = 0; i < count; ++i) {
+        const input_event &ev = in_[i];
+        if (ev.type != EV_KEY) continue;
+        keys_.push_back({ev.code, ev.value, ev.time.tv_sec * 1000000LL + ev.time.tv_usec});
+        key_index_.push_back(i);
+    }
+
+    size_t passed = 0; // events of the read buffer passed so far
+    size_t pushed = 0;
+    while (pushed < keys_.size()) {
+        size_t consumed;
+        Action action = conv_.push_batch(keys_.data() + pushed, keys_.size() - pushed, consumed);
+        pushed += consumed;
+        if (action == None) break;
+
+        size_t trigger = key_index_[pushed - 1];
+        pass_range(passed, trigger + 1);
+        passed = trigger + 1;
+        if (!flush()) return false;
+        conv_.convert(action, plan_);
+        if (!plan_.empty()) ++conversions;
+        if (!write_plan(in_[trigger].time)) return false;
+    }
+    pass_range(passed, count);
+    return true;
+}
+
+// The convert and undo keys only trigger actions, as in grab mode, the rest passes.
+void StreamFilter::pass_range(size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+        const input_event *ev = &in_[i];
+        if (ev->type == EV_KEY && ev->code != 0 && (ev->code == conv_.conv_key || ev->code == conv_.undo_key)) {
+            continue;
+        }
+        pass(ev);
+    }
+}
+
+// Adds the event to the runs of the read buffer that are written as they are.
+void StreamFilter::pass(const input_event *ev) {
+    if (!spans_.empty()) {
+        iovec &last = spans_.back();
+        if (static_cast<char *>(last.iov_base) + last.iov_len == reinterpret_cast<const char *>(ev)) {
+            last.iov_len += sizeof(input_event);
+            return;
+        }
+    }
+    spans_.push_back({const_cast<input_event *>(ev), sizeof(input_event)});
+}
+
+bool StreamFilter::flush() {
+    if (spans_.empty()) return true;
+
+    TRACE2(output_batch, out_fd_, spans_.size());
+    bool written = write_all(spans_.data(), spans_.size());
+    spans_.clear();
+    return written;
+}
+
+bool StreamFilter::write_all(iovec *iov, size_t count) {
+    while (count > 0) {
+        ssize_t len = writev(out_fd_, iov, (int) std::min<size_t>(count, IOV_MAX));
+        if (len == -1 && errno == EINTR) continue;
+        if (len == -1) {
+            if (errno == EPIPE) {
+                closed_ = true;
+            } else {
+                err = "Failed to write output events: " + std::string(strerror(errno));
+            }
+            return false;
+        }
+
+        // skip what was written, a pipe may take only a part of it
+        while (count > 0 && (size_t) len >= iov->iov_len) {
+            len -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + len;
+            iov->iov_len -= len;
+        }
+    }
+    return true;
+}
+
+// Conversion output, one key per frame with the delay after it, as VirtualKeyboard writes it.
+// The frames carry the time of the trigger.
+bool StreamFilter::write_plan(const timeval &time) {
+    for (const auto &out: plan_) {
+        input_event frame[2] = {};
+        frame[0].time = time;
+        frame[0].type = EV_KEY;
+        frame[0].code = out.code;
+        frame[0].value = out.value;
+        frame[1].time = time;
+        frame[1].type = EV_SYN;
+        frame[1].code = SYN_REPORT;
+
+        TRACE4(output_write, out_fd_, EV_KEY, out.code, out.value);
+        iovec iov{frame, sizeof(frame)};
+        if (!write_all(&iov, 1)) return false;
+        clock->sleep_us(delay * 1000LL);
+    }
+    return true;
+}
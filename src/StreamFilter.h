@@ -0,0 +1,58 @@
+#pragma once
+
+#include "Backend.h"
+#include "Converter.h"
+
+#include <string>
+#include <vector>
+#include <sys/uio.h>
+#include <linux/input.h>
+
+// Converter as a stage of an evdev pipeline, like the filters of interception-tools:
+// raw input_event records are read from one fd and written to another, see easy-switcher --filter.
+// Events pass through as they were read, straight from the read buffer, except the convert
+// and undo keys, which only trigger actions. Conversion output is written in their place.
+class StreamFilter {
+public:
+    static const size_t BATCH = 1024; // events read at once
+
+    std::string err;
+
+    Clock *clock;
+    int delay = 10; // ms after each output key, as VirtualKeyboard
+
+    unsigned long conversions = 0;
+
+    explicit StreamFilter(Converter &conv);
+
+    StreamFilter(const StreamFilter &) = delete;
+
+    StreamFilter &operator=(const StreamFilter &) = delete;
+
+    // Filters until the end of the input. False if reading or writing fails,
+    // a closed output is an end too.
+    bool run(int in_fd, int out_fd);
+
+private:
+    Converter &conv_;
+    int out_fd_ = -1;
+    bool closed_ = false; // the reader of the output went away
+
+    std::vector<input_event> in_;
+    std::vector<iovec> spans_;     // runs of in_ to pass through
+    std::vector<KeyEvent> keys_;   // key events of in_, pushed as a batch
+    std::vector<size_t> key_index_; // their positions in in_
+    std::vector<KeyEvent> plan_;
+
+    bool process(size_t count);
+
+    void pass_range(size_t begin, size_t end);
+
+    void pass(const input_event *ev);
+
+    bool flush();
+
+    bool write_all(iovec *iov, size_t count);
+
+    bool write_plan(const timeval &time);
+};
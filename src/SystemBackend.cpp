@@ -0,0 +1,319 @@
+#include "SystemBackend.h"
+#include "DeviceManager.h"
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+
+long long SystemClock::now_us() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void SystemClock::sleep_us(long long us) {
+    usleep(us);
+}
+
+EvdevInput::~EvdevInput() {
+    for (size_t fd = 0; fd < devs_.size(); ++fd) {
+        if (devs_[fd]) close(fd);
+    }
+}
+
+int EvdevInput::open(const std::string &path, DeviceInfo &info) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) return -1;
+    return adopt(fd, info);
+}
+
+// The grab and the non-blocking mode belong to the open file, so they survive the handover.
+int EvdevInput::adopt(int fd, DeviceInfo &info) {
+    libevdev *dev = nullptr;
+    int rc = libevdev_new_from_fd(fd, &dev);
+    if (rc < 0) {
+        ::close(fd);
+        errno = -rc;
+        return -1;
+    }
+
+    const char *name = libevdev_get_name(dev);
+    info.name = name ? name : "";
+    info.bustype = libevdev_get_id_bustype(dev);
+    info.vendor = libevdev_get_id_vendor(dev);
+    info.product = libevdev_get_id_product(dev);
+    info.version = libevdev_get_id_version(dev);
+    info.keyboard = libevdev_has_event_code(dev, EV_KEY, KEY_A);
+    info.mouse = libevdev_has_event_code(dev, EV_KEY, BTN_LEFT);
+
+    // use the same clock as the rest of the daemon, so that event timestamps
+    // can be compared across devices and against the time of output
+    int clock = CLOCK_MONOTONIC;
+    ioctl(fd, EVIOCSCLOCKID, &clock);
+
+    if ((size_t) fd >= devs_.size()) {
+        devs_.resize(fd + 1, nullptr);
+        syncing_.resize(fd + 1, false);
+    }
+    devs_[fd] = dev;
+    syncing_[fd] = false;
+    return fd;
+}
+
+void EvdevInput::close(int fd) {
+    if (fd < 0 || (size_t) fd >= devs_.size() || !devs_[fd]) return;
+    libevdev_free(devs_[fd]);
+    devs_[fd] = nullptr;
+    ::close(fd);
+}
+
+// A resync that doesn't fit into `max` is continued on the next call.
+size_t EvdevInput::read(int fd, input_event *events, size_t max) {
+    if (fd < 0 || (size_t) fd >= devs_.size() || !devs_[fd]) return 0;
+
+    libevdev *dev = devs_[fd];
+    size_t count = 0;
+    while (count < max) {
+        int flag = syncing_[fd] ? LIBEVDEV_READ_FLAG_SYNC : LIBEVDEV_READ_FLAG_NORMAL;
+        int rc = libevdev_next_event(dev, flag, &events[count]);
+
+        if (rc == LIBEVDEV_READ_STATUS_SYNC) {
+            // the first SYN_DROPPED starts the resync, the rest are the resynced events
+            if (syncing_[fd]) ++count;
+            syncing_[fd] = true;
+        } else if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
+            ++count;
+        } else if (syncing_[fd]) {
+            syncing_[fd] = false; // resync done, continue with the normal events
+        } else {
+            break;
+        }
+    }
+
+    return count;
+}
+
+// The key state is asked from the kernel, as libevdev doesn't see events read by io_uring.
+bool EvdevInput::keys_down(int fd) {
+    unsigned char keys[KEY_MAX / 8 + 1] = {};
+    if (ioctl(fd, EVIOCGKEY(sizeof(keys)), keys) == -1) return true;
+    for (unsigned char bits: keys) {
+        if (bits) return true;
+    }
+    return false;
+}
+
+bool EvdevInput::grab(int fd) {
+    if (fd < 0 || (size_t) fd >= devs_.size() || !devs_[fd]) return false;
+    return libevdev_grab(devs_[fd], LIBEVDEV_GRAB) == 0;
+}
+
+InotifyHotplug::~InotifyHotplug() {
+    if (inotify_fd_ != -1) {
+        ::close(inotify_fd_);
+    }
+    if (timer_fd_ != -1) {
+        ::close(timer_fd_);
+    }
+}
+
+int InotifyHotplug::init(std::string &err) {
+    inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd_ == -1) {
+        err = "Failed to initialize inotify: " + std::string(strerror(errno));
+        return -1;
+    }
+
+    timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd_ == -1) {
+        err = "Failed to create device probe timer: " + std::string(strerror(errno));
+        ::close(inotify_fd_);
+        inotify_fd_ = -1;
+        return -1;
+    }
+
+    // IN_ATTRIB tells when udev has fixed the permissions of a node that failed to open
+    int wd = inotify_add_watch(inotify_fd_, INPUT_DEVICE_DIR.c_str(), IN_CREATE | IN_DELETE | IN_ATTRIB);
+    if (wd == -1) {
+        err = "Failed to add inotify watch on " + INPUT_DEVICE_DIR + ": " + std::string(strerror(errno));
+        ::close(inotify_fd_);
+        inotify_fd_ = -1;
+        return -1;
+    }
+
+    return inotify_fd_;
+}
+
+int InotifyHotplug::get_timer_fd() const {
+    return timer_fd_;
+}
+
+bool InotifyHotplug::list(std::vector<std::string> &paths, std::string &err) {
+    DIR *dir = opendir(INPUT_DEVICE_DIR.c_str());
+    if (!dir) {
+        err = "Failed to open input devices directory " + INPUT_DEVICE_DIR + ": " + std::string(strerror(errno));
+        return false;
+    }
+
+    dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        std::string name(entry->d_name);
+        if (name.find("event") != 0) continue;
+        paths.push_back(INPUT_DEVICE_DIR + name);
+    }
+    closedir(dir);
+    return true;
+}
+
+bool InotifyHotplug::next(NodeChange &change, std::string &path) {
+    while (true) {
+        if (pos_ >= len_) {
+            ssize_t len = ::read(inotify_fd_, buf_, sizeof(buf_));
+            if (len <= 0) return false;
+            len_ = len;
+            pos_ = 0;
+        }
+
+        auto *event = (struct inotify_event *) (buf_ + pos_);
+        pos_ += sizeof(struct inotify_event) + event->len;
+
+        if ((event->mask & IN_ISDIR) || event->len == 0 || strncmp(event->name, "event", 5) != 0) {
+            continue;
+        }
+
+        if (event->mask & IN_DELETE) {
+            change = NodeDeleted;
+        } else if (event->mask & IN_CREATE) {
+            change = NodeCreated;
+        } else if (event->mask & IN_ATTRIB) {
+            change = NodeChanged;
+        } else {
+            continue;
+        }
+
+        path = INPUT_DEVICE_DIR + event->name;
+        return true;
+    }
+}
+
+void InotifyHotplug::set_timer(long long delay_ms) {
+    uint64_t expirations;
+    if (::read(timer_fd_, &expirations, sizeof(expirations)) < 0) {
+        // the timer hasn't fired yet
+    }
+
+    itimerspec spec{};
+    if (delay_ms >= 0) {
+        if (delay_ms < 1) delay_ms = 1;
+        spec.it_value.tv_sec = delay_ms / 1000;
+        spec.it_value.tv_nsec = (delay_ms % 1000) * 1000000;
+    }
+    timerfd_settime(timer_fd_, 0, &spec, nullptr);
+}
+
+UinputOutput::~UinputOutput() {
+    if (uidev_) libevdev_uinput_destroy(uidev_);
+    if (dev_) libevdev_free(dev_);
+    if (fd_ != -1) ::close(fd_);
+}
+
+bool UinputOutput::create(const DeviceInfo &info, bool extended, std::string &err) {
+    dev_ = libevdev_new();
+    if (!dev_) {
+        err = "Failed to init libevdev";
+        return false;
+    }
+
+    libevdev_set_name(dev_, info.name.c_str());
+    libevdev_set_id_bustype(dev_, info.bustype);
+    libevdev_set_id_vendor(dev_, info.vendor);
+    libevdev_set_id_product(dev_, info.product);
+    libevdev_set_id_version(dev_, info.version);
+
+    libevdev_enable_event_type(dev_, EV_KEY);
+    libevdev_enable_event_type(dev_, EV_SYN);
+
+    for (int key = 0; key < 256; ++key) {
+        libevdev_enable_event_code(dev_, EV_KEY, key, nullptr);
+    }
+
+    // grabbed keyboards may send multimedia keys too, but no BTN_* codes:
+    // those would make the virtual keyboard look like a mouse or a joystick
+    if (extended) {
+        for (int key = KEY_OK; key <= KEY_MAX; ++key) {
+            libevdev_enable_event_code(dev_, EV_KEY, key, nullptr);
+        }
+    }
+
+    if (libevdev_uinput_create_from_device(dev_, LIBEVDEV_UINPUT_OPEN_MANAGED, &uidev_) < 0) {
+        err = "Failed to initialize virtual keyboard: " + std::string(strerror(errno));
+        libevdev_free(dev_);
+        dev_ = nullptr;
+        return false;
+    }
+
+    const char* node = nullptr;
+    for (int i = 0; i < 100; ++i) { // wait for device setup up to ~10s
+        node = libevdev_uinput_get_devnode(uidev_);
+        if (node && access(node, F_OK) == 0) {
+            return true;
+        }
+        usleep(100 * 1000); // 100 ms
+    }
+
+    err = "Timed out waiting for virtual keyboard to be ready";
+    return false;
+}
+
+// The device lives as long as a descriptor of it is open, closing the adopted one destroys it.
+bool UinputOutput::adopt(int fd, std::string &err) {
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+        err = "Failed to adopt virtual keyboard: " + std::string(strerror(errno));
+        return false;
+    }
+    fd_ = fd;
+    return true;
+}
+
+int UinputOutput::get_fd() const {
+    return uidev_ ? libevdev_uinput_get_fd(uidev_) : fd_;
+}
+
+bool UinputOutput::write(const input_event *events, size_t count) {
+    int fd = get_fd();
+    if (fd == -1 || count == 0) return false;
+
+    ssize_t size = count * sizeof(input_event);
+    ssize_t rc;
+    do {
+        rc = ::write(fd, events, size);
+    } while (rc == -1 && errno == EINTR);
+
+    return rc == size;
+}
+
+Clock &system_clock() {
+    static SystemClock clock;
+    return clock;
+}
+
+InputBackend &system_input() {
+    static EvdevInput input;
+    return input;
+}
+
+HotplugBackend &system_hotplug() {
+    static InotifyHotplug hotplug;
+    return hotplug;
+}
+
+OutputBackend &system_output() {
+    static UinputOutput output;
+    return output;
+}
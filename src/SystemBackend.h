@@ -0,0 +1,87 @@
+#pragma once
+
+#include "Backend.h"
+
+#include <libevdev/libevdev.h>
+#include <libevdev/libevdev-uinput.h>
+
+class SystemClock : public Clock {
+public:
+    long long now_us() override;
+
+    void sleep_us(long long us) override;
+};
+
+// evdev nodes read with libevdev.
+class EvdevInput : public InputBackend {
+public:
+    ~EvdevInput() override;
+
+    int open(const std::string &path, DeviceInfo &info) override;
+
+    int adopt(int fd, DeviceInfo &info) override;
+
+    void close(int fd) override;
+
+    size_t read(int fd, input_event *events, size_t max) override;
+
+    bool keys_down(int fd) override;
+
+    bool grab(int fd) override;
+
+private:
+    std::vector<libevdev *> devs_; // indexed by fd
+    std::vector<bool> syncing_;    // resync after SYN_DROPPED not finished yet
+};
+
+// /dev/input watched with inotify, probes timed with a timerfd.
+class InotifyHotplug : public HotplugBackend {
+public:
+    ~InotifyHotplug() override;
+
+    int init(std::string &err) override;
+
+    int get_timer_fd() const override;
+
+    bool list(std::vector<std::string> &paths, std::string &err) override;
+
+    bool next(NodeChange &change, std::string &path) override;
+
+    void set_timer(long long delay_ms) override;
+
+private:
+    int inotify_fd_ = -1;
+    int timer_fd_ = -1;
+
+    alignas(8) char buf_[4096];
+    size_t len_ = 0;
+    size_t pos_ = 0;
+};
+
+// uinput device created with libevdev.
+class UinputOutput : public OutputBackend {
+public:
+    ~UinputOutput() override;
+
+    bool create(const DeviceInfo &info, bool extended, std::string &err) override;
+
+    bool adopt(int fd, std::string &err) override;
+
+    int get_fd() const override;
+
+    bool write(const input_event *events, size_t count) override;
+
+private:
+    struct libevdev *dev_ = nullptr;
+    struct libevdev_uinput *uidev_ = nullptr;
+    int fd_ = -1; // the device was handed over, there is only its descriptor
+};
+
+// Backends used by default, shared by all instances.
+Clock &system_clock();
+
+InputBackend &system_input();
+
+HotplugBackend &system_hotplug();
+
+OutputBackend &system_output();
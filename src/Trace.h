@@ -0,0 +1,27 @@
+#pragma once
+
+// USDT tracepoints of the input-to-output pipeline, provider "easy_switcher".
+// A disabled probe is a single nop, so they stay in release builds. Without sys/sdt.h they compile to nothing.
+// Arguments are kept cheap to compute, probes get their own time from the tracer (nsecs in bpftrace).
+//
+//   input_fetch        fd, code, value, tv_sec, tv_usec  - event taken from a device, with its kernel timestamp
+//   converter_push     code, value, buffer size          - key event given to the converter
+//   converter_process  action, buffer size               - result of matching the trigger patterns
+//   converter_plan     action, plan size                 - output plan built for the action
+//   output_write       fd, type, code, value             - single key frame written to uinput
+//   output_batch       fd, events                        - batch of frames written to uinput
+//
+// Example: bpftrace -e 'usdt:/usr/bin/easy-switcher:easy_switcher:converter_plan { @[arg0] = hist(arg1); }'
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE2(name, a, b) DTRACE_PROBE2(easy_switcher, name, a, b)
+#define TRACE3(name, a, b, c) DTRACE_PROBE3(easy_switcher, name, a, b, c)
+#define TRACE4(name, a, b, c, d) DTRACE_PROBE4(easy_switcher, name, a, b, c, d)
+#define TRACE5(name, a, b, c, d, e) DTRACE_PROBE5(easy_switcher, name, a, b, c, d, e)
+#else
+#define TRACE2(name, a, b) do {} while (0)
+#define TRACE3(name, a, b, c) do {} while (0)
+#define TRACE4(name, a, b, c, d) do {} while (0)
+#define TRACE5(name, a, b, c, d, e) do {} while (0)
+#endif
@@ -0,0 +1,287 @@
+#include "UringBackend.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#ifdef HAVE_IO_URING
+
+static const unsigned IN_ENTRIES = 256;
+static const unsigned OUT_ENTRIES = 256;
+static const int BUF_GROUP = 0;
+static const unsigned BUF_COUNT = 64;           // power of 2, as required by the buffer ring
+static const unsigned BUF_EVENTS = EventQueue::SIZE;
+static const size_t CHUNK = OUT_ENTRIES / 2;   // events per submitted chain, each takes a write and a timeout
+
+static const __u64 CANCEL_TAG = ~0ULL;
+static const __u64 WRITE_TAG = ~0ULL - 1;
+
+UringBackend::UringBackend()
+    : event_fd_(-1), in_ring_{}, out_ring_{}, in_ready_(false), out_ready_(false), buf_ring_(nullptr), delay_{} {
+}
+
+UringBackend::~UringBackend() {
+    if (buf_ring_) io_uring_free_buf_ring(&in_ring_, buf_ring_, BUF_COUNT, BUF_GROUP);
+    if (in_ready_) io_uring_queue_exit(&in_ring_);
+    if (out_ready_) io_uring_queue_exit(&out_ring_);
+    if (event_fd_ != -1) close(event_fd_);
+}
+
+bool UringBackend::supported() {
+    return true;
+}
+
+bool UringBackend::init() {
+    err.clear();
+
+    int rc = io_uring_queue_init(IN_ENTRIES, &in_ring_, 0);
+    if (rc < 0) {
+        err = "Failed to initialize io_uring: " + std::string(strerror(-rc));
+        return false;
+    }
+    in_ready_ = true;
+
+    io_uring_probe *probe = io_uring_get_probe_ring(&in_ring_);
+    bool multishot = probe && io_uring_opcode_supported(probe, IORING_OP_READ_MULTISHOT);
+    if (probe) io_uring_free_probe(probe);
+    if (!multishot) {
+        err = "io_uring multishot reads are not supported by the kernel";
+        return false;
+    }
+
+    rc = io_uring_queue_init(OUT_ENTRIES, &out_ring_, 0);
+    if (rc < 0) {
+        err = "Failed to initialize io_uring: " + std::string(strerror(-rc));
+        return false;
+    }
+    out_ready_ = true;
+
+    buf_ring_ = io_uring_setup_buf_ring(&in_ring_, BUF_COUNT, BUF_GROUP, 0, &rc);
+    if (!buf_ring_) {
+        err = "Failed to set up io_uring buffers: " + std::string(strerror(-rc));
+        return false;
+    }
+
+    buffers_.resize(BUF_COUNT * BUF_EVENTS);
+    for (unsigned bid = 0; bid < BUF_COUNT; ++bid) {
+        io_uring_buf_ring_add(buf_ring_, &buffers_[bid * BUF_EVENTS], BUF_EVENTS * sizeof(input_event),
+                              bid, io_uring_buf_ring_mask(BUF_COUNT), bid);
+    }
+    io_uring_buf_ring_advance(buf_ring_, BUF_COUNT);
+
+    event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd_ == -1) {
+        err = "Failed to create io_uring notification: " + std::string(strerror(errno));
+        return false;
+    }
+
+    rc = io_uring_register_eventfd(&in_ring_, event_fd_);
+    if (rc < 0) {
+        err = "Failed to register io_uring notification: " + std::string(strerror(-rc));
+        return false;
+    }
+
+    armed_.resize(1024);
+    generations_.resize(1024);
+    frames_.resize(CHUNK * 2);
+    return true;
+}
+
+// Returns the descriptor to watch in the event loop, it becomes readable when reads complete.
+int UringBackend::get_fd() const {
+    return event_fd_;
+}
+
+bool UringBackend::add_device(int fd) {
+    err.clear();
+
+    if (fd < 0) {
+        err = "Cannot add device: Invalid file descriptor.";
+        return false;
+    }
+    if ((size_t) fd >= armed_.size()) {
+        armed_.resize(fd * 2);
+        generations_.resize(fd * 2);
+    }
+
+    ++generations_[fd];
+    armed_[fd] = true;
+    if (!arm(fd) || io_uring_submit(&in_ring_) < 0) {
+        armed_[fd] = false;
+        err = "Failed to post io_uring read for device";
+        return false;
+    }
+    return true;
+}
+
+void UringBackend::remove_device(int fd) {
+    if (fd < 0 || (size_t) fd >= armed_.size() || !armed_[fd]) return;
+    armed_[fd] = false;
+
+    io_uring_sqe *sqe = io_uring_get_sqe(&in_ring_);
+    if (!sqe) return;
+    io_uring_prep_cancel64(sqe, tag(fd), 0);
+    io_uring_sqe_set_data64(sqe, CANCEL_TAG);
+    io_uring_submit(&in_ring_);
+}
+
+// Move completed reads into the reader's device queues.
+// When a queue has no room left, the rest of the completions is kept for the next loop iteration.
+void UringBackend::fetch(InputReader &reader) {
+    uint64_t counter;
+    if (read(event_fd_, &counter, sizeof(counter)) < 0) {
+        // nothing to reset, completions are checked anyway
+    }
+
+    bool rearmed = false;
+    io_uring_cqe *cqe;
+    while (io_uring_peek_cqe(&in_ring_, &cqe) == 0) {
+        __u64 data = io_uring_cqe_get_data64(cqe);
+        if (data == CANCEL_TAG) {
+            io_uring_cqe_seen(&in_ring_, cqe);
+            continue;
+        }
+
+        // a read of a device that is gone, its fd may already belong to another one
+        int fd = (int) (data & 0xffffffff);
+        bool stale = fd < 0 || (size_t) fd >= armed_.size() || data != tag(fd);
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe->res > 0 && !stale) {
+                size_t count = cqe->res / sizeof(input_event);
+                if (reader.room(fd) < count) {
+                    // wake up again once the batch handler has drained the queues
+                    uint64_t one = 1;
+                    if (write(event_fd_, &one, sizeof(one)) < 0) {
+                        // the eventfd counter can't overflow here
+                    }
+                    break;
+                }
+                reader.push_events(fd, &buffers_[bid * BUF_EVENTS], count);
+            }
+            recycle(bid);
+        }
+
+        // a multishot read ends on errors and when buffers run out, repost it unless the device is gone
+        bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+        bool rearm = !more && !stale && (cqe->res >= 0 || cqe->res == -ENOBUFS) && armed_[fd];
+        if (!more && !rearm && !stale) armed_[fd] = false;
+        io_uring_cqe_seen(&in_ring_, cqe);
+
+        if (rearm) rearmed |= arm(fd);
+    }
+
+    if (rearmed) io_uring_submit(&in_ring_);
+}
+
+// Write the plan to the virtual keyboard as a chain of hard-linked write and timeout requests.
+// Hard links keep the chain going after each timeout completes with -ETIME.
+// Returns false if any frame was not written.
+bool UringBackend::write_plan(int fd, const std::vector<KeyEvent> &plan, int delay_ms) {
+    delay_.tv_sec = delay_ms / 1000;
+    delay_.tv_nsec = (delay_ms % 1000) * 1000000LL;
+
+    bool ok = true;
+    for (size_t start = 0; start < plan.size(); start += CHUNK) {
+        size_t count = std::min(CHUNK, plan.size() - start);
+
+        for (size_t i = 0; i < count; ++i) {
+            input_event *frame = &frames_[i * 2];
+            frame[0] = {};
+            frame[0].type = EV_KEY;
+            frame[0].code = plan[start + i].code;
+            frame[0].value = plan[start + i].value;
+            frame[1] = {};
+            frame[1].type = EV_SYN;
+            frame[1].code = SYN_REPORT;
+            TRACE4(output_write, fd, EV_KEY, frame[0].code, frame[0].value);
+
+            io_uring_sqe *sqe = io_uring_get_sqe(&out_ring_);
+            io_uring_prep_write(sqe, fd, frame, 2 * sizeof(input_event), 0);
+            io_uring_sqe_set_data64(sqe, WRITE_TAG);
+            io_uring_sqe_set_flags(sqe, IOSQE_IO_HARDLINK);
+
+            sqe = io_uring_get_sqe(&out_ring_);
+            io_uring_prep_timeout(sqe, &delay_, 0, 0);
+            io_uring_sqe_set_data64(sqe, 0);
+            if (i + 1 < count) io_uring_sqe_set_flags(sqe, IOSQE_IO_HARDLINK);
+        }
+
+        unsigned expected = count * 2;
+        int rc = io_uring_submit_and_wait(&out_ring_, expected);
+        if (rc < 0) return false;
+
+        for (unsigned seen = 0; seen < expected; ++seen) {
+            io_uring_cqe *cqe;
+            if (io_uring_wait_cqe(&out_ring_, &cqe) < 0) return false;
+            if (io_uring_cqe_get_data64(cqe) == WRITE_TAG && cqe->res != (int) (2 * sizeof(input_event))) {
+                ok = false;
+            }
+            io_uring_cqe_seen(&out_ring_, cqe);
+        }
+    }
+
+    return ok;
+}
+
+__u64 UringBackend::tag(int fd) const {
+    return (__u64) generations_[fd] << 32 | (unsigned) fd;
+}
+
+bool UringBackend::arm(int fd) {
+    io_uring_sqe *sqe = io_uring_get_sqe(&in_ring_);
+    if (!sqe) {
+        io_uring_submit(&in_ring_);
+        sqe = io_uring_get_sqe(&in_ring_);
+        if (!sqe) return false;
+    }
+
+    io_uring_prep_read_multishot(sqe, fd, 0, 0, BUF_GROUP);
+    io_uring_sqe_set_data64(sqe, tag(fd));
+    return true;
+}
+
+void UringBackend::recycle(unsigned short bid) {
+    io_uring_buf_ring_add(buf_ring_, &buffers_[bid * BUF_EVENTS], BUF_EVENTS * sizeof(input_event),
+                          bid, io_uring_buf_ring_mask(BUF_COUNT), 0);
+    io_uring_buf_ring_advance(buf_ring_, 1);
+}
+
+#else
+
+UringBackend::UringBackend() : event_fd_(-1) {
+}
+
+UringBackend::~UringBackend() = default;
+
+bool UringBackend::supported() {
+    return false;
+}
+
+bool UringBackend::init() {
+    err = "Easy Switcher is built without io_uring support";
+    return false;
+}
+
+int UringBackend::get_fd() const {
+    return event_fd_;
+}
+
+bool UringBackend::add_device(int) {
+    err = "Easy Switcher is built without io_uring support";
+    return false;
+}
+
+void UringBackend::remove_device(int) {
+}
+
+void UringBackend::fetch(InputReader &) {
+}
+
+bool UringBackend::write_plan(int, const std::vector<KeyEvent> &, int) {
+    return false;
+}
+
+#endif
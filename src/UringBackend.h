@@ -0,0 +1,65 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <linux/input.h>
+
+#include "Converter.h"
+#include "InputReader.h"
+
+#ifdef HAVE_IO_URING
+#include <liburing.h>
+#endif
+
+// Optional io_uring backend for device reads and virtual keyboard writes.
+// Every device has a multishot read posted into a shared buffer ring, so one wakeup costs
+// a single eventfd read however many devices are ready. A replay is submitted as a chain of
+// hard-linked write and timeout requests, so it costs a syscall per chunk instead of two per event.
+class UringBackend {
+public:
+    UringBackend();
+
+    ~UringBackend();
+
+    std::string err;
+
+    static bool supported();
+
+    bool init();
+
+    int get_fd() const;
+
+    bool add_device(int fd);
+
+    void remove_device(int fd);
+
+    void fetch(InputReader &reader);
+
+    bool write_plan(int fd, const std::vector<KeyEvent> &plan, int delay_ms);
+
+private:
+    int event_fd_;
+
+#ifdef HAVE_IO_URING
+    io_uring in_ring_;
+    io_uring out_ring_;
+    bool in_ready_;
+    bool out_ready_;
+
+    io_uring_buf_ring *buf_ring_;
+    std::vector<input_event> buffers_;
+    std::vector<char> armed_; // indexed by fd
+    // indexed by fd, bumped whenever a device takes the fd; reads are tagged with it,
+    // so the late completions of a closed device don't touch a new one that reuses its fd
+    std::vector<unsigned> generations_;
+
+    std::vector<input_event> frames_;
+    __kernel_timespec delay_;
+
+    __u64 tag(int fd) const;
+
+    bool arm(int fd);
+
+    void recycle(unsigned short bid);
+#endif
+};
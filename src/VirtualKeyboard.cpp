@@ -1,55 +1,27 @@
 #include "VirtualKeyboard.h"
+#include "SystemBackend.h"
+#include "Trace.h"
 
-#include <cstring>
-#include <unistd.h>
+#include <cstdio>
+#include <functional>
 
-VirtualKeyboard::VirtualKeyboard() : dev_(nullptr), uidev_(nullptr) {}
+VirtualKeyboard::VirtualKeyboard() : output(&system_output()), clock(&system_clock()), created_(false) {}
 
-VirtualKeyboard::~VirtualKeyboard() {
-    if (uidev_) libevdev_uinput_destroy(uidev_);
-    if (dev_) libevdev_free(dev_);
-}
+VirtualKeyboard::~VirtualKeyboard() = default;
 
 bool VirtualKeyboard::init() {
     err.clear();
 
-    dev_ = libevdev_new();
-    if (!dev_) {
-        err = "Failed to init libevdev";
-        return false;
-    }
-
-    libevdev_set_name(dev_, name);
-    libevdev_set_id_bustype(dev_, bustype);
-    libevdev_set_id_vendor(dev_, vendor);
-    libevdev_set_id_product(dev_, product);
-    libevdev_set_id_version(dev_, version);
-
-    libevdev_enable_event_type(dev_, EV_KEY);
-    libevdev_enable_event_type(dev_, EV_SYN);
-
-    for (int key = 0; key < 256; ++key) {
-        libevdev_enable_event_code(dev_, EV_KEY, key, nullptr);
-    }
-
-    if (libevdev_uinput_create_from_device(dev_, LIBEVDEV_UINPUT_OPEN_MANAGED, &uidev_) < 0) {
-        err = "Failed to initialize virtual keyboard: " + std::string(strerror(errno));
-        libevdev_free(dev_);
-        dev_ = nullptr;
-        return false;
-    }
-
-    const char* node = nullptr;
-    for (int i = 0; i < 100; ++i) { // wait for device setup up to ~10s
-        node = libevdev_uinput_get_devnode(uidev_);
-        if (node && access(node, F_OK) == 0) {
-            return true;
-        }
-        usleep(100 * 1000); // 100 ms
-    }
-
-    err = "Timed out waiting for virtual keyboard to be ready";
-    return false;
+    DeviceInfo info{name, bustype, vendor, product, version, true, false};
+    created_ = output->create(info, passthrough, err);
+    return created_;
+}
+
+bool VirtualKeyboard::adopt(int fd) {
+    err.clear();
+
+    created_ = output->adopt(fd, err);
+    return created_;
 }
 
 std::string VirtualKeyboard::get_uid() const {
@@ -63,11 +35,38 @@ std::string VirtualKeyboard::get_uid() const {
     return buf;
 }
 
+int VirtualKeyboard::get_fd() const {
+    return output->get_fd();
+}
+
 void VirtualKeyboard::emit_key(int code, int value) {
-    if (!uidev_) return;
+    if (!created_) return;
+
+    input_event frame[2] = {};
+    frame[0].type = EV_KEY;
+    frame[0].code = code;
+    frame[0].value = value;
+    frame[1].type = EV_SYN;
+    frame[1].code = SYN_REPORT;
+
+    TRACE4(output_write, output->get_fd(), EV_KEY, code, value);
+    if (counters) counters->start();
+    output->write(frame, 2);
+    if (counters) counters->stop(StageCounters::StageWrite);
+
+    if (counters) counters->start();
+    clock->sleep_us(delay * 1000LL);
+    if (counters) counters->stop(StageCounters::StageSleep);
+}
 
-    libevdev_uinput_write_event(uidev_, EV_KEY, code, value);
-    libevdev_uinput_write_event(uidev_, EV_SYN, SYN_REPORT, 0);
+// Write a batch of ready-made events with a single syscall, without any delay.
+// Used to pass through the events of grabbed keyboards, frames must already contain their SYN_REPORTs.
+bool VirtualKeyboard::write_events(const input_event *events, size_t count) {
+    if (!created_ || count == 0) return false;
 
-    usleep(delay * 1000);
-}
\ No newline at end of file
+    TRACE2(output_batch, output->get_fd(), count);
+    if (counters) counters->start();
+    bool written = output->write(events, count);
+    if (counters) counters->stop(StageCounters::StageWrite);
+    return written;
+}
@@ -1,8 +1,9 @@
 #pragma once
 
+#include "Backend.h"
+#include "StageCounters.h"
+
 #include <string>
-#include <libevdev/libevdev.h>
-#include <libevdev/libevdev-uinput.h>
 
 class VirtualKeyboard {
 public:
@@ -12,6 +13,10 @@ public:
 
     std::string err;
 
+    OutputBackend *output;
+    Clock *clock;
+    StageCounters *counters = nullptr;
+
     const char *name = "Easy Switcher virtual keyboard";
     int bustype = BUS_VIRTUAL;
     int vendor = 0x0777;
@@ -20,13 +25,21 @@ public:
 
     int delay = 10;
 
+    bool passthrough = false; // also forwards events of grabbed keyboards
+
     bool init();
 
+    // Keeps writing to the device of the previous instance, see Handoff.
+    bool adopt(int fd);
+
     std::string get_uid() const;
 
+    int get_fd() const;
+
     void emit_key(int code, int value);
 
+    bool write_events(const input_event *events, size_t count);
+
 private:
-    struct libevdev *dev_;
-    struct libevdev_uinput *uidev_;
+    bool created_;
 };
@@ -4,14 +4,27 @@
 #include <fstream>
 #include <iostream>
 #include <libgen.h>
+#include <unistd.h>
 #include <sstream>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
+#include <ctime>
+#include <iomanip>
+#include <unordered_map>
 
 #include "Config.h"
+#include "ControlSocket.h"
 #include "Converter.h"
+#include "DebugLog.h"
 #include "DeviceManager.h"
 #include "EventLoop.h"
+#include "Handoff.h"
 #include "InputReader.h"
+#include "LowLatency.h"
+#include "Pipeline.h"
+#include "StageCounters.h"
+#include "StreamFilter.h"
+#include "UringBackend.h"
 #include "VirtualKeyboard.h"
 
 #define VERSION "0.5"
@@ -23,73 +36,292 @@ InputReader reader;
 VirtualKeyboard vk;
 Converter conv;
 Config conf;
+LowLatency low_latency;
+UringBackend uring;
+DebugLog debug_log;
+ControlSocket control;
+StageCounters stage_counters;
+Handoff handoff;
+Pipeline pipeline(reader, vk, conv);
 
 bool debug_mode = false;
+bool low_latency_mode = false;
+bool use_uring = false;
+bool counters_mode = false;
+std::string control_path;
+std::string control_group;
+
+char **main_argv = nullptr;
+int resume_fd = -1; // handoff of the previous instance, see --resume
+bool resumed = false;
+int stats_fd = -1; // written on SIGUSR1, watched by the loop
+volatile sig_atomic_t restart_requested = 0;
+volatile sig_atomic_t exit_requested = 0;
 
 void signal_handler(int signum) {
     std::cout << "\nGot exit signal (" << signum << "). Bye." << std::endl;
+    exit_requested = 1;
+    loop.stop();
+}
+
+void print_allocations() {
+    std::cout << "Heap allocations after startup: " << LowLatency::allocations()
+            << (debug_mode ? " (including debug output)." : ".") << std::endl;
+}
+
+// SIGUSR1 prints the stage counters, see 'stage-counters',
+// and the heap allocations in low latency mode.
+// It only wakes the loop: stopping it would hold back the keys read in that round.
+void stats_handler(int) {
+    int saved = errno;
+    uint64_t flag = 1;
+    if (stats_fd != -1) write(stats_fd, &flag, sizeof(flag));
+    errno = saved;
+}
+
+void stats_command_handler(int fd) {
+    uint64_t flag;
+    if (read(fd, &flag, sizeof(flag)) != sizeof(flag)) return;
+    if (stage_counters.enabled()) stage_counters.print(std::cout);
+    if (low_latency_mode) print_allocations();
+}
+
+// SIGUSR2 restarts the daemon in place, e.g. after an upgrade, see restart().
+void restart_handler(int) {
+    restart_requested = 1;
     loop.stop();
 }
 
 void input_handler(int device_fd) {
-    int code, value;
-    while (reader.fetch(device_fd, code, value)) {
-        if (conv.push(code, value)) {
-            if (debug_mode) {
-                std::cout << "Input event: " << reader.get_key_name(code) << " "
-                        << reader.get_key_state(value) << " from: "
-                        << reader.get_device_name(device_fd) << std::endl;
-                std::cout << "Buffer: " << conv.get_buffer_dump() << std::endl;
-            }
+    stage_counters.start();
+    reader.read(device_fd);
+    stage_counters.stop(StageCounters::StageRead);
+}
 
-            Action action_needed = conv.process();
+// With io_uring, all devices are read by the kernel and a single handler collects the results.
+void uring_handler(int) {
+    stage_counters.start();
+    uring.fetch(reader);
+    stage_counters.stop(StageCounters::StageRead);
+}
 
-            if (action_needed != None) {
-                if (debug_mode) std::cout << "Convert pattern detected, processing..." << std::endl;
+void batch_handler() {
+    pipeline.process();
+}
 
-                for (const auto &ev: conv.convert(action_needed)) {
-                    vk.emit_key(ev.code, ev.value);
-                    if (debug_mode) {
-                        std::cout << "Output: " << reader.get_key_name(ev.code) << " "
-                                << reader.get_key_state(ev.value) << std::endl;
-                    }
-                }
-                reader.flush();
-                if (debug_mode) std::cout << "Buffer: " << conv.get_buffer_dump() << std::endl;
-            }
+void device_handler(int) {
+    pipeline.probe(manager);
+}
+
+// Commands of the control socket, see --control.
+void control_handler(int) {
+    int command;
+    ControlState state{};
+    while (control.receive(command)) {
+        pipeline.command(command, state);
+        control.reply(state);
+    }
+}
+
+// Devices are read by the kernel with io_uring, or watched by the loop.
+bool watch_device(int device_fd, bool added) {
+    if (!added) {
+        if (use_uring) uring.remove_device(device_fd);
+        else loop.remove_handler(device_fd);
+        return true;
+    }
+
+    if (use_uring ? !uring.add_device(device_fd) : !loop.add_handler(device_fd, input_handler)) {
+        std::cerr << (use_uring ? uring.err : loop.err) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Takes over the virtual keyboard of the previous instance, see restart().
+// One without the extended key codes can't pass grabbed keyboards through, a new one is created then.
+bool resume_output() {
+    if (!handoff.receive(resume_fd)) {
+        std::cerr << handoff.err << ", starting anew." << std::endl;
+        handoff.close();
+        return false;
+    }
+    resumed = true;
+    if (handoff.output_extended != vk.passthrough || !vk.adopt(handoff.output_fd)) return false;
+
+    handoff.output_fd = -1;
+    return true;
+}
+
+// Takes over the devices and the typed text of the previous instance.
+// Whatever isn't taken over is closed, releasing its grab; devices are then opened anew by probing.
+void resume_devices() {
+    for (auto &device: handoff.devices) {
+        int fd = reader.adopt_device(device.path, device.fd, device.grabbed);
+        device.fd = -1;
+        if (fd == -1) {
+            if (debug_mode) std::cout << "Skipped device " << device.path << ": " << reader.err << std::endl;
+            continue;
         }
+        if (!watch_device(fd, true)) {
+            reader.remove_device(device.path);
+            continue;
+        }
+        std::string name = reader.get_device_name(fd);
+        if (debug_log.enabled()) debug_log.device(fd, name);
+        if (debug_mode) std::cout << "Resumed device " << device.path << ": " << name << std::endl;
     }
+
+    conv.restore(handoff.converter);
+    handoff.close();
 }
 
-void device_handler(int watcher_fd) {
-    bool connected;
-    std::string path;
+// Hands the open devices and the typed text over to a new image of the daemon, executed in place
+// so that the PID stays the same for the service manager. Only returns if that fails.
+void restart() {
+    std::cout << "Restarting..." << std::endl;
 
-    while (manager.fetch(path, connected)) {
-        if (connected) {
-            int device_fd = reader.add_device(path);
-            if (device_fd != -1) {
-                if (!loop.add_handler(device_fd, input_handler)) {
-                    std::cerr << loop.err << std::endl;
-                } else {
-                    std::string uid = reader.get_device_uid(device_fd);
-                    std::string name = reader.get_device_name(device_fd);
-                    if (debug_mode)
-                        std::cout << "Added device " << path << ": " << name << ", UID=" << uid <<
-                                std::endl;
-                }
-            } else {
-                if (debug_mode) std::cout << "Skipped device " << path << ": " << reader.err << std::endl;
-            }
-        } else {
-            int device_fd = reader.get_device_fd(path);
-            if (device_fd != -1) {
-                loop.remove_handler(device_fd);
-                reader.remove_device(path);
-                if (debug_mode) std::cout << "Removed device: " << path << std::endl;
-            }
+    // with io_uring, reads that have already completed are taken before the rings go away
+    if (use_uring) {
+        for (const Device &device: reader.get_devices()) {
+            if (device.fd != -1) uring.remove_device(device.fd);
+        }
+        uring.fetch(reader);
+    }
+    // the loop stopped without its batch callback, events read in its last round are still queued
+    pipeline.process();
+
+    handoff.output_fd = vk.get_fd();
+    handoff.output_extended = vk.passthrough;
+    handoff.devices.clear();
+    for (const Device &device: reader.get_devices()) {
+        if (device.fd != -1) handoff.devices.push_back({device.path, device.fd, device.grabbed});
+    }
+    conv.save(handoff.converter);
+
+    int fd;
+    if (handoff.send(fd)) {
+        debug_log.close();
+        std::string fd_arg = std::to_string(fd);
+        const char *args[] = {main_argv[0], debug_mode ? "--debug" : "--run", "--resume", fd_arg.c_str(), nullptr};
+        execvp(main_argv[0], const_cast<char *const *>(args));
+        handoff.err = "Failed to execute " + std::string(main_argv[0]) + ": " + std::string(strerror(errno));
+    }
+    std::cerr << handoff.err << ", going on without restart." << std::endl;
+    handoff.close();
+
+    if (use_uring) {
+        for (const Device &device: reader.get_devices()) {
+            if (device.fd != -1) uring.add_device(device.fd);
+        }
+    }
+}
+
+// Reads the settings of the converter and its output from the open config.
+// `layouts` is set to the 'layouts' value.
+bool read_converter_config(std::string &layouts) {
+    std::string layout_switch;
+    if (!conf.get_string("Easy Switcher", "layout-switch", layout_switch)) {
+        std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
+                << "Error: invalid 'layout-switch' value." << std::endl;
+        return false;
+    }
+
+    if (sscanf(layout_switch.c_str(), "%d+%d", &conv.ls_keys[0], &conv.ls_keys[1]) < 1) {
+        std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
+                << "Invalid 'layout-switch' value: " << layout_switch << std::endl;
+        return false;
+    }
+
+    if (conv.ls_keys[0] >= 0 && conv.ls_keys[0] <= 255 && conv.ls_keys[1] >= 0 && conv.ls_keys[1] <= 255) {
+        if (debug_mode) std::cout << "layout-switch=" << conv.ls_keys[0] << "+" << conv.ls_keys[1] << std::endl;
+    } else {
+        std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
+                << "Invalid 'layout-switch' value: Key code is out of valid range (0..255)." << std::endl;
+        return false;
+    }
+
+    if (!conf.get_int("Easy Switcher", "convert-key", conv.conv_key)) {
+        std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
+                << "Error: invalid 'convert-key' value." << std::endl;
+        return false;
+    }
+
+    if (conv.conv_key >= 0 && conv.conv_key <= 255) {
+        if (debug_mode) std::cout << "convert-key=" << conv.conv_key << std::endl;
+    } else {
+        std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
+                << "Error: 'convert-key' is out of valid range (0–255)." << std::endl;
+        return false;
+    }
+
+    if (conf.has("Easy Switcher", "undo-key")) {
+        if (!conf.get_int("Easy Switcher", "undo-key", conv.undo_key) ||
+            conv.undo_key < 0 || conv.undo_key > 255 || (conv.undo_key != 0 && conv.undo_key == conv.conv_key)) {
+            std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
+                    << "Error: invalid 'undo-key' value." << std::endl;
+            return false;
+        }
+        if (debug_mode) std::cout << "undo-key=" << conv.undo_key << std::endl;
+    }
+
+    if (conf.has("Easy Switcher", "layouts")) {
+        conf.get_string("Easy Switcher", "layouts", layouts);
+        if (!layouts.empty() && !conv.layouts.load(layouts)) {
+            std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
+                    << "Error: invalid 'layouts' value. " << conv.layouts.err << std::endl;
+            return false;
+        }
+        if (debug_mode) std::cout << "layouts=" << layouts << std::endl;
+    }
+
+    if (conf.has("Easy Switcher", "auto-convert")) {
+        if (!conf.get_bool("Easy Switcher", "auto-convert", conv.auto_convert)) {
+            std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
+                    << "Error: invalid 'auto-convert' value." << std::endl;
+            return false;
+        }
+        if (conv.auto_convert && !conv.layouts.has_models()) {
+            std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
+                    << "Error: 'auto-convert' needs 'layouts' with an n-gram model next to each keymap."
+                    << std::endl;
+            return false;
         }
+        if (debug_mode) std::cout << "auto-convert=" << (conv.auto_convert ? "true" : "false") << std::endl;
     }
+
+    if (conf.has("Easy Switcher", "trigger-window")) {
+        if (!conf.get_int("Easy Switcher", "trigger-window", conv.trigger_window) || conv.trigger_window < 0) {
+            std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
+                    << "Error: invalid 'trigger-window' value." << std::endl;
+            return false;
+        }
+        if (debug_mode) std::cout << "trigger-window=" << conv.trigger_window << std::endl;
+    }
+
+    if (conf.has("Easy Switcher", "expand-window")) {
+        if (!conf.get_int("Easy Switcher", "expand-window", conv.expand_window) || conv.expand_window < 0) {
+            std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
+                    << "Error: invalid 'expand-window' value." << std::endl;
+            return false;
+        }
+        if (debug_mode) std::cout << "expand-window=" << conv.expand_window << std::endl;
+    }
+
+    if (!conf.get_int("Easy Switcher", "delay", vk.delay)) {
+        std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
+                << "Error: invalid 'delay' value." << std::endl;
+        return false;
+    }
+
+    if (vk.delay > 0) {
+        if (debug_mode) std::cout << "delay=" << vk.delay << std::endl;
+    } else {
+        std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
+                << "Error: 'delay' value is out of valid range." << std::endl;
+        return false;
+    }
+    return true;
 }
 
 bool run() {
@@ -106,6 +338,10 @@ bool run() {
     sigaction(SIGHUP, &sa, nullptr);
     sigaction(SIGQUIT, &sa, nullptr);
     sigaction(SIGTERM, &sa, nullptr);
+    sa.sa_handler = restart_handler;
+    sigaction(SIGUSR2, &sa, nullptr);
+    sa.sa_handler = stats_handler;
+    sigaction(SIGUSR1, &sa, nullptr);
     if (debug_mode) std::cout << "Signal handlers set." << std::endl;
 
     if (loop.init()) {
@@ -121,6 +357,14 @@ bool run() {
         return false;
     }
     loop.add_handler(fd, device_handler);
+    loop.add_handler(manager.get_timer_fd(), device_handler);
+
+    stats_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (stats_fd == -1 || !loop.add_handler(stats_fd, stats_command_handler)) {
+        std::cerr << "Failed to watch SIGUSR1: " << (stats_fd == -1 ? strerror(errno) : loop.err) << std::endl;
+        return false;
+    }
+    loop.set_batch_handler(batch_handler);
     if (debug_mode) std::cout << "Device manager initialized." << std::endl;
 
     if (reader.init()) {
@@ -130,66 +374,113 @@ bool run() {
         return false;
     }
 
-    if (vk.init()) {
-        std::string uid = vk.get_uid();
-        reader.add_to_blacklist(uid);
-        if (debug_mode) std::cout << "Virtual keyboard created: " << vk.name << ", UID=" << uid << std::endl;
-    } else {
-        std::cerr << vk.err << std::endl;
-        return false;
-    }
-
     // Reading config
     if (debug_mode) std::cout << "Loading configuration..." << std::endl;
 
     if (conf.open(CONFIG_FILE)) {
-        std::string layout_switch;
-        if (!conf.get_string("Easy Switcher", "layout-switch", layout_switch)) {
-            std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
-                    << "Error: invalid 'layout-switch' value." << std::endl;
-            return false;
+        std::string layouts;
+        if (!read_converter_config(layouts)) return false;
+
+        if (conf.has("Easy Switcher", "grab")) {
+            if (!conf.get_bool("Easy Switcher", "grab", reader.grab)) {
+                std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
+                        << "Error: invalid 'grab' value." << std::endl;
+                return false;
+            }
+            vk.passthrough = reader.grab;
+            if (debug_mode) std::cout << "grab=" << (reader.grab ? "true" : "false") << std::endl;
         }
 
-        if (sscanf(layout_switch.c_str(), "%d+%d", &conv.ls_keys[0], &conv.ls_keys[1]) < 1) {
+        // an automatic conversion starts unasked, without grab the keys typed meanwhile
+        // would reach applications in the middle of its output
+        if (conv.auto_convert && !reader.grab) {
             std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
-                    << "Invalid 'layout-switch' value: " << layout_switch << std::endl;
+                    << "Error: 'auto-convert' needs 'grab=true'." << std::endl;
             return false;
         }
 
-        if (conv.ls_keys[0] >= 0 && conv.ls_keys[0] <= 255 && conv.ls_keys[1] >= 0 && conv.ls_keys[1] <= 255) {
-            if (debug_mode) std::cout << "layout-switch=" << conv.ls_keys[0] << "+" << conv.ls_keys[1] << std::endl;
-        } else {
-            std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
-                    << "Invalid 'layout-switch' value: Key code is out of valid range (0..255)." << std::endl;
-            return false;
+        if (conf.has("Easy Switcher", "low-latency")) {
+            if (!conf.get_bool("Easy Switcher", "low-latency", low_latency_mode)) {
+                std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
+                        << "Error: invalid 'low-latency' value." << std::endl;
+                return false;
+            }
+            if (debug_mode) std::cout << "low-latency=" << (low_latency_mode ? "true" : "false") << std::endl;
         }
 
-        if (!conf.get_int("Easy Switcher", "convert-key", conv.conv_key)) {
-            std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
-                    << "Error: invalid 'convert-key' value." << std::endl;
-            return false;
+        if (conf.has("Easy Switcher", "realtime-priority")) {
+            if (!conf.get_int("Easy Switcher", "realtime-priority", low_latency.priority) ||
+                low_latency.priority < 0 || low_latency.priority > 99) {
+                std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
+                        << "Error: 'realtime-priority' is out of valid range (0–99)." << std::endl;
+                return false;
+            }
+            if (debug_mode) std::cout << "realtime-priority=" << low_latency.priority << std::endl;
         }
 
-        if (conv.conv_key >= 0 && conv.conv_key <= 255) {
-            if (debug_mode) std::cout << "convert-key=" << conv.conv_key << std::endl;
-        } else {
-            std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
-                    << "Error: 'convert-key' is out of valid range (0–255)." << std::endl;
-            return false;
+        if (conf.has("Easy Switcher", "cpu-affinity")) {
+            if (!conf.get_int("Easy Switcher", "cpu-affinity", low_latency.cpu) || low_latency.cpu < -1) {
+                std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
+                        << "Error: invalid 'cpu-affinity' value." << std::endl;
+                return false;
+            }
+            if (debug_mode) std::cout << "cpu-affinity=" << low_latency.cpu << std::endl;
         }
 
-        if (!conf.get_int("Easy Switcher", "delay", vk.delay)) {
-            std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
-                    << "Error: invalid 'delay' value." << std::endl;
-            return false;
+        if (conf.has("Easy Switcher", "stage-counters")) {
+            if (!conf.get_bool("Easy Switcher", "stage-counters", counters_mode)) {
+                std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
+                        << "Error: invalid 'stage-counters' value." << std::endl;
+                return false;
+            }
+            if (counters_mode && !stage_counters.open()) {
+                std::cerr << stage_counters.err << std::endl;
+                return false;
+            }
+            if (debug_mode) std::cout << "stage-counters=" << (counters_mode ? "true" : "false") << std::endl;
         }
 
-        if (vk.delay > 0) {
-            if (debug_mode) std::cout << "delay=" << vk.delay << std::endl;
-        } else {
-            std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
-                    << "Error: 'delay' value is out of valid range." << std::endl;
-            return false;
+        if (conf.has("Easy Switcher", "io-backend")) {
+            std::string backend;
+            conf.get_string("Easy Switcher", "io-backend", backend);
+            if (backend == "io_uring") {
+                if (!UringBackend::supported()) {
+                    std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
+                            << "Error: 'io-backend=io_uring' is not supported by this build." << std::endl;
+                    return false;
+                }
+                use_uring = true;
+            } else if (backend != "epoll") {
+                std::cerr << "Failed to parse configuration file: " << CONFIG_FILE << "\n"
+                        << "Error: invalid 'io-backend' value." << std::endl;
+                return false;
+            }
+            if (debug_mode) std::cout << "io-backend=" << backend << std::endl;
+        }
+
+        if (conf.has("Easy Switcher", "debug-log")) {
+            std::string debug_log_path;
+            conf.get_string("Easy Switcher", "debug-log", debug_log_path);
+            if (!debug_log_path.empty()) {
+                if (!debug_log.open(debug_log_path)) {
+                    std::cerr << debug_log.err << std::endl;
+                    return false;
+                }
+                debug_log.header(conv.conv_key, conv.undo_key, conv.ls_keys);
+                debug_log.triggers(conv.trigger_window, conv.expand_window);
+                if (conv.layouts.count() > 0) debug_log.layouts(layouts, conv.auto_convert);
+            }
+            if (debug_mode) std::cout << "debug-log=" << debug_log_path << std::endl;
+        }
+
+        if (conf.has("Easy Switcher", "control-socket")) {
+            conf.get_string("Easy Switcher", "control-socket", control_path);
+            if (debug_mode) std::cout << "control-socket=" << control_path << std::endl;
+        }
+
+        if (conf.has("Easy Switcher", "control-group")) {
+            conf.get_string("Easy Switcher", "control-group", control_group);
+            if (debug_mode) std::cout << "control-group=" << control_group << std::endl;
         }
 
         std::string blacklist;
@@ -221,11 +512,84 @@ bool run() {
     }
     if (debug_mode) std::cout << "Configuration file loaded." << std::endl;
 
+    if (resume_fd != -1 && resume_output()) {
+        std::string uid = vk.get_uid();
+        reader.add_to_blacklist(uid);
+        if (debug_mode) std::cout << "Virtual keyboard resumed: " << vk.name << ", UID=" << uid << std::endl;
+    } else if (vk.init()) {
+        std::string uid = vk.get_uid();
+        reader.add_to_blacklist(uid);
+        if (debug_mode) std::cout << "Virtual keyboard created: " << vk.name << ", UID=" << uid << std::endl;
+    } else {
+        std::cerr << vk.err << std::endl;
+        return false;
+    }
+
+    if (use_uring) {
+        if (uring.init() && loop.add_handler(uring.get_fd(), uring_handler)) {
+            if (debug_mode) std::cout << "io_uring backend initialized." << std::endl;
+        } else {
+            std::cerr << (uring.err.empty() ? loop.err : uring.err) << ", falling back to epoll." << std::endl;
+            use_uring = false;
+        }
+    }
+
+    pipeline.uring = use_uring ? &uring : nullptr;
+    pipeline.debug_log = &debug_log;
+    pipeline.counters = counters_mode ? &stage_counters : nullptr;
+    vk.counters = pipeline.counters;
+    pipeline.debug_mode = debug_mode;
+    // per-event debug output is replaced by the binary log if it is enabled
+    pipeline.debug_text = debug_mode && !debug_log.enabled();
+    pipeline.watch = watch_device;
+    pipeline.reserve();
+
+    if (!control_path.empty()) {
+        if (!control.open(control_path, control_group) || !loop.add_handler(control.get_fd(), control_handler)) {
+            std::cerr << (control.err.empty() ? loop.err : control.err) << std::endl;
+            return false;
+        }
+        if (debug_mode) std::cout << "Control socket opened." << std::endl;
+    }
+
+    if (resumed) {
+        resume_devices();
+        if (debug_mode) std::cout << "Resumed from the previous instance." << std::endl;
+    }
+
+    // devices present at startup, later ones are reported by the device manager
+    pipeline.probe(manager);
+
+    if (low_latency_mode) {
+        if (!low_latency.apply()) {
+            std::cerr << low_latency.err << std::endl;
+            return false;
+        }
+        LowLatency::count_allocations();
+        if (debug_mode) std::cout << "Low latency mode enabled." << std::endl;
+    }
+
     // Start main loop
     if (debug_mode) std::cout << "Starting event loop..." << std::endl;
-    if (!loop.run()) {
-        std::cerr << loop.err << std::endl;
-        return false;
+    while (true) {
+        if (!loop.run()) {
+            std::cerr << loop.err << std::endl;
+            return false;
+        }
+        if (exit_requested || !restart_requested) break;
+        restart_requested = 0;
+        restart();
+    }
+    debug_log.close();
+    if (stage_counters.enabled()) stage_counters.print(std::cout);
+
+    if (low_latency_mode) print_allocations();
+
+    const LatencyStats &latency = pipeline.passthrough_latency;
+    if (reader.grab && latency.count > 0) {
+        std::cout << "Passthrough latency: avg " << latency.total_us / (long long) latency.count
+                << " us, max " << latency.max_us << " us, "
+                << latency.count << " key events." << std::endl;
     }
 
     return true;
@@ -236,11 +600,39 @@ bool configure() {
     std::cout << "Checking existing config...";
 
     int delay;
+    int undo_key = 0;
+    std::string io_backend = "epoll";
+    bool grab = false;
+    bool low_latency_enabled = false;
+    bool stage_counters_enabled = false;
+    int priority = 0;
+    int cpu = -1;
+    std::string debug_log_path;
+    std::string layouts;
+    bool auto_convert = false;
+    int trigger_window = DEFAULT_TRIGGER_WINDOW;
+    int expand_window = DEFAULT_EXPAND_WINDOW;
+    std::string control_socket = CONTROL_SOCKET;
+    std::string control_socket_group;
     std::string blacklist;
     if (conf.open(CONFIG_FILE)) {
         if (conf.get_int("Easy Switcher", "delay", delay, 10) &&
             conf.get_string("Easy Switcher", "blacklist", blacklist, "")
         ) {
+            conf.get_int("Easy Switcher", "undo-key", undo_key, 0);
+            conf.get_bool("Easy Switcher", "grab", grab, false);
+            conf.get_string("Easy Switcher", "io-backend", io_backend, "epoll");
+            conf.get_bool("Easy Switcher", "low-latency", low_latency_enabled, false);
+            conf.get_bool("Easy Switcher", "stage-counters", stage_counters_enabled, false);
+            conf.get_int("Easy Switcher", "realtime-priority", priority, 0);
+            conf.get_int("Easy Switcher", "cpu-affinity", cpu, -1);
+            conf.get_string("Easy Switcher", "debug-log", debug_log_path, "");
+            conf.get_string("Easy Switcher", "layouts", layouts, "");
+            conf.get_bool("Easy Switcher", "auto-convert", auto_convert, false);
+            conf.get_int("Easy Switcher", "trigger-window", trigger_window, DEFAULT_TRIGGER_WINDOW);
+            conf.get_int("Easy Switcher", "expand-window", expand_window, DEFAULT_EXPAND_WINDOW);
+            conf.get_string("Easy Switcher", "control-socket", control_socket, CONTROL_SOCKET);
+            conf.get_string("Easy Switcher", "control-group", control_socket_group, "");
             std::cout << "Done." << std::endl;
         } else {
             delay = 10;
@@ -425,6 +817,48 @@ bool configure() {
     cfg_file << "# convert-key=0\n\n";
     cfg_file << "convert-key=" << conv_key << "\n\n\n";
 
+    cfg_file << "# Scancode of the key that undoes the last conversion,\n";
+    cfg_file << "# as long as the converted text wasn't edited since.\n";
+    cfg_file << "# Set 0 to disable.\n";
+    cfg_file << "# Example:\n";
+    cfg_file << "# undo-key=0\n\n";
+    cfg_file << "undo-key=" << undo_key << "\n\n\n";
+
+    cfg_file << "# Layouts the layout switch cycles through, in its order, when there are more than two.\n";
+    cfg_file << "# Easy Switcher then switches straight to the layout the text most likely\n";
+    cfg_file << "# was meant for. Names refer to keymaps in /usr/share/easy-switcher/layouts,\n";
+    cfg_file << "# a path can be given instead. The first layout must be active at startup.\n";
+    cfg_file << "# Empty for two layouts, they need no keymaps.\n";
+    cfg_file << "# Example:\n";
+    cfg_file << "# layouts=us,ru,ua\n\n";
+    cfg_file << "layouts=" << layouts << "\n\n\n";
+
+    cfg_file << "# Convert a word on its own when it is typed in the wrong layout,\n";
+    cfg_file << "# as soon as it ends. Needs 'layouts' and an n-gram model of each,\n";
+    cfg_file << "# <name>.ngram next to the keymap, made with 'easy-switcher --build-model'.\n";
+    cfg_file << "# Needs 'grab' too, so that keys typed during a conversion wait for it.\n";
+    cfg_file << "# Default value is false.\n";
+    cfg_file << "# Example:\n";
+    cfg_file << "# auto-convert=false\n\n";
+    cfg_file << "auto-convert=" << (auto_convert ? "true" : "false") << "\n\n\n";
+
+    cfg_file << "# Longest time in ms between the key events of a double shift.\n";
+    cfg_file << "# Shift taps further apart, such as a shift tapped again a few seconds later,\n";
+    cfg_file << "# don't convert. 0 accepts any timing.\n";
+    cfg_file << "# Default value is " << DEFAULT_TRIGGER_WINDOW << " ms.\n";
+    cfg_file << "# Example:\n";
+    cfg_file << "# trigger-window=500\n\n";
+    cfg_file << "trigger-window=" << trigger_window << "\n\n\n";
+
+    cfg_file << "# Converting a word again within this many ms after the last conversion\n";
+    cfg_file << "# also converts the word before it, one more word with each trigger.\n";
+    cfg_file << "# Only the new word is retyped, the cursor moves over the rest.\n";
+    cfg_file << "# 0 converts the last word back instead.\n";
+    cfg_file << "# Default value is " << DEFAULT_EXPAND_WINDOW << " ms.\n";
+    cfg_file << "# Example:\n";
+    cfg_file << "# expand-window=1500\n\n";
+    cfg_file << "expand-window=" << expand_window << "\n\n\n";
+
     cfg_file << "# Easy Switcher waits a small delay before sending keys.\n";
     cfg_file << "# This helps your system handle all events correctly.\n";
     cfg_file << "# Smaller delay makes switching faster, but may cause errors.\n";
@@ -434,6 +868,60 @@ bool configure() {
     cfg_file << "# delay=10\n\n";
     cfg_file << "delay=" << delay << "\n\n\n";
 
+    cfg_file << "# Grab keyboards and pass their input through the virtual keyboard.\n";
+    cfg_file << "# Applications then never see the convert key, and keys typed\n";
+    cfg_file << "# during a conversion are delivered after it instead of mixing in.\n";
+    cfg_file << "# Default value is false.\n";
+    cfg_file << "# Example:\n";
+    cfg_file << "# grab=false\n\n";
+    cfg_file << "grab=" << (grab ? "true" : "false") << "\n\n\n";
+
+    cfg_file << "# Backend used to read keyboards and write the output: epoll or io_uring.\n";
+    cfg_file << "# io_uring needs Linux 6.7 or newer and a build with WITH_IO_URING=ON,\n";
+    cfg_file << "# it falls back to epoll when the kernel doesn't support it.\n";
+    cfg_file << "# Default value is epoll.\n";
+    cfg_file << "# Example:\n";
+    cfg_file << "# io-backend=epoll\n\n";
+    cfg_file << "io-backend=" << io_backend << "\n\n\n";
+
+    cfg_file << "# Low latency mode locks Easy Switcher in memory, so it is never\n";
+    cfg_file << "# paged out, and reports heap allocations made after startup on exit.\n";
+    cfg_file << "# Optionally it also runs with the realtime priority (1-99, 0 to skip)\n";
+    cfg_file << "# and on a single CPU (-1 to skip).\n";
+    cfg_file << "# Default values are false, 0 and -1.\n";
+    cfg_file << "# Example:\n";
+    cfg_file << "# low-latency=true\n";
+    cfg_file << "# realtime-priority=50\n";
+    cfg_file << "# cpu-affinity=1\n\n";
+    cfg_file << "low-latency=" << (low_latency_enabled ? "true" : "false") << "\n";
+    cfg_file << "realtime-priority=" << priority << "\n";
+    cfg_file << "cpu-affinity=" << cpu << "\n\n\n";
+
+    cfg_file << "# Counts CPU cycles, instructions, cache misses and context switches\n";
+    cfg_file << "# of each stage of the key path: device reads, conversion, plans,\n";
+    cfg_file << "# output writes and delays. Totals are printed on SIGUSR1 and on exit.\n";
+    cfg_file << "# Needs performance counters, see perf_event_open(2).\n";
+    cfg_file << "# Default value is false.\n";
+    cfg_file << "# Example:\n";
+    cfg_file << "# stage-counters=true\n\n";
+    cfg_file << "stage-counters=" << (stage_counters_enabled ? "true" : "false") << "\n\n\n";
+
+    cfg_file << "# File to write a binary debug log to, empty to disable.\n";
+    cfg_file << "# Logging doesn't slow down typing, so it can stay on while\n";
+    cfg_file << "# chasing a rare bug. Read it with 'easy-switcher --decode-log FILE'.\n";
+    cfg_file << "# Example:\n";
+    cfg_file << "# debug-log=/var/log/easy-switcher.log\n\n";
+    cfg_file << "debug-log=" << debug_log_path << "\n\n\n";
+
+    cfg_file << "# Unix socket for commands from shortcuts and scripts, empty to disable.\n";
+    cfg_file << "# Send them with 'easy-switcher --control COMMAND'. Only root may send\n";
+    cfg_file << "# commands, or also the members of control-group if it is set.\n";
+    cfg_file << "# Example:\n";
+    cfg_file << "# control-socket=" << CONTROL_SOCKET << "\n";
+    cfg_file << "# control-group=input\n\n";
+    cfg_file << "control-socket=" << control_socket << "\n";
+    cfg_file << "control-group=" << control_socket_group << "\n\n\n";
+
 
     cfg_file << "# If you get unwanted input from a specific device,\n";
     cfg_file << "# add its UID to the blacklist below.\n";
@@ -453,6 +941,268 @@ bool configure() {
     return true;
 }
 
+// Renders a binary debug log as the text --debug would print.
+// The converter is replayed from the logged input, so the buffer dumps and output are rebuilt here
+// and checked against the logged plan sizes.
+bool decode_log(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        std::cerr << "Failed to open debug log: " << path << "\n" << strerror(errno) << std::endl;
+        return false;
+    }
+
+    LogRecord record{};
+    if (!file.read(reinterpret_cast<char *>(&record), sizeof(record)) ||
+        record.type != LogHeader || strncmp(record.text, LOG_MAGIC, sizeof(record.text)) != 0) {
+        std::cerr << "Not an Easy Switcher debug log: " << path << std::endl;
+        return false;
+    }
+
+    auto header = [](const LogRecord &header) {
+        conv.conv_key = header.code;
+        conv.undo_key = header.value;
+        conv.ls_keys[0] = header.fd;
+        conv.ls_keys[1] = header.size;
+        std::cout << "layout-switch=" << conv.ls_keys[0] << "+" << conv.ls_keys[1] << "\n"
+                << "convert-key=" << conv.conv_key << "\n"
+                << "undo-key=" << conv.undo_key << std::endl;
+        // until a LogTriggers record says otherwise, the log is older than trigger windows
+        conv.trigger_window = 0;
+        conv.expand_window = 0;
+    };
+    header(record);
+
+    std::unordered_map<int, std::string> names;
+    std::vector<KeyEvent> plan;
+    std::string dump;
+    size_t replayed = 0; // size of the plan rebuilt for the last action
+    bool have_replayed = false;
+
+    while (file.read(reinterpret_cast<char *>(&record), sizeof(record))) {
+        // events the converter doesn't take weren't printed by --debug either
+        if (record.type == LogInput && !conv.push(record.code, record.value, record.time_us)) continue;
+
+        std::cout << "[" << record.time_us / 1000000 << "." << std::setfill('0') << std::setw(6)
+                << record.time_us % 1000000 << std::setfill(' ') << "] ";
+
+        switch (record.type) {
+            case LogHeader:
+                // the daemon started again and appended to the log; text carried over
+                // a restart isn't logged, so the replay starts over with an empty buffer
+                std::cout << "Started again" << std::endl;
+                conv.clear_buffer();
+                conv.layouts.load(""); // no keymaps until its LogLayouts record
+                conv.auto_convert = false;
+                names.clear();
+                have_replayed = false;
+                header(record);
+                break;
+
+            case LogDevice:
+                names[record.fd] = std::string(record.text, strnlen(record.text, sizeof(record.text)));
+                std::cout << "Added device: " << names[record.fd] << std::endl;
+                break;
+
+            case LogRemoved:
+                std::cout << "Removed device: " << names[record.fd] << std::endl;
+                names.erase(record.fd);
+                break;
+
+            case LogInput:
+                std::cout << "Input event: " << reader.get_key_name(record.code) << " "
+                        << reader.get_key_state(record.value) << " from: " << names[record.fd] << "\n";
+                dump.clear();
+                conv.get_buffer_dump(dump);
+                std::cout << "Buffer: " << dump << std::endl;
+
+                {
+                    Action action = conv.process();
+                    if (action == None) break;
+
+                    std::cout << (action == Undo ? "Undo" : "Convert") << " pattern detected, processing..." << "\n";
+                    conv.convert(action, plan);
+                    for (const auto &out: plan) {
+                        std::cout << "Output: " << reader.get_key_name(out.code) << " "
+                                << reader.get_key_state(out.value) << "\n";
+                    }
+                    if (conv.layouts.count() > 0) {
+                        std::cout << "Layout: " << conv.layouts.name(conv.get_layout()) << "\n";
+                    }
+                    replayed = plan.size();
+                    have_replayed = true;
+
+                    dump.clear();
+                    conv.get_buffer_dump(dump);
+                    std::cout << "Buffer: " << dump << std::endl;
+                }
+                break;
+
+            case LogControl:
+                std::cout << "Control command " << record.code << "\n";
+                if (record.code == CommandPause || record.code == CommandClear) {
+                    conv.clear_buffer();
+                } else if (record.code >= CommandConvertWord && record.code <= CommandUndo) {
+                    Action action = record.code == CommandConvertWord ? ConvertWord
+                                    : record.code == CommandConvertAll ? ConvertAll : Undo;
+                    conv.convert(action, plan);
+                    for (const auto &out: plan) {
+                        std::cout << "Output: " << reader.get_key_name(out.code) << " "
+                                << reader.get_key_state(out.value) << "\n";
+                    }
+                    replayed = plan.size();
+                    have_replayed = true;
+                }
+                dump.clear();
+                conv.get_buffer_dump(dump);
+                std::cout << "Buffer: " << dump << std::endl;
+                break;
+
+            case LogPlan:
+                if (!have_replayed || replayed != record.size) {
+                    std::cout << "Warning: the daemon sent " << record.size
+                            << " events, the replay doesn't match from here on" << std::endl;
+                } else {
+                    std::cout << "Sent " << record.size << " events" << std::endl;
+                }
+                have_replayed = false;
+                break;
+
+            case LogLayouts:
+                {
+                    std::string list(record.text, strnlen(record.text, sizeof(record.text)));
+                    if (conv.layouts.load(list)) {
+                        conv.auto_convert = record.value != 0 && conv.layouts.has_models();
+                        std::cout << "layouts=" << list << "\n"
+                                << "auto-convert=" << (conv.auto_convert ? "true" : "false") << std::endl;
+                        if (record.value != 0 && !conv.auto_convert) {
+                            std::cout << "Warning: n-gram models not found, automatic conversions aren't replayed"
+                                    << std::endl;
+                        }
+                    } else {
+                        std::cout << "Warning: layouts=" << list << " not loaded, assuming two layouts. "
+                                << conv.layouts.err << std::endl;
+                    }
+                }
+                break;
+
+            case LogTriggers:
+                conv.trigger_window = record.value;
+                conv.expand_window = (int) record.size;
+                std::cout << "trigger-window=" << conv.trigger_window << "\n"
+                        << "expand-window=" << conv.expand_window << std::endl;
+                break;
+
+            case LogDropped:
+                std::cout << record.size << " records dropped, buffer restarted" << std::endl;
+                conv.clear_buffer();
+                break;
+
+            default:
+                std::cout << "Unknown record type " << record.type << std::endl;
+                break;
+        }
+    }
+
+    return true;
+}
+
+// Learns an n-gram model of a layout's language from a text typed in it.
+bool build_model(const std::string &keymap, const std::string &text, const std::string &path) {
+    Layouts layouts;
+    if (!layouts.load_keymap(keymap)) {
+        std::cerr << layouts.err << std::endl;
+        return false;
+    }
+
+    std::ifstream corpus(text);
+    if (!corpus) {
+        std::cerr << "Failed to open " << text << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        std::cerr << "Failed to create " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    if (!layouts.build_model(0, corpus, out)) {
+        std::cerr << layouts.err << std::endl;
+        return false;
+    }
+
+    std::cout << "Model of " << layouts.name(0) << " written to " << path << std::endl;
+    return true;
+}
+
+// Sends a command to the running daemon and prints its state.
+bool send_command(const std::string &name) {
+    static const std::pair<const char *, int> Commands[] = {
+        {"state", CommandState}, {"convert-word", CommandConvertWord}, {"convert-all", CommandConvertAll},
+        {"undo", CommandUndo}, {"pause", CommandPause}, {"resume", CommandResume}, {"clear", CommandClear}
+    };
+    int command = -1;
+    for (const auto &entry: Commands) {
+        if (name == entry.first) command = entry.second;
+    }
+    if (command == -1) {
+        std::cerr << "Unknown command: " << name << "\n"
+                << "Commands: state, convert-word, convert-all, undo, pause, resume, clear" << std::endl;
+        return false;
+    }
+
+    std::string path = CONTROL_SOCKET;
+    if (conf.open(CONFIG_FILE) && conf.has("Easy Switcher", "control-socket")) {
+        conf.get_string("Easy Switcher", "control-socket", path);
+        if (path.empty()) {
+            std::cerr << "The control socket is disabled in " << CONFIG_FILE << std::endl;
+            return false;
+        }
+    }
+
+    ControlState state{};
+    if (!control.request(path, command, state)) {
+        std::cerr << control.err << std::endl;
+        return false;
+    }
+
+    size_t layouts = state.layouts > 0 ? state.layouts : 2;
+    std::cout << "Paused: " << (state.paused ? "yes" : "no") << "\n"
+            << "Layout: " << state.layout + 1 << " of " << layouts << "\n"
+            << "Buffer: " << state.buffer_size << " events, cursor at " << state.cursor << "\n"
+            << "Conversions: " << state.conversions << "\n"
+            << "Devices: " << state.devices << std::endl;
+
+    if (state.status != StatusOk) {
+        std::cerr << (state.status == StatusUnknown ? "The daemon doesn't know this command"
+                                                    : "Nothing to do") << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Filters raw input events from stdin to stdout. Messages go to stderr,
+// stdout is the event stream.
+bool filter() {
+    if (!conf.open(CONFIG_FILE)) {
+        std::cerr << conf.err << std::endl;
+        return false;
+    }
+    std::string layouts;
+    if (!read_converter_config(layouts)) return false;
+
+    // the end of the pipeline going away ends the filter
+    signal(SIGPIPE, SIG_IGN);
+
+    StreamFilter stream(conv);
+    stream.delay = vk.delay;
+    if (!stream.run(STDIN_FILENO, STDOUT_FILENO)) {
+        std::cerr << stream.err << std::endl;
+        return false;
+    }
+    return true;
+}
+
 void show_help() {
     std::cout << "Easy Switcher - keyboard layout switcher v" << VERSION << "\n"
             << "Usage: easy-switcher [option]\n"
@@ -460,11 +1210,28 @@ void show_help() {
             << "   -c,   --configure   configure Easy Switcher\n"
             << "   -r,   --run         run\n"
             << "   -d,   --debug       run in a debug mode\n"
+            << "         --decode-log  print a binary debug log, see 'debug-log' in the config\n"
+            << "         --build-model KEYMAP TEXT MODEL\n"
+            << "                       learn an n-gram model of a layout for 'auto-convert'\n"
+            << "         --control COMMAND\n"
+            << "                       send a command to the running daemon: state, convert-word,\n"
+            << "                       convert-all, undo, pause, resume or clear\n"
+            << "         --filter      filter input events from stdin to stdout, as a stage of an\n"
+            << "                       evdev pipeline such as interception-tools\n"
             << "   -h,   --help        show this help" << std::endl;
 }
 
 int main(int argc, char *argv[]) {
+    main_argv = argv;
     std::string option = (argc == 2) ? argv[1] : "--help";
+    // a restart executes the daemon again with the handoff socket, see restart()
+    if (argc == 4 && strcmp(argv[2], "--resume") == 0) {
+        option = argv[1];
+        resume_fd = atoi(argv[3]);
+    }
+    if (argc == 3 && strcmp(argv[1], "--decode-log") == 0) option = argv[1];
+    if (argc == 5 && strcmp(argv[1], "--build-model") == 0) option = argv[1];
+    if (argc == 3 && strcmp(argv[1], "--control") == 0) option = argv[1];
 
     if (option == "-c" || option == "--configure") {
         if (!configure()) {
@@ -476,6 +1243,22 @@ int main(int argc, char *argv[]) {
             std::cerr << "Easy Switcher failed, exiting.\n";
             return EXIT_FAILURE;
         }
+    } else if (option == "--decode-log" && argc == 3) {
+        if (!decode_log(argv[2])) {
+            return EXIT_FAILURE;
+        }
+    } else if (option == "--build-model" && argc == 5) {
+        if (!build_model(argv[2], argv[3], argv[4])) {
+            return EXIT_FAILURE;
+        }
+    } else if (option == "--control" && argc == 3) {
+        if (!send_command(argv[2])) {
+            return EXIT_FAILURE;
+        }
+    } else if (option == "--filter") {
+        if (!filter()) {
+            return EXIT_FAILURE;
+        }
     } else if (option == "-d" || option == "--debug") {
         debug_mode = true;
         if (!run()) {
@@ -0,0 +1,301 @@
+#include "SimBackend.h"
+
+#include <cerrno>
+
+static timeval to_timeval(long long us) {
+    timeval tv{};
+    tv.tv_sec = us / 1000000;
+    tv.tv_usec = us % 1000000;
+    return tv;
+}
+
+SimInput::SimInput(Clock &clock) : clock_(clock) {}
+
+void SimInput::add_node(const std::string &path, const std::string &name, bool keyboard, size_t capacity,
+                        bool mouse) {
+    nodes_.emplace_back();
+    Node &node = nodes_.back();
+    node.path = path;
+    node.info = {name, BUS_USB, 0x1234, (int) nodes_.size(), 1, keyboard, mouse || !keyboard};
+    node.capacity = capacity;
+    node.present = true;
+    node.fd = -1;
+    node.failures = 0;
+    node.grabbed = false;
+    node.dropped = false;
+    node.next = 0;
+    node.buffer.resize(capacity);
+    node.head = 0;
+    node.count = 0;
+    node.resync.reserve(KEYS + 1);
+    node.resync_next = 0;
+    node.down.assign(KEYS, 0);
+    node.seen.assign(KEYS, 0);
+    node.snapshot.assign(KEYS, 0);
+}
+
+void SimInput::remove_node(const std::string &path) {
+    Node *node = find(path);
+    if (node) node->present = false;
+}
+
+void SimInput::fail_opens(const std::string &path, int count) {
+    Node *node = find(path);
+    if (node) node->failures = count;
+}
+
+void SimInput::schedule(const std::string &path, long long time_us, int code, int value) {
+    Node *node = find(path);
+    if (!node) return;
+
+    input_event ev{};
+    ev.time = to_timeval(time_us);
+    ev.type = EV_KEY;
+    ev.code = code;
+    ev.value = value;
+    node->scheduled.push_back(ev);
+
+    ev.type = EV_SYN;
+    ev.code = SYN_REPORT;
+    ev.value = 0;
+    node->scheduled.push_back(ev);
+}
+
+void SimInput::deliver() {
+    for (auto &node: nodes_) {
+        deliver(node);
+    }
+}
+
+long long SimInput::next_time() const {
+    long long next = -1;
+    for (const auto &node: nodes_) {
+        if (!node.present || node.next == node.scheduled.size()) continue;
+        const timeval &tv = node.scheduled[node.next].time;
+        long long us = tv.tv_sec * 1000000LL + tv.tv_usec;
+        if (next == -1 || us < next) next = us;
+    }
+    return next;
+}
+
+void SimInput::readable(std::vector<int> &fds) {
+    fds.clear();
+    for (auto &node: nodes_) {
+        if (!node.present || node.fd == -1) continue;
+        deliver(node);
+        if (node.count > 0 || node.dropped || node.resync_next < node.resync.size()) {
+            fds.push_back(node.fd);
+        }
+    }
+}
+
+int SimInput::open(const std::string &path, DeviceInfo &info) {
+    Node *node = find(path);
+    if (!node) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (node->failures > 0) {
+        --node->failures;
+        errno = EACCES;
+        return -1;
+    }
+
+    node->fd = next_fd_++;
+    if ((size_t) node->fd >= open_.size()) open_.resize(node->fd + 1, nullptr);
+    open_[node->fd] = node;
+    node->grabbed = false;
+    node->dropped = false;
+    node->head = 0;
+    node->count = 0;
+    node->resync.clear();
+    node->resync_next = 0;
+    node->seen = node->down; // like libevdev, the state is known from the start
+    info = node->info;
+    return node->fd;
+}
+
+int SimInput::adopt(int fd, DeviceInfo &info) {
+    Node *node = find(fd);
+    if (!node || fd == -1) {
+        errno = EBADF;
+        return -1;
+    }
+    info = node->info;
+    return fd;
+}
+
+void SimInput::close(int fd) {
+    Node *node = find(fd);
+    if (!node) return;
+    open_[fd] = nullptr;
+    node->fd = -1;
+    node->grabbed = false;
+    node->count = 0;
+}
+
+size_t SimInput::read(int fd, input_event *events, size_t max) {
+    Node *node = find(fd);
+    if (!node || !node->present) return 0;
+    deliver(*node);
+
+    if (node->dropped) {
+        node->dropped = false;
+        node->resync.clear();
+        node->resync_next = 0;
+        for (int code = 0; code < KEYS; ++code) {
+            if (node->seen[code] == node->snapshot[code]) continue;
+            input_event ev{};
+            ev.time = to_timeval(clock_.now_us());
+            ev.type = EV_KEY;
+            ev.code = code;
+            ev.value = node->snapshot[code];
+            node->resync.push_back(ev);
+            node->seen[code] = node->snapshot[code];
+        }
+        if (!node->resync.empty()) {
+            input_event ev{};
+            ev.time = to_timeval(clock_.now_us());
+            ev.type = EV_SYN;
+            ev.code = SYN_REPORT;
+            node->resync.push_back(ev);
+        }
+    }
+
+    size_t count = 0;
+    while (count < max && node->resync_next < node->resync.size()) {
+        events[count++] = node->resync[node->resync_next++];
+    }
+
+    while (count < max && node->count > 0) {
+        const input_event &ev = node->buffer[node->head];
+        node->head = (node->head + 1) % node->capacity;
+        --node->count;
+        if (ev.type == EV_KEY) node->seen[ev.code] = ev.value != 0;
+        events[count++] = ev;
+    }
+
+    return count;
+}
+
+bool SimInput::keys_down(int fd) {
+    Node *node = find(fd);
+    if (!node) return true;
+    for (char down: node->down) {
+        if (down) return true;
+    }
+    return false;
+}
+
+bool SimInput::grab(int fd) {
+    Node *node = find(fd);
+    if (!node) return false;
+    node->grabbed = true;
+    return true;
+}
+
+// The latest node with this path, it may have been unplugged and plugged again.
+SimInput::Node *SimInput::find(const std::string &path) {
+    for (auto it = nodes_.rbegin(); it != nodes_.rend(); ++it) {
+        if (it->path == path) return &*it;
+    }
+    return nullptr;
+}
+
+SimInput::Node *SimInput::find(int fd) {
+    return fd >= 0 && (size_t) fd < open_.size() ? open_[fd] : nullptr;
+}
+
+void SimInput::deliver(Node &node) {
+    long long now = clock_.now_us();
+    while (node.present && node.next < node.scheduled.size()) {
+        const input_event &ev = node.scheduled[node.next];
+        if (ev.time.tv_sec * 1000000LL + ev.time.tv_usec > now) break;
+        ++node.next;
+
+        if (node.fd != -1) push(node, ev);
+        if (ev.type == EV_KEY) {
+            node.down[ev.code] = ev.value != 0;
+            if (node.fd == -1 || !node.grabbed) ++direct_events;
+        }
+    }
+}
+
+// A full buffer is dropped as a whole, as evdev does.
+void SimInput::push(Node &node, const input_event &ev) {
+    if (node.count == node.capacity) {
+        node.count = 0;
+        node.snapshot = node.down;
+        node.dropped = true;
+        ++dropped_buffers;
+    }
+
+    node.buffer[(node.head + node.count) % node.capacity] = ev;
+    ++node.count;
+}
+
+SimHotplug::SimHotplug(Clock &clock) : clock_(clock) {}
+
+void SimHotplug::change(NodeChange change, const std::string &path) {
+    changes_.emplace_back(change, path);
+}
+
+bool SimHotplug::pending() {
+    return !changes_.empty() || (due_us_ >= 0 && due_us_ <= clock_.now_us());
+}
+
+int SimHotplug::init(std::string &) {
+    return 100;
+}
+
+int SimHotplug::get_timer_fd() const {
+    return 101;
+}
+
+bool SimHotplug::list(std::vector<std::string> &paths, std::string &) {
+    paths = initial;
+    return true;
+}
+
+bool SimHotplug::next(NodeChange &change, std::string &path) {
+    if (changes_.empty()) return false;
+    change = changes_.front().first;
+    path = changes_.front().second;
+    changes_.pop_front();
+    return true;
+}
+
+void SimHotplug::set_timer(long long delay_ms) {
+    if (delay_ms < 0) {
+        due_us_ = -1;
+        return;
+    }
+    if (delay_ms < 1) delay_ms = 1;
+    due_us_ = clock_.now_us() + delay_ms * 1000;
+}
+
+SimOutput::SimOutput(Clock &clock) : clock_(clock) {}
+
+bool SimOutput::create(const DeviceInfo &, bool, std::string &) {
+    return true;
+}
+
+bool SimOutput::adopt(int fd, std::string &err) {
+    if (fd != get_fd()) {
+        err = "Unknown virtual keyboard descriptor";
+        return false;
+    }
+    return true;
+}
+
+int SimOutput::get_fd() const {
+    return 200;
+}
+
+bool SimOutput::write(const input_event *events, size_t count) {
+    long long now = clock_.now_us();
+    for (size_t i = 0; i < count; ++i) {
+        written.push_back({now, events[i]});
+    }
+    return true;
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+// In-memory backends driven by a virtual clock, used by easy-switcher-sim.
+// Time only moves when the simulator advances it or when the daemon sleeps,
+// so scenarios are deterministic and run as fast as the CPU allows.
+
+#include "Backend.h"
+
+#include <deque>
+#include <string>
+#include <vector>
+
+class SimClock : public Clock {
+public:
+    long long now_us() override { return now_; }
+
+    void sleep_us(long long us) override { now_ += us; }
+
+    void advance_to(long long us) {
+        if (us > now_) now_ = us;
+    }
+
+private:
+    long long now_ = 1000000;
+};
+
+// Event nodes with an evdev-like kernel buffer. Events are scheduled ahead and appear
+// in the buffer when their time comes; a full buffer drops its contents and the next
+// read resyncs the key state, like libevdev does after SYN_DROPPED.
+class SimInput : public InputBackend {
+public:
+    explicit SimInput(Clock &clock);
+
+    // Adds a node; `capacity` is the size of its kernel buffer in events.
+    // A node that isn't a keyboard is a mouse, `mouse` adds a pointer to a keyboard.
+    void add_node(const std::string &path, const std::string &name, bool keyboard = true, size_t capacity = 256,
+                  bool mouse = false);
+
+    void remove_node(const std::string &path);
+
+    // The next `count` opens of the node fail with EACCES.
+    void fail_opens(const std::string &path, int count);
+
+    // Schedules a key event and its SYN_REPORT; times of one node must not decrease.
+    void schedule(const std::string &path, long long time_us, int code, int value);
+
+    // Moves scheduled events that are due into the kernel buffers.
+    void deliver();
+
+    // Time of the earliest scheduled event, -1 if there is none.
+    long long next_time() const;
+
+    // Open descriptors with something to read.
+    void readable(std::vector<int> &fds);
+
+    unsigned long dropped_buffers = 0; // buffer overflows
+    unsigned long direct_events = 0;   // key events that reached applications directly (device not grabbed)
+
+    int open(const std::string &path, DeviceInfo &info) override;
+
+    // The node stays open and grabbed as it was, like a descriptor kept across exec.
+    int adopt(int fd, DeviceInfo &info) override;
+
+    void close(int fd) override;
+
+    size_t read(int fd, input_event *events, size_t max) override;
+
+    bool keys_down(int fd) override;
+
+    bool grab(int fd) override;
+
+private:
+    static const int KEYS = KEY_MAX + 1;
+
+    struct Node {
+        std::string path;
+        DeviceInfo info;
+        size_t capacity;
+        bool present;
+        int fd;
+        int failures;
+        bool grabbed;
+        bool dropped;
+        // fixed-size storage, so that reading never allocates
+        std::vector<input_event> scheduled;
+        size_t next;                 // first scheduled event not delivered yet
+        std::vector<input_event> buffer;
+        size_t head;
+        size_t count;
+        std::vector<input_event> resync;
+        size_t resync_next;
+        std::vector<char> down;      // current key state
+        std::vector<char> seen;      // key state after the events read so far
+        std::vector<char> snapshot;  // key state when the buffer was dropped
+    };
+
+    Clock &clock_;
+    std::deque<Node> nodes_; // never moves, nodes are only marked absent
+    std::vector<Node *> open_; // open nodes by fd, so reads cost the same with many nodes
+    int next_fd_ = 3;
+
+    Node *find(const std::string &path);
+
+    Node *find(int fd);
+
+    void deliver(Node &node);
+
+    void push(Node &node, const input_event &ev);
+};
+
+// /dev/input changes queued by the simulator, timer fired by the virtual clock.
+class SimHotplug : public HotplugBackend {
+public:
+    explicit SimHotplug(Clock &clock);
+
+    std::vector<std::string> initial; // nodes listed on init()
+
+    void change(NodeChange change, const std::string &path);
+
+    // True if DeviceManager has something to do now.
+    bool pending();
+
+    // Time when the timer fires, -1 if it is disarmed.
+    long long timer_due() const { return due_us_; }
+
+    int init(std::string &err) override;
+
+    int get_timer_fd() const override;
+
+    bool list(std::vector<std::string> &paths, std::string &err) override;
+
+    bool next(NodeChange &change, std::string &path) override;
+
+    void set_timer(long long delay_ms) override;
+
+private:
+    Clock &clock_;
+    std::deque<std::pair<NodeChange, std::string> > changes_;
+    long long due_us_ = -1;
+};
+
+// Records every event written to the virtual keyboard with the time it was written.
+class SimOutput : public OutputBackend {
+public:
+    explicit SimOutput(Clock &clock);
+
+    struct Written {
+        long long time_us;
+        input_event ev;
+    };
+
+    std::vector<Written> written;
+
+    bool create(const DeviceInfo &info, bool extended, std::string &err) override;
+
+    bool adopt(int fd, std::string &err) override;
+
+    int get_fd() const override;
+
+    bool write(const input_event *events, size_t count) override;
+
+private:
+    Clock &clock_;
+};
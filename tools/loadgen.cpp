@@ -0,0 +1,607 @@
+// Synthetic load generator for Easy Switcher.
+//
+// Creates one or more uinput keyboards, types a configurable workload into them
+// and watches the daemon's virtual keyboard to measure how it keeps up:
+// conversion latency, replay duration, dropped or misordered events and daemon CPU use.
+
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <libevdev/libevdev.h>
+
+#include "Config.h"
+#include "Converter.h"
+#include "VirtualKeyboard.h"
+
+#define CONFIG_FILE "/etc/easy-switcher/default.conf"
+#define DAEMON_KEYBOARD "Easy Switcher virtual keyboard"
+
+static const int Letters[] = {
+    KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I, KEY_O, KEY_P,
+    KEY_A, KEY_S, KEY_D, KEY_F, KEY_G, KEY_H, KEY_J, KEY_K, KEY_L,
+    KEY_Z, KEY_X, KEY_C, KEY_V, KEY_B, KEY_N, KEY_M
+};
+
+struct Options {
+    std::string workload = "typing";
+    int devices = 1;
+    int rate = 20;          // keys per second
+    int keys = 1000;        // keys to type
+    int word = 5;           // letters per word
+    int trigger_every = 5;  // words between triggers, 0 disables triggers
+    int line = 50;          // words per line for the "line" workload
+    int burst = 100;        // keys per burst for the "burst" workload
+    int settle = 1000;      // ms to wait for the daemon to pick up new keyboards
+    int timeout = 5000;     // ms to wait for the daemon's output after the last key
+    bool grab = false;      // daemon runs in grab mode, typed keys are passed through
+    unsigned seed = 1;
+    int pid = 0;
+    int cpu_load = 0;       // busy processes competing with the daemon while typing
+};
+
+struct Trigger {
+    long long sent_us;
+    std::vector<int> expected; // keys the daemon must replay
+};
+
+struct ObservedConversion {
+    long long latency_us;
+    long long duration_us;
+};
+
+struct SentKey {
+    int code;
+    long long sent_us;
+};
+
+Options opt;
+int ls_keys[2] = {0, 0};
+int conv_key = 0;
+
+std::vector<std::unique_ptr<VirtualKeyboard> > keyboards;
+size_t next_keyboard = 0;
+int output_fd = -1;
+libevdev *output_dev = nullptr;
+
+std::deque<Trigger> triggers;        // triggers waiting for their conversion
+std::deque<SentKey> sent_keys;       // typed keys waiting to be passed through (grab mode)
+std::vector<ObservedConversion> conversions;
+std::vector<long long> passthrough_latencies;
+
+// state of the conversion currently being observed
+bool converting = false;
+Trigger current;
+size_t replayed = 0;
+int backspaces = 0;
+long long conversion_start_us = 0;
+long long last_output_us = 0;
+
+unsigned long keys_sent = 0;
+unsigned long keys_typed = 0;  // keys typed by type(), triggers not included
+unsigned long triggers_sent = 0;
+unsigned long misordered = 0;
+unsigned long incomplete = 0;
+unsigned long dropped = 0;
+
+long long now_us() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void sleep_until_us(long long deadline) {
+    timespec ts{};
+    ts.tv_sec = deadline / 1000000;
+    ts.tv_nsec = (deadline % 1000000) * 1000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+    }
+}
+
+bool read_config() {
+    Config conf;
+    if (!conf.open(CONFIG_FILE)) {
+        std::cerr << conf.err << std::endl;
+        return false;
+    }
+
+    std::string layout_switch;
+    if (!conf.get_string("Easy Switcher", "layout-switch", layout_switch) ||
+        sscanf(layout_switch.c_str(), "%d+%d", &ls_keys[0], &ls_keys[1]) < 1) {
+        std::cerr << "Invalid 'layout-switch' value in " << CONFIG_FILE << std::endl;
+        return false;
+    }
+    conf.get_int("Easy Switcher", "convert-key", conv_key, 0);
+
+    // handle_output() follows plain conversions only: a layout switch, backspaces and the replay
+    int undo_key = 0, expand_window = DEFAULT_EXPAND_WINDOW;
+    bool auto_convert = false;
+    std::string layouts;
+    conf.get_int("Easy Switcher", "undo-key", undo_key, 0);
+    conf.get_int("Easy Switcher", "expand-window", expand_window, DEFAULT_EXPAND_WINDOW);
+    conf.get_bool("Easy Switcher", "auto-convert", auto_convert, false);
+    conf.get_string("Easy Switcher", "layouts", layouts, "");
+    std::string unsupported;
+    if (expand_window != 0) unsupported = "expand-window=0";
+    else if (undo_key != 0) unsupported = "undo-key=0";
+    else if (auto_convert) unsupported = "auto-convert=false";
+    else if (std::count(layouts.begin(), layouts.end(), ',') > 1) unsupported = "at most two layouts";
+    if (!unsupported.empty()) {
+        std::cerr << "The load generator needs " << unsupported << " in " << CONFIG_FILE
+                << ", it can't follow other conversions." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Find the daemon's virtual keyboard and open it for reading.
+bool open_output() {
+    DIR *dir = opendir("/dev/input");
+    if (!dir) {
+        std::cerr << "Failed to open /dev/input: " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (strncmp(entry->d_name, "event", 5) != 0) continue;
+
+        std::string path = std::string("/dev/input/") + entry->d_name;
+        int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK);
+        if (fd < 0) continue;
+
+        libevdev *dev = nullptr;
+        if (libevdev_new_from_fd(fd, &dev) == 0) {
+            const char *name = libevdev_get_name(dev);
+            if (name && strcmp(name, DAEMON_KEYBOARD) == 0) {
+                int clock = CLOCK_MONOTONIC;
+                ioctl(fd, EVIOCSCLOCKID, &clock);
+                output_fd = fd;
+                output_dev = dev;
+                break;
+            }
+            libevdev_free(dev);
+        }
+        close(fd);
+    }
+    closedir(dir);
+
+    if (!output_dev) {
+        std::cerr << "Easy Switcher virtual keyboard not found. Is the daemon running?" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int find_daemon_pid() {
+    DIR *dir = opendir("/proc");
+    if (!dir) return 0;
+
+    int pid = 0;
+    dirent *entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        int candidate = atoi(entry->d_name);
+        if (candidate <= 0 || candidate == getpid()) continue;
+
+        std::ifstream comm(std::string("/proc/") + entry->d_name + "/comm");
+        std::string name;
+        if (std::getline(comm, name) && name == "easy-switcher") {
+            pid = candidate;
+            break;
+        }
+    }
+    closedir(dir);
+    return pid;
+}
+
+// Returns user + system CPU time of the process in clock ticks, or -1.
+long long cpu_ticks(int pid) {
+    std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+    std::string line;
+    if (!std::getline(stat, line)) return -1;
+
+    // skip "pid (comm) ", comm may contain spaces
+    size_t pos = line.rfind(')');
+    if (pos == std::string::npos) return -1;
+
+    std::istringstream fields(line.substr(pos + 2));
+    std::string field;
+    long long utime = 0, stime = 0;
+    for (int i = 0; i < 13 && fields >> field; ++i) {
+        if (i == 11) utime = std::stoll(field);
+        if (i == 12) stime = std::stoll(field);
+    }
+    return utime + stime;
+}
+
+// Returns voluntary + involuntary context switches of the process, or -1.
+// Every blocking syscall of the daemon is a voluntary switch, so this shows how the backends compare.
+long long context_switches(int pid) {
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    long long total = -1;
+    while (std::getline(status, line)) {
+        if (line.find("ctxt_switches:") != std::string::npos) {
+            total = (total < 0 ? 0 : total) + std::stoll(line.substr(line.find(':') + 1));
+        }
+    }
+    return total;
+}
+
+void finish_conversion() {
+    if (!converting) return;
+    converting = false;
+
+    if (replayed != current.expected.size() || backspaces != (int) current.expected.size()) {
+        ++incomplete;
+    }
+    conversions.push_back({conversion_start_us - current.sent_us, last_output_us - conversion_start_us});
+}
+
+void handle_output(const input_event &ev) {
+    if (ev.type != EV_KEY) return;
+
+    long long time_us = ev.time.tv_sec * 1000000LL + ev.time.tv_usec;
+    last_output_us = time_us;
+    if (ev.value != 1) return;
+
+    // a new conversion always starts with the layout switch, see read_config()
+    if (ev.code == ls_keys[0] && !(converting && replayed < current.expected.size())) {
+        finish_conversion();
+        if (triggers.empty()) {
+            ++misordered; // a conversion nobody asked for
+            return;
+        }
+        current = triggers.front();
+        triggers.pop_front();
+        converting = true;
+        replayed = 0;
+        backspaces = 0;
+        conversion_start_us = time_us;
+        return;
+    }
+
+    if (converting && replayed < current.expected.size()) {
+        if (ev.code == ls_keys[1]) return;
+        if (ev.code == KEY_BACKSPACE) {
+            ++backspaces;
+            return;
+        }
+        if (ev.code != current.expected[replayed]) ++misordered;
+        ++replayed;
+        return;
+    }
+
+    // everything else is a passthrough of typed keys
+    if (opt.grab) {
+        while (!sent_keys.empty() && sent_keys.front().code != ev.code) {
+            sent_keys.pop_front();
+            ++dropped;
+        }
+        if (!sent_keys.empty()) {
+            passthrough_latencies.push_back(time_us - sent_keys.front().sent_us);
+            sent_keys.pop_front();
+        }
+    }
+}
+
+void drain_output() {
+    input_event ev{};
+    int rc;
+    while ((rc = libevdev_next_event(output_dev, LIBEVDEV_READ_FLAG_NORMAL, &ev)) >= 0) {
+        if (rc == LIBEVDEV_READ_STATUS_SUCCESS) handle_output(ev);
+    }
+}
+
+// Send a single key event from the next keyboard in turn.
+// With several keyboards, consecutive events come from different devices.
+void send(int code, int value) {
+    input_event frame[2]{};
+    frame[0].type = EV_KEY;
+    frame[0].code = code;
+    frame[0].value = value;
+    frame[1].type = EV_SYN;
+    frame[1].code = SYN_REPORT;
+
+    keyboards[next_keyboard]->write_events(frame, 2);
+    next_keyboard = (next_keyboard + 1) % keyboards.size();
+
+    if (value == 1) {
+        ++keys_sent;
+        if (opt.grab) sent_keys.push_back({code, now_us()});
+    }
+    drain_output();
+}
+
+long long interval_us() {
+    return opt.rate > 0 ? 1000000LL / opt.rate : 0;
+}
+
+// Type a key at the configured rate. In the burst workload only the first key of each burst
+// waits for its time, the rest of the burst follows as fast as possible.
+void type(int code, long long &next) {
+    bool paced = opt.workload != "burst" || keys_typed++ % opt.burst == 0;
+    if (paced) sleep_until_us(next);
+    send(code, 1);
+    send(code, 0);
+    next = (paced ? next : now_us()) + interval_us();
+}
+
+std::vector<int> type_word(std::mt19937 &rng, long long &next) {
+    std::vector<int> word;
+    for (int i = 0; i < opt.word; ++i) {
+        int code = Letters[rng() % (sizeof(Letters) / sizeof(Letters[0]))];
+        type(code, next);
+        word.push_back(code);
+    }
+    return word;
+}
+
+// Double shift, or the convert key, to convert the last word.
+// With `whole_line` the other shift is held, to convert the whole line.
+void trigger(const std::vector<int> &expected, bool whole_line, long long &next) {
+    sleep_until_us(next);
+
+    int key = conv_key != 0 ? conv_key : (whole_line ? KEY_RIGHTSHIFT : KEY_LEFTSHIFT);
+
+    if (whole_line) send(KEY_LEFTSHIFT, 1);
+    if (conv_key == 0) {
+        send(key, 1);
+        send(key, 0);
+    }
+    send(key, 1);
+    if (whole_line) send(key, 0);
+
+    // the conversion is triggered by the last release
+    triggers.push_back({now_us(), expected});
+    ++triggers_sent;
+    send(whole_line ? KEY_LEFTSHIFT : key, 0);
+
+    next = now_us() + interval_us();
+}
+
+void run_workload() {
+    std::mt19937 rng(opt.seed);
+    long long next = now_us();
+
+    if (opt.workload == "typing" || opt.workload == "burst") {
+        // words separated by spaces, the last word converted every `trigger_every` words
+        int words = 0;
+        while ((int) keys_sent < opt.keys) {
+            std::vector<int> word = type_word(rng, next);
+            type(KEY_SPACE, next);
+            word.push_back(KEY_SPACE);
+            ++words;
+
+            if (opt.trigger_every > 0 && words % opt.trigger_every == 0) {
+                trigger(word, false, next);
+            }
+        }
+    } else if (opt.workload == "storm") {
+        // one short word converted back and forth with no pause between triggers
+        std::vector<int> word = type_word(rng, next);
+        type(KEY_SPACE, next);
+        word.push_back(KEY_SPACE);
+        while ((int) keys_sent < opt.keys) {
+            trigger(word, false, next);
+            next = now_us();
+        }
+    } else if (opt.workload == "line") {
+        // long lines converted as a whole, then Enter
+        while ((int) keys_sent < opt.keys) {
+            std::vector<int> line;
+            for (int i = 0; i < opt.line; ++i) {
+                std::vector<int> word = type_word(rng, next);
+                line.insert(line.end(), word.begin(), word.end());
+                if (i + 1 < opt.line) {
+                    type(KEY_SPACE, next);
+                    line.push_back(KEY_SPACE);
+                }
+            }
+            trigger(line, true, next);
+
+            // wait for the replay, so that Enter doesn't become a part of it
+            long long deadline = now_us() + opt.timeout * 1000LL;
+            while ((!triggers.empty() || (converting && replayed < current.expected.size()))
+                   && now_us() < deadline) {
+                usleep(1000);
+                drain_output();
+            }
+            type(KEY_ENTER, next);
+        }
+    } else {
+        std::cerr << "Unknown workload: " << opt.workload << std::endl;
+    }
+
+    // wait for the daemon to finish its output
+    long long deadline = now_us() + opt.timeout * 1000LL;
+    while (now_us() < deadline) {
+        usleep(1000);
+        drain_output();
+        if (triggers.empty() && !(converting && replayed < current.expected.size()) && sent_keys.empty()) break;
+    }
+    finish_conversion();
+}
+
+long long percentile(std::vector<long long> values, double p) {
+    if (values.empty()) return 0;
+    std::sort(values.begin(), values.end());
+    size_t index = (size_t) (p * (values.size() - 1));
+    return values[index];
+}
+
+void report(double elapsed_s, long long cpu, long long switches) {
+    std::vector<long long> latencies, durations;
+    for (const auto &c: conversions) {
+        latencies.push_back(c.latency_us);
+        durations.push_back(c.duration_us);
+    }
+
+    std::cout << "Workload: " << opt.workload << ", " << opt.devices << " device(s), "
+            << keys_sent << " keys in " << elapsed_s << " s ("
+            << (elapsed_s > 0 ? keys_sent / elapsed_s : 0) << " keys/s)\n";
+    std::cout << "Triggers sent: " << triggers_sent << ", conversions observed: " << conversions.size()
+            << ", missed: " << triggers.size() << ", incomplete: " << incomplete << "\n";
+    std::cout << "Misordered events: " << misordered << "\n";
+
+    if (!latencies.empty()) {
+        std::cout << "Conversion latency, us: p50 " << percentile(latencies, 0.5)
+                << ", p99 " << percentile(latencies, 0.99)
+                << ", max " << percentile(latencies, 1.0) << "\n";
+        std::cout << "Replay duration, us: p50 " << percentile(durations, 0.5)
+                << ", p99 " << percentile(durations, 0.99)
+                << ", max " << percentile(durations, 1.0) << "\n";
+    }
+
+    if (opt.grab) {
+        std::cout << "Passthrough: " << passthrough_latencies.size() << " keys, dropped: "
+                << dropped + sent_keys.size() << "\n";
+        if (!passthrough_latencies.empty()) {
+            std::cout << "Passthrough latency, us: p50 " << percentile(passthrough_latencies, 0.5)
+                    << ", p99 " << percentile(passthrough_latencies, 0.99)
+                    << ", max " << percentile(passthrough_latencies, 1.0) << "\n";
+        }
+    }
+
+    if (cpu >= 0) {
+        double cpu_s = (double) cpu / sysconf(_SC_CLK_TCK);
+        std::cout << "Daemon CPU: " << cpu_s << " s (" << (elapsed_s > 0 ? 100.0 * cpu_s / elapsed_s : 0)
+                << "%)\n";
+    }
+    if (switches >= 0) {
+        std::cout << "Daemon context switches: " << switches << " ("
+                << (keys_sent > 0 ? (double) switches / keys_sent : 0) << " per key)\n";
+    }
+    std::cout.flush();
+}
+
+void show_help() {
+    std::cout << "Easy Switcher load generator\n"
+            << "Usage: easy-switcher-loadgen [option value]...\n"
+            << "Options:\n"
+            << "   --workload W        typing, burst, storm or line (default typing)\n"
+            << "   --devices N         number of keyboards to type from (default 1)\n"
+            << "   --rate N            keys per second (default 20)\n"
+            << "   --keys N            number of keys to type (default 1000)\n"
+            << "   --word N            letters per word (default 5)\n"
+            << "   --trigger-every N   words between conversions, 0 to disable (default 5)\n"
+            << "   --line N            words per line for the line workload (default 50)\n"
+            << "   --burst N           keys per burst for the burst workload (default 100)\n"
+            << "   --settle MS         time for the daemon to pick up the keyboards (default 1000)\n"
+            << "   --timeout MS        time to wait for the daemon's output (default 5000)\n"
+            << "   --grab              the daemon runs with grab=true\n"
+            << "   --seed N            random seed (default 1)\n"
+            << "   --pid PID           daemon PID for CPU accounting (default: found by name)\n"
+            << "   --cpu-load N        keep N busy processes running while typing, to compare\n"
+            << "                       the default and the low-latency mode under load (default 0)\n"
+            << "   -h, --help          show this help" << std::endl;
+}
+
+bool parse_options(int argc, char *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        std::string option = argv[i];
+        if (option == "-h" || option == "--help") return false;
+        if (option == "--grab") {
+            opt.grab = true;
+            continue;
+        }
+        if (i + 1 >= argc) return false;
+
+        std::string value = argv[++i];
+        if (option == "--workload") opt.workload = value;
+        else if (option == "--devices") opt.devices = std::max(1, atoi(value.c_str()));
+        else if (option == "--rate") opt.rate = atoi(value.c_str());
+        else if (option == "--keys") opt.keys = atoi(value.c_str());
+        else if (option == "--word") opt.word = std::max(1, atoi(value.c_str()));
+        else if (option == "--trigger-every") opt.trigger_every = atoi(value.c_str());
+        else if (option == "--line") opt.line = std::max(1, atoi(value.c_str()));
+        else if (option == "--burst") opt.burst = std::max(1, atoi(value.c_str()));
+        else if (option == "--settle") opt.settle = atoi(value.c_str());
+        else if (option == "--timeout") opt.timeout = atoi(value.c_str());
+        else if (option == "--seed") opt.seed = (unsigned) atoi(value.c_str());
+        else if (option == "--pid") opt.pid = atoi(value.c_str());
+        else if (option == "--cpu-load") opt.cpu_load = std::max(0, atoi(value.c_str()));
+        else return false;
+    }
+    return true;
+}
+
+// Busy processes at the default priority, they take every CPU cycle the daemon doesn't.
+std::vector<pid_t> start_cpu_load(int count) {
+    std::vector<pid_t> pids;
+    for (int i = 0; i < count; ++i) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            volatile unsigned long spin = 0;
+            while (true) ++spin;
+        }
+        if (pid > 0) pids.push_back(pid);
+    }
+    return pids;
+}
+
+void stop_cpu_load(const std::vector<pid_t> &pids) {
+    for (pid_t pid: pids) kill(pid, SIGKILL);
+    for (pid_t pid: pids) waitpid(pid, nullptr, 0);
+}
+
+int main(int argc, char *argv[]) {
+    if (!parse_options(argc, argv)) {
+        show_help();
+        return EXIT_FAILURE;
+    }
+
+    if (!read_config() || !open_output()) return EXIT_FAILURE;
+
+    static std::vector<std::string> names;
+    for (int i = 0; i < opt.devices; ++i) {
+        names.push_back("Easy Switcher load generator " + std::to_string(i + 1));
+    }
+    for (int i = 0; i < opt.devices; ++i) {
+        std::unique_ptr<VirtualKeyboard> kb(new VirtualKeyboard());
+        kb->name = names[i].c_str();
+        kb->product = 0x0778;
+        kb->delay = 0;
+        if (!kb->init()) {
+            std::cerr << kb->err << std::endl;
+            return EXIT_FAILURE;
+        }
+        keyboards.push_back(std::move(kb));
+    }
+
+    // let the daemon open the new keyboards
+    usleep(opt.settle * 1000);
+    drain_output();
+
+    int pid = opt.pid ? opt.pid : find_daemon_pid();
+    long long cpu_before = pid ? cpu_ticks(pid) : -1;
+    long long switches_before = pid ? context_switches(pid) : -1;
+    std::vector<pid_t> load = start_cpu_load(opt.cpu_load);
+    long long start = now_us();
+
+    run_workload();
+
+    double elapsed_s = (now_us() - start) / 1e6;
+    stop_cpu_load(load);
+    long long cpu_after = pid ? cpu_ticks(pid) : -1;
+    long long switches_after = pid ? context_switches(pid) : -1;
+    report(elapsed_s, cpu_before >= 0 && cpu_after >= 0 ? cpu_after - cpu_before : -1,
+           switches_before >= 0 && switches_after >= 0 ? switches_after - switches_before : -1);
+
+    libevdev_free(output_dev);
+    close(output_fd);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,1469 @@
+// Deterministic simulator for Easy Switcher.
+//
+// Runs the daemon's own pipeline (InputReader, DeviceManager, Converter, Pipeline, VirtualKeyboard)
+// on the in-memory backends of SimBackend.h with a virtual clock, so whole-daemon scenarios
+// need no root or real devices and run as fast as the CPU allows. Every scenario checks exact
+// event counts, order and latencies; the exit status is 1 if any check fails.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "DebugLog.h"
+#include "DeviceManager.h"
+#include "Handoff.h"
+#include "InputReader.h"
+#include "LowLatency.h"
+#include "Pipeline.h"
+#include "SimBackend.h"
+#include "StageCounters.h"
+#include "StreamFilter.h"
+#include "VirtualKeyboard.h"
+
+static const int LS_KEY = KEY_LEFTMETA;
+static const int DELAY_MS = 10;
+static const long long MS = 1000;
+
+static const int Letters[] = {
+    KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I, KEY_O, KEY_P,
+    KEY_A, KEY_S, KEY_D, KEY_F, KEY_G, KEY_H, KEY_J, KEY_K, KEY_L,
+    KEY_Z, KEY_X, KEY_C, KEY_V, KEY_B, KEY_N, KEY_M
+};
+
+struct Result {
+    std::string name;
+    std::string summary;
+    std::vector<std::string> failures;
+};
+
+std::vector<Result> results;
+
+void check(Result &result, const std::string &what, long long expected, long long actual) {
+    if (expected != actual) {
+        result.failures.push_back(what + ": expected " + std::to_string(expected) + ", got " + std::to_string(actual));
+    }
+}
+
+// Ends a scenario that could not start. Returns false, for the start functions.
+static bool failed_to_start(Result &result) {
+    result.failures.push_back("failed to start");
+    results.push_back(result);
+    return false;
+}
+
+static const char KBD[] = "/dev/input/event3"; // the keyboard most scenarios type on
+
+// The daemon on simulated devices. Input is scheduled ahead, then run() advances
+// the virtual clock from one due event to the next, like the event loop would wake up.
+struct Sim {
+    SimClock clock;
+    SimInput input{clock};
+    SimHotplug hotplug{clock};
+    SimOutput output{clock};
+    InputReader reader;
+    DeviceManager manager;
+    VirtualKeyboard vk;
+    Converter conv;
+    Pipeline pipeline{reader, vk, conv};
+
+    std::vector<std::pair<long long, std::function<void()> > > actions; // ordered by time
+    size_t next_action = 0;
+    std::vector<int> ready;
+
+    // the instance reading the devices, another one takes over on a restart
+    InputReader *active_reader = &reader;
+    Pipeline *active = &pipeline;
+    bool stopped = false; // between the instances, nothing reads the devices
+    std::chrono::nanoseconds daemon_time{0}; // wall clock spent reading and processing, without the simulation
+
+    explicit Sim(bool grab) {
+        reader.input = &input;
+        reader.grab = grab;
+        manager.hotplug = &hotplug;
+        manager.clock = &clock;
+        vk.output = &output;
+        vk.clock = &clock;
+        vk.delay = DELAY_MS;
+        vk.passthrough = grab;
+        pipeline.clock = &clock;
+        conv.ls_keys[0] = LS_KEY;
+        ready.reserve(256);
+    }
+
+    bool start() {
+        if (!reader.init() || manager.init() == -1 || !vk.init()) return false;
+        pipeline.reserve();
+        pipeline.probe(manager);
+        return true;
+    }
+
+    // A failure to start ends the scenario with its result, the caller only has to return.
+    bool start(Result &result) {
+        return start() || failed_to_start(result);
+    }
+
+    // Starts with the keyboard KBD plugged in.
+    bool start_with_keyboard(size_t capacity = 256) {
+        hotplug.initial.push_back(KBD);
+        input.add_node(KBD, "Sim keyboard", true, capacity);
+        return start();
+    }
+
+    bool start_with_keyboard(Result &result, size_t capacity = 256) {
+        return start_with_keyboard(capacity) || failed_to_start(result);
+    }
+
+    long long now() { return clock.now_us(); }
+
+    void at(long long time_us, std::function<void()> action) {
+        actions.emplace_back(time_us, std::move(action));
+    }
+
+    void plug(long long time_us, const std::string &path, size_t capacity = 256) {
+        at(time_us, [this, path, capacity]() {
+            input.add_node(path, "Sim keyboard " + path, true, capacity);
+            hotplug.change(NodeCreated, path);
+        });
+    }
+
+    void unplug(long long time_us, const std::string &path) {
+        at(time_us, [this, path]() {
+            input.remove_node(path);
+            hotplug.change(NodeDeleted, path);
+        });
+    }
+
+    // Press and release, returns the time of the release.
+    long long tap(const std::string &path, long long time_us, int code, long long hold_us = 30 * MS) {
+        input.schedule(path, time_us, code, 1);
+        input.schedule(path, time_us + hold_us, code, 0);
+        return time_us + hold_us;
+    }
+
+    // Double shift, converts the last word. Returns the time of the last release.
+    long long trigger(const std::string &path, long long time_us) {
+        tap(path, time_us, KEY_LEFTSHIFT, 20 * MS);
+        return tap(path, time_us + 60 * MS, KEY_LEFTSHIFT, 20 * MS);
+    }
+
+    // Stops the instance as SIGUSR2 does: the last round of the loop reads the devices,
+    // then skips its batch callback, so what it read stays queued in the reader.
+    void stop(long long time_us) {
+        at(time_us, [this]() {
+            input.deliver();
+            input.readable(ready);
+            for (int fd: ready) {
+                active_reader->read(fd);
+            }
+            stopped = true;
+        });
+    }
+
+    void poll() {
+        input.deliver();
+        if (stopped) return;
+        if (hotplug.pending()) active->probe(manager);
+
+        input.readable(ready);
+        if (ready.empty()) return;
+        auto started = std::chrono::steady_clock::now();
+        for (int fd: ready) {
+            active_reader->read(fd);
+        }
+        active->process();
+        daemon_time += std::chrono::steady_clock::now() - started;
+    }
+
+    void run(long long until_us) {
+        while (true) {
+            while (next_action < actions.size() && actions[next_action].first <= now()) {
+                actions[next_action++].second();
+            }
+            poll();
+
+            long long next = input.next_time();
+            if (next_action < actions.size() && (next == -1 || actions[next_action].first < next)) {
+                next = actions[next_action].first;
+            }
+            long long due = hotplug.timer_due();
+            if (due != -1 && (next == -1 || due < next)) next = due;
+
+            if (next == -1 || next > until_us) break;
+            clock.advance_to(next);
+        }
+        clock.advance_to(until_us);
+        poll();
+    }
+
+    // Key events written to the virtual keyboard, without SYN_REPORTs.
+    std::vector<SimOutput::Written> keys() const {
+        std::vector<SimOutput::Written> result;
+        for (const auto &w: output.written) {
+            if (w.ev.type == EV_KEY) result.push_back(w);
+        }
+        return result;
+    }
+};
+
+// One keyboard types a word and converts it: exact output and its timing.
+void scenario_typing() {
+    Result result{"typing", "", {}};
+    Sim sim(false);
+    if (!sim.start_with_keyboard(result)) return;
+
+    const int word[] = {KEY_G, KEY_H, KEY_B, KEY_D, KEY_T, KEY_N};
+    long long t = sim.now() + 100 * MS;
+    for (int code: word) {
+        sim.tap(KBD, t, code);
+        t += 80 * MS;
+    }
+    long long trigger_us = sim.trigger(KBD, t);
+    sim.run(trigger_us + 2000 * MS);
+
+    auto keys = sim.keys();
+    const size_t n = sizeof(word) / sizeof(word[0]);
+    check(result, "conversions", 1, sim.pipeline.conversions);
+    check(result, "output keys", 2 + 4 * n, keys.size());
+    if (keys.size() == 2 + 4 * n) {
+        check(result, "layout switch", LS_KEY, keys[0].ev.code);
+        for (size_t i = 0; i < n; ++i) {
+            check(result, "backspace " + std::to_string(i), KEY_BACKSPACE, keys[2 + 2 * i].ev.code);
+            check(result, "replayed key " + std::to_string(i), word[i], keys[2 + 2 * n + 2 * i].ev.code);
+        }
+        check(result, "latency to the first key, us", 0, keys.front().time_us - trigger_us);
+        check(result, "latency to the last key, us", (long long) (keys.size() - 1) * DELAY_MS * MS,
+              keys.back().time_us - trigger_us);
+        result.summary = std::to_string(keys.size()) + " output keys in "
+                         + std::to_string((keys.back().time_us - trigger_us) / MS) + " ms";
+    }
+    check(result, "keys seen by applications directly", 2 * n + 4, sim.input.direct_events);
+    results.push_back(result);
+}
+
+// Two grabbed keyboards type while a conversion is being written: after it,
+// their events are merged by timestamp, both in the passthrough and in the converter.
+void scenario_interleaved() {
+    Result result{"interleaved", "", {}};
+    Sim sim(true);
+    const std::string kbd1 = "/dev/input/event3", kbd2 = "/dev/input/event4";
+    sim.hotplug.initial = {kbd1, kbd2};
+    sim.input.add_node(kbd1, "Sim keyboard 1");
+    sim.input.add_node(kbd2, "Sim keyboard 2");
+    if (!sim.start(result)) return;
+
+    long long t = sim.now() + 100 * MS;
+    t = sim.tap(kbd1, t, KEY_A) + 50 * MS;
+    t = sim.tap(kbd1, t, KEY_B) + 50 * MS;
+    long long first_trigger = sim.trigger(kbd1, t);
+
+    // typed while the first conversion (10 keys, 100 ms) is written
+    const int typed[] = {KEY_Q, KEY_W, KEY_E, KEY_R};
+    for (int i = 0; i < 4; ++i) {
+        sim.tap(i % 2 ? kbd2 : kbd1, first_trigger + (10 + 10 * i) * MS, typed[i], 5 * MS);
+    }
+    long long second_trigger = sim.trigger(kbd2, first_trigger + 500 * MS);
+    sim.run(second_trigger + 2000 * MS);
+
+    check(result, "conversions", 2, sim.pipeline.conversions);
+    check(result, "keys seen by applications directly", 0, sim.input.direct_events);
+
+    // passthrough of the keys typed during the first conversion, in timestamp order
+    std::vector<int> passed;
+    for (const auto &w: sim.keys()) {
+        if (w.time_us > first_trigger && w.time_us < second_trigger && w.ev.value == 1) {
+            for (int code: typed) {
+                if (w.ev.code == code) passed.push_back(code);
+            }
+        }
+    }
+    check(result, "passed through keys", 4, passed.size());
+    for (size_t i = 0; i < passed.size() && i < 4; ++i) {
+        check(result, "passed through key " + std::to_string(i), typed[i], passed[i]);
+    }
+
+    // the second conversion replays the whole word "abqwer" in typing order
+    const int expected[] = {KEY_A, KEY_B, KEY_Q, KEY_W, KEY_E, KEY_R};
+    std::vector<int> replayed;
+    auto keys = sim.keys();
+    size_t backspaces = 0;
+    for (const auto &w: keys) {
+        if (w.time_us < second_trigger || w.ev.value != 1) continue;
+        if (w.ev.code == KEY_BACKSPACE) ++backspaces;
+        else if (w.ev.code != LS_KEY) replayed.push_back(w.ev.code);
+    }
+    check(result, "backspaces", 6, backspaces);
+    check(result, "replayed keys", 6, replayed.size());
+    for (size_t i = 0; i < replayed.size() && i < 6; ++i) {
+        check(result, "replayed key " + std::to_string(i), expected[i], replayed[i]);
+    }
+
+    const LatencyStats &latency = sim.pipeline.passthrough_latency;
+    result.summary = std::to_string(latency.count) + " keys passed through, max latency "
+                     + std::to_string(latency.max_us / MS) + " ms";
+    results.push_back(result);
+}
+
+// A keyboard with a touchpad next to a plain keyboard, both grabbed by the config:
+// only the plain one is grabbed, the other keeps its buttons and still converts.
+void scenario_combo() {
+    Result result{"combo", "", {}};
+    Sim sim(true);
+    const std::string combo = "/dev/input/event4";
+    sim.hotplug.initial = {KBD, combo};
+    sim.input.add_node(KBD, "Sim keyboard");
+    sim.input.add_node(combo, "Sim keyboard with touchpad", true, 256, true);
+    if (!sim.start(result)) return;
+
+    const int word[] = {KEY_G, KEY_H, KEY_B};
+    long long t = sim.now() + 100 * MS;
+    for (int code: word) {
+        t = sim.tap(combo, t, code) + 50 * MS;
+    }
+    t = sim.tap(combo, t, BTN_LEFT) + 50 * MS;
+    t = sim.tap(combo, t, KEY_D) + 50 * MS;
+    long long trigger_us = sim.trigger(combo, t);
+    sim.run(trigger_us + 2000 * MS);
+
+    size_t grabbed = 0;
+    for (const auto &device: sim.reader.get_devices()) {
+        if (device.fd != -1 && device.grabbed) ++grabbed;
+    }
+    check(result, "grabbed devices", 1, grabbed);
+    check(result, "keys seen by applications directly", 2 * 5 + 4, sim.input.direct_events);
+    check(result, "conversions", 1, sim.pipeline.conversions);
+
+    // the click ends the word, only the key typed after it is converted
+    size_t backspaces = 0, replayed = 0;
+    for (const auto &w: sim.keys()) {
+        if (w.ev.value != 1) continue;
+        if (w.ev.code == KEY_BACKSPACE) ++backspaces;
+        else if (w.ev.code == KEY_D) ++replayed;
+        check(result, "button written to the virtual keyboard", false, w.ev.code == BTN_LEFT);
+    }
+    check(result, "backspaces", 1, backspaces);
+    check(result, "replayed keys", 1, replayed);
+
+    result.summary = std::to_string(grabbed) + " of 2 keyboards grabbed, "
+                     + std::to_string(sim.input.direct_events) + " events seen by applications directly";
+    results.push_back(result);
+}
+
+// CPU time the daemon adds to a grabbed key on its way to the virtual keyboard: reading the device,
+// the merge, the converter and the write, measured on the wall clock for each key event.
+void scenario_passthrough() {
+    Result result{"passthrough", "", {}};
+    Sim sim(true);
+    if (!sim.start_with_keyboard(result, 1024)) return;
+
+    const int EVENTS = 100000;
+    const int keys[] = {KEY_A, KEY_S, KEY_D, KEY_F, KEY_SPACE};
+    std::vector<long long> cost;
+    cost.reserve(EVENTS);
+    sim.output.written.reserve(2 * EVENTS);
+    long long t = sim.now();
+    for (int i = 0; i < EVENTS; ++i) {
+        t += MS;
+        sim.input.schedule(KBD, t, keys[i / 2 % 5], i % 2 == 0);
+        sim.clock.advance_to(t);
+        sim.input.deliver();
+        sim.input.readable(sim.ready);
+
+        auto started = std::chrono::steady_clock::now();
+        for (int fd: sim.ready) {
+            sim.reader.read(fd);
+        }
+        sim.pipeline.process();
+        cost.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - started).count());
+    }
+
+    check(result, "keys passed through", EVENTS, sim.keys().size());
+    check(result, "latency on the virtual clock, us", 0, sim.pipeline.passthrough_latency.max_us);
+
+    std::sort(cost.begin(), cost.end());
+    result.summary = std::to_string(EVENTS) + " key events, p50 " + std::to_string(cost[EVENTS / 2])
+                     + " ns, p99 " + std::to_string(cost[EVENTS * 99 / 100]) + " ns each";
+    results.push_back(result);
+}
+
+// A storm of new nodes is probed in one batch, a node that can't be opened yet is retried
+// with backoff, a node that disappears before its probe is never opened.
+void scenario_hotplug() {
+    Result result{"hotplug", "", {}};
+    Sim sim(false);
+
+    std::vector<std::pair<long long, std::string> > opened;
+    std::vector<std::pair<long long, std::string> > closed;
+    sim.pipeline.watch = [&sim, &opened, &closed](int fd, bool added) {
+        std::string path;
+        for (int i = 0; i < 100 && path.empty(); ++i) {
+            std::string candidate = "/dev/input/event" + std::to_string(i);
+            if (sim.reader.get_device_fd(candidate) == fd) path = candidate;
+        }
+        (added ? opened : closed).emplace_back(sim.now(), path);
+        return true;
+    };
+    if (!sim.start(result)) return;
+
+    long long start = sim.now();
+    const int STORM = 20;
+    for (int i = 0; i < STORM; ++i) {
+        sim.plug(start + (100 + 2 * i) * MS, "/dev/input/event" + std::to_string(10 + i));
+    }
+    long long storm_end = start + (100 + 2 * (STORM - 1)) * MS;
+
+    sim.plug(start + 300 * MS, "/dev/input/event40");
+    sim.at(start + 300 * MS, [&sim]() { sim.input.fail_opens("/dev/input/event40", 2); });
+
+    sim.plug(start + 700 * MS, "/dev/input/event50");
+    sim.unplug(start + 720 * MS, "/dev/input/event50");
+
+    sim.unplug(start + 800 * MS, "/dev/input/event10");
+
+    // typing on a hot-plugged keyboard
+    sim.at(start + 900 * MS, [&sim]() {
+        long long t = sim.now() + 10 * MS;
+        t = sim.tap("/dev/input/event20", t, KEY_F) + 50 * MS;
+        sim.trigger("/dev/input/event20", t);
+    });
+    // a node that keeps re-enumerating must not hold back a keyboard plugged meanwhile
+    for (long long at = 1200; at < 2600; at += 40) {
+        sim.plug(start + at * MS, "/dev/input/event60");
+        if (at == 1200) sim.plug(start + (at + 10) * MS, "/dev/input/event61");
+        sim.unplug(start + (at + 20) * MS, "/dev/input/event60");
+    }
+    sim.run(start + 3000 * MS);
+
+    check(result, "opened devices", STORM + 2, opened.size());
+    size_t batch = 0;
+    for (const auto &entry: opened) {
+        if (entry.first == storm_end + DEBOUNCE_MS * MS) ++batch;
+    }
+    check(result, "devices opened in the storm batch", STORM, batch);
+
+    long long retried = -1;
+    for (const auto &entry: opened) {
+        if (entry.second == "/dev/input/event40") retried = entry.first - start;
+    }
+    // probed at 350 ms, retried after 100 and 200 ms more
+    check(result, "retried device opened at, ms", 650, retried / MS);
+
+    check(result, "closed devices", 1, closed.size());
+    if (!closed.empty()) {
+        check(result, "closed at, ms", 800, (closed[0].first - start) / MS);
+        if (closed[0].second != "/dev/input/event10") result.failures.push_back("wrong device closed: " + closed[0].second);
+    }
+    check(result, "conversions", 1, sim.pipeline.conversions);
+
+    long long flapping = -1;
+    for (const auto &entry: opened) {
+        if (entry.second == "/dev/input/event61") flapping = entry.first - start;
+    }
+    check(result, "device plugged among re-enumerations opened at, ms", 1210 + MAX_DEBOUNCE_MS, flapping / MS);
+
+    result.summary = std::to_string(opened.size()) + " devices opened, " + std::to_string(batch)
+                     + " of them in one batch";
+    results.push_back(result);
+}
+
+// A grabbed keyboard overflows its kernel buffer while the daemon is busy writing a conversion.
+// The resync after SYN_DROPPED must leave no key stuck for applications.
+void scenario_syn_dropped() {
+    Result result{"syn-dropped", "", {}};
+    Sim sim(true);
+    if (!sim.start_with_keyboard(result, 16)) return;
+
+    long long t = sim.now() + 100 * MS;
+    for (int code: {KEY_H, KEY_E, KEY_L, KEY_L, KEY_O}) {
+        t = sim.tap(KBD, t, code) + 50 * MS;
+    }
+    long long trigger_us = sim.trigger(KBD, t);
+
+    // 30 keys in 60 ms, with a shift held across the overflow
+    t = trigger_us + 5 * MS;
+    sim.input.schedule(KBD, t, KEY_RIGHTSHIFT, 1);
+    for (int i = 0; i < 30; ++i) {
+        sim.tap(KBD, t + 1 * MS + 2 * i * MS, Letters[i % 26], 1 * MS);
+    }
+    sim.input.schedule(KBD, t + 300 * MS, KEY_RIGHTSHIFT, 0);
+    sim.run(t + 2000 * MS);
+
+    check(result, "conversions", 1, sim.pipeline.conversions);
+    if (sim.input.dropped_buffers == 0) result.failures.push_back("the kernel buffer never overflowed");
+
+    std::vector<int> state(KEY_MAX + 1, 0);
+    for (const auto &w: sim.keys()) {
+        state[w.ev.code] = w.ev.value != 0;
+    }
+    int stuck = 0;
+    for (int down: state) {
+        stuck += down;
+    }
+    check(result, "keys left down for applications", 0, stuck);
+
+    result.summary = std::to_string(sim.input.dropped_buffers) + " buffer overflows, "
+                     + std::to_string(sim.pipeline.passthrough_latency.count) + " keys passed through";
+    results.push_back(result);
+}
+
+// Three layouts: each conversion switches straight to the layout the word was meant for,
+// and a layout switch made by the user is followed.
+void scenario_layouts() {
+    Result result{"layouts", "", {}};
+    Sim sim(false);
+    if (!sim.start_with_keyboard(result)) return;
+    Layouts &layouts = sim.conv.layouts;
+    if (!layouts.add("us", "`1234567890-=qwertyuiop[]\\asdfghjkl;'zxcvbnm,./",
+                     "~!@#$%^&*()_+QWERTYUIOP{}|ASDFGHJKL:\"ZXCVBNM<>?", "etaoinshrdlcumwfgypbvkjxqz") ||
+        !layouts.add("ru", "ё1234567890-=йцукенгшщзхъ\\фывапролджэячсмитьбю.",
+                     "Ё!\"№;%:?*()_+ЙЦУКЕНГШЩЗХЪ/ФЫВАПРОЛДЖЭЯЧСМИТЬБЮ,", "оеаинтсрвлкмдпуяыьгзбчйхжшюцщэфъё") ||
+        !layouts.add("ua", "'1234567890-=йцукенгшщзхїґфівапролджєячсмитьбю.",
+                     "₴!\"№;%:?*()_+ЙЦУКЕНГШЩЗХЇҐФІВАПРОЛДЖЄЯЧСМИТЬБЮ,", "оанівтеирсклудмпзяьгчбхжшйюцєщфїґ")) {
+        result.failures.push_back("failed to add layouts: " + layouts.err);
+        results.push_back(result);
+        return;
+    }
+
+    // "привіт" typed in us goes to ua, two switches away; "hello" typed in ua goes to us, one switch away;
+    // after the user switches to ru, "привіт" typed there goes to ua, one switch away
+    struct Step {
+        std::vector<int> word;
+        bool user_switch;
+        size_t switches;
+        size_t layout;
+    };
+    const std::vector<Step> steps = {
+        {{KEY_G, KEY_H, KEY_B, KEY_D, KEY_S, KEY_N}, false, 2, 2},
+        {{KEY_SPACE, KEY_H, KEY_E, KEY_L, KEY_L, KEY_O}, false, 1, 0},
+        {{KEY_SPACE, KEY_G, KEY_H, KEY_B, KEY_D, KEY_S, KEY_N}, true, 1, 2},
+    };
+
+    // each conversion is written within OUTPUT_MS, the next step starts after it
+    const long long OUTPUT_MS = 900;
+    long long t = sim.now() + 100 * MS;
+    std::vector<long long> triggers;
+    for (const auto &step: steps) {
+        if (step.user_switch) t = sim.tap(KBD, t, LS_KEY) + 50 * MS;
+        for (int code: step.word) {
+            t = sim.tap(KBD, t, code) + 50 * MS;
+        }
+        triggers.push_back(sim.trigger(KBD, t));
+        t = triggers.back() + (OUTPUT_MS + 100) * MS;
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < steps.size(); ++i) {
+        long long written = triggers[i] + OUTPUT_MS * MS;
+        sim.run(written);
+        size_t switches = 0;
+        for (const auto &w: sim.keys()) {
+            if (w.time_us >= triggers[i] && w.time_us <= written && w.ev.code == LS_KEY && w.ev.value == 1) {
+                ++switches;
+            }
+        }
+        total += switches;
+        check(result, "switches of conversion " + std::to_string(i), steps[i].switches, switches);
+        check(result, "layout after conversion " + std::to_string(i), steps[i].layout, sim.conv.get_layout());
+    }
+    check(result, "conversions", steps.size(), sim.pipeline.conversions);
+
+    result.summary = std::to_string(steps.size()) + " conversions with " + std::to_string(total) + " layout switches";
+    results.push_back(result);
+}
+
+// Cursor keys and Delete keep the buffer: a typo fixed in the middle of a word, then a conversion
+// at the end of the line, and a conversion with the cursor inside a word.
+void scenario_cursor() {
+    Result result{"cursor", "", {}};
+    Sim sim(false);
+    if (!sim.start_with_keyboard(result)) return;
+
+    // "ghbdtn" typed as "ghbxtn", fixed with Left, Left, Backspace, D, End
+    long long t = sim.now() + 100 * MS;
+    for (int code: {KEY_G, KEY_H, KEY_B, KEY_X, KEY_T, KEY_N, KEY_LEFT, KEY_LEFT, KEY_BACKSPACE, KEY_D, KEY_END}) {
+        t = sim.tap(KBD, t, code) + 50 * MS;
+    }
+    long long first = sim.trigger(KBD, t);
+
+    // " ntcn" typed with a Delete in it, converted with the cursor after "nt"
+    t = first + 1000 * MS;
+    for (int code: {KEY_SPACE, KEY_N, KEY_T, KEY_C, KEY_X, KEY_N, KEY_LEFT, KEY_LEFT, KEY_DELETE, KEY_LEFT}) {
+        t = sim.tap(KBD, t, code) + 50 * MS;
+    }
+    long long second = sim.trigger(KBD, t);
+    sim.run(second + 2000 * MS);
+
+    check(result, "conversions", 2, sim.pipeline.conversions);
+
+    // output key presses of a conversion, other than the layout switch
+    auto presses = [&sim](long long from, long long to) {
+        std::vector<int> codes;
+        for (const auto &w: sim.keys()) {
+            if (w.time_us >= from && w.time_us < to && w.ev.value == 1 && w.ev.code != LS_KEY) {
+                codes.push_back(w.ev.code);
+            }
+        }
+        return codes;
+    };
+    const std::vector<int> expected_first = {
+        KEY_BACKSPACE, KEY_BACKSPACE, KEY_BACKSPACE, KEY_BACKSPACE, KEY_BACKSPACE, KEY_BACKSPACE,
+        KEY_G, KEY_H, KEY_B, KEY_D, KEY_T, KEY_N
+    };
+    const std::vector<int> expected_second = {
+        KEY_BACKSPACE, KEY_BACKSPACE, KEY_DELETE, KEY_DELETE,
+        KEY_N, KEY_T, KEY_C, KEY_N, KEY_LEFT, KEY_LEFT
+    };
+    std::vector<int> output_first = presses(first, first + 1000 * MS);
+    std::vector<int> output_second = presses(second, second + 2000 * MS);
+    check(result, "first conversion keys", expected_first.size(), output_first.size());
+    check(result, "second conversion keys", expected_second.size(), output_second.size());
+    if (output_first != expected_first) result.failures.push_back("wrong keys in the first conversion");
+    if (output_second != expected_second) result.failures.push_back("wrong keys in the second conversion");
+
+    result.summary = std::to_string(output_first.size() + output_second.size())
+                     + " keys written by conversions after in-line edits";
+    results.push_back(result);
+}
+
+// Commands of the control socket: a word converted without its trigger, typing ignored while paused,
+// an undo, and the state reported after each of them.
+void scenario_control() {
+    Result result{"control", "", {}};
+    Sim sim(false);
+    if (!sim.start_with_keyboard(result)) return;
+
+    std::vector<ControlState> states;
+    auto command = [&sim, &states](long long time_us, int cmd) {
+        sim.at(time_us, [&sim, &states, cmd]() {
+            ControlState state{};
+            sim.pipeline.command(cmd, state);
+            states.push_back(state);
+        });
+    };
+
+    // the debug log records the command after the keys it converts
+    char log_path[] = "/tmp/easy-switcher-sim.XXXXXX";
+    int log_fd = mkstemp(log_path);
+    DebugLog log;
+    if (log_fd != -1 && log.open(log_path)) sim.pipeline.debug_log = &log;
+
+    // "ghbdtn" converted by a command and undone, then " ntcn" typed while paused and after resuming;
+    // the press of "n" is read in the same round of the loop as the command, so it is still queued
+    long long t = sim.now() + 100 * MS;
+    for (int code: {KEY_G, KEY_H, KEY_B, KEY_D, KEY_T}) {
+        t = sim.tap(KBD, t, code) + 50 * MS;
+    }
+    long long convert = t;
+    sim.tap(KBD, convert, KEY_N);
+    sim.at(convert, [&sim]() {
+        sim.input.deliver();
+        sim.input.readable(sim.ready);
+        for (int fd: sim.ready) sim.reader.read(fd);
+    });
+    command(convert, CommandConvertWord);
+    command(convert + 1000 * MS, CommandUndo);
+    command(convert + 2000 * MS, CommandUndo);
+    t = convert + 3000 * MS;
+    command(t, CommandPause);
+    for (int i = 0; i < 2; ++i) {
+        for (int code: {KEY_SPACE, KEY_N, KEY_T, KEY_C, KEY_N}) {
+            t = sim.tap(KBD, t + 10 * MS, code) + 50 * MS;
+        }
+        if (i == 0) command(t, CommandResume);
+    }
+    command(t, CommandState);
+    command(t, 99);
+    sim.run(t + 1000 * MS);
+
+    check(result, "replies", 7, states.size());
+    if (states.size() == 7) {
+        check(result, "convert status", StatusOk, states[0].status);
+        check(result, "layout after converting", 1, states[0].layout);
+        check(result, "undo status", StatusOk, states[1].status);
+        check(result, "layout after undo", 0, states[1].layout);
+        check(result, "second undo status", StatusFailed, states[2].status);
+        check(result, "conversions without the failed undo", 2, states[2].conversions);
+        check(result, "paused", 1, states[3].paused);
+        check(result, "buffer when paused", 0, states[3].buffer_size);
+        check(result, "resumed", 0, states[4].paused);
+        check(result, "buffer typed while paused", 0, states[4].buffer_size);
+        check(result, "buffer typed after resuming", 5, states[5].buffer_size);
+        check(result, "unknown command status", StatusUnknown, states[6].status);
+    }
+
+    size_t backspaces = 0;
+    for (const auto &w: sim.keys()) {
+        if (w.time_us >= convert && w.time_us < convert + 1000 * MS && w.ev.code == KEY_BACKSPACE && w.ev.value == 1) {
+            ++backspaces;
+        }
+    }
+    check(result, "keys converted by the command", 6, backspaces);
+
+    log.close();
+    std::vector<LogRecord> records;
+    LogRecord record{};
+    for (std::ifstream in(log_path, std::ios::binary); in.read((char *) &record, sizeof(record));) {
+        records.push_back(record);
+    }
+    if (log_fd != -1) ::close(log_fd);
+    unlink(log_path);
+    long long inputs_before = 0;
+    for (const LogRecord &r: records) {
+        if (r.type == LogControl) break;
+        if (r.type == LogInput) ++inputs_before;
+    }
+    check(result, "key events logged before the command", 11, inputs_before);
+
+    result.summary = std::to_string(states.size()) + " commands, " + std::to_string(backspaces)
+                     + " keys converted without a trigger";
+    results.push_back(result);
+}
+
+// A restart while typing: the new instance takes over the grabbed keyboard, the virtual keyboard
+// and the typed text, as restart() and resume_devices() do across exec. Keys typed while no instance
+// is running wait in the kernel, none reach applications past the grab, and the word typed across
+// the restart is converted whole.
+void scenario_restart() {
+    Result result{"restart", "", {}};
+    Sim sim(true);
+    if (!sim.start_with_keyboard(result)) return;
+
+    InputReader reader;
+    VirtualKeyboard vk;
+    Converter conv;
+    Pipeline pipeline{reader, vk, conv};
+    reader.input = &sim.input;
+    reader.grab = true;
+    reader.init();
+    vk.output = &sim.output;
+    vk.clock = &sim.clock;
+    vk.delay = DELAY_MS;
+    vk.passthrough = true;
+    pipeline.clock = &sim.clock;
+    pipeline.reserve();
+    conv.ls_keys[0] = LS_KEY;
+
+    // "ghbdtn": "ghb" typed before the restart, "d" pressed as it stops and read but not processed,
+    // "t" while no instance runs, "n" after it
+    const long long RESTART_MS = 200;
+    long long t = sim.now() + 100 * MS;
+    for (int code: {KEY_G, KEY_H, KEY_B}) {
+        t = sim.tap(KBD, t, code) + 50 * MS;
+    }
+    long long stop = t;
+    sim.stop(stop);
+
+    size_t adopted = 0;
+    bool resumed = true;
+    size_t queued = 0;
+    sim.at(stop + RESTART_MS * MS, [&]() {
+        // as restart(), the queued events are processed before the handover
+        for (const Device &device: sim.reader.get_devices()) {
+            queued += device.event_queue.size();
+        }
+        sim.pipeline.process();
+        std::unique_ptr<ConverterState> state(new ConverterState());
+        sim.conv.save(*state);
+        resumed = vk.adopt(sim.vk.get_fd());
+        for (const Device &device: sim.reader.get_devices()) {
+            if (device.fd == -1) continue;
+            if (reader.adopt_device(device.path, device.fd, device.grabbed) != -1) ++adopted;
+        }
+        conv.restore(*state);
+        sim.active_reader = &reader;
+        sim.active = &pipeline;
+        sim.stopped = false;
+    });
+    for (int code: {KEY_D, KEY_T}) {
+        t = sim.tap(KBD, t, code) + 50 * MS;
+    }
+    t = sim.tap(KBD, stop + (RESTART_MS + 50) * MS, KEY_N) + 50 * MS;
+    long long trigger = sim.trigger(KBD, t);
+    sim.run(trigger + 1000 * MS);
+
+    check(result, "virtual keyboard adopted", 1, resumed);
+    check(result, "devices adopted", 1, adopted);
+    check(result, "events queued at the stop", 2, queued); // press of "d" and its SYN_REPORT
+    check(result, "events past the grab", 0, sim.input.direct_events);
+    check(result, "conversions", 1, pipeline.conversions);
+
+    size_t passed = 0, backspaces = 0;
+    for (const auto &w: sim.keys()) {
+        if (w.ev.value != 1) continue;
+        if (w.time_us < trigger && w.ev.code != KEY_LEFTSHIFT) ++passed;
+        if (w.time_us >= trigger && w.ev.code == KEY_BACKSPACE) ++backspaces;
+    }
+    check(result, "keys passed through", 6, passed);
+    check(result, "keys converted", 6, backspaces);
+
+    result.summary = std::to_string(passed) + " keys passed through and converted across a "
+                     + std::to_string(RESTART_MS) + " ms restart";
+    results.push_back(result);
+}
+
+// The handoff of a restart with many keyboards: every descriptor and the typed text are queued
+// before exec, when nobody reads the socket yet, and come back in order on the other end.
+void scenario_handoff() {
+    Result result{"handoff", "", {}};
+    const size_t DEVICES = 256;
+    const uint32_t TYPED = 100;
+
+    int fds[2];
+    if (pipe(fds) == -1) {
+        failed_to_start(result);
+        return;
+    }
+
+    Handoff handoff;
+    handoff.output_fd = fds[1];
+    for (size_t i = 0; i < DEVICES; ++i) {
+        handoff.devices.push_back({"/dev/input/event" + std::to_string(i), fds[0], i % 2 == 0});
+    }
+    handoff.converter.layout = 1;
+    handoff.converter.cursor = 2;
+    handoff.converter.size = TYPED;
+    for (uint32_t i = 0; i < TYPED; ++i) {
+        handoff.converter.events[i] = {Letters[i % 26], 1, i * MS};
+    }
+
+    int resume_fd = -1;
+    bool sent = handoff.send(resume_fd);
+    Handoff resumed;
+    // the sender keeps its end, as an image does until exec
+    bool received = sent && resumed.receive(dup(resume_fd));
+    if (!received) result.failures.push_back(handoff.err + resumed.err);
+
+    size_t in_order = 0;
+    for (size_t i = 0; i < resumed.devices.size(); ++i) {
+        const HandoffDevice &device = resumed.devices[i];
+        if (device.path == handoff.devices[i].path && device.grabbed == handoff.devices[i].grabbed) ++in_order;
+    }
+    size_t typed = 0;
+    for (uint32_t i = 0; i < TYPED; ++i) {
+        const KeyEvent &event = resumed.converter.events[i];
+        if (event.code == Letters[i % 26] && event.value == 1 && event.time_us == i * MS) ++typed;
+    }
+
+    check(result, "handoff sent", 1, sent);
+    check(result, "virtual keyboard received", 1, resumed.output_fd != -1);
+    check(result, "devices received", DEVICES, resumed.devices.size());
+    check(result, "devices in order", DEVICES, in_order);
+    check(result, "layout", 1, resumed.converter.layout);
+    check(result, "cursor", 2, resumed.converter.cursor);
+    check(result, "typed events", TYPED, resumed.converter.size);
+    check(result, "typed events restored", TYPED, typed);
+
+    ::close(fds[0]);
+    ::close(fds[1]);
+    result.summary = std::to_string(resumed.devices.size()) + " keyboards and " + std::to_string(typed)
+                     + " typed events handed over";
+    results.push_back(result);
+}
+
+static const char EnglishText[] =
+    "hello world, this is a short text in english. the quick brown fox jumps over the lazy dog.\n"
+    "we write words here so that the model learns which letters follow each other in english.\n"
+    "hello again, the world is large and there are many other words to type on a keyboard.\n";
+
+static const char RussianText[] =
+    "привет мир, это короткий текст на русском языке. съешь же ещё этих мягких французских булок.\n"
+    "мы пишем здесь слова, чтобы модель узнала, какие буквы идут друг за другом в русском языке.\n"
+    "привет снова, мир большой, и есть много других слов, которые можно набрать на клавиатуре.\n";
+
+// Writes keymaps and models learned from the texts above to a temporary directory.
+static bool write_models(std::string &dir, std::string &err) {
+    char tmpl[] = "/tmp/easy-switcher-sim.XXXXXX";
+    if (!mkdtemp(tmpl)) {
+        err = "failed to create a temporary directory";
+        return false;
+    }
+    dir = tmpl;
+
+    std::ofstream(dir + "/us.map")
+            << "`1234567890-=qwertyuiop[]\\asdfghjkl;'zxcvbnm,./\n"
+            << "~!@#$%^&*()_+QWERTYUIOP{}|ASDFGHJKL:\"ZXCVBNM<>?\n"
+            << "etaoinshrdlcumwfgypbvkjxqz\n";
+    std::ofstream(dir + "/ru.map")
+            << "ё1234567890-=йцукенгшщзхъ\\фывапролджэячсмитьбю.\n"
+            << "Ё!\"№;%:?*()_+ЙЦУКЕНГШЩЗХЪ/ФЫВАПРОЛДЖЭЯЧСМИТЬБЮ,\n"
+            << "оеаинтсрвлкмдпуяыьгзбчйхжшюцщэфъё\n";
+
+    const std::pair<const char *, const char *> models[] = {{"us", EnglishText}, {"ru", RussianText}};
+    for (const auto &model: models) {
+        Layouts layout;
+        std::string name = model.first;
+        std::istringstream text(model.second);
+        std::ofstream out(dir + "/" + name + ".ngram", std::ios::binary);
+        if (!layout.load_keymap(dir + "/" + name + ".map") || !layout.build_model(0, text, out)) {
+            err = layout.err;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Words typed in the wrong layout are converted as soon as they end, words in the right one are left alone.
+void scenario_auto() {
+    Result result{"auto", "", {}};
+    Sim sim(true); // auto-convert needs grab
+    if (!sim.start_with_keyboard(result)) return;
+
+    std::string dir, err;
+    bool loaded = write_models(dir, err);
+    if (loaded && !sim.conv.layouts.load(dir + "/us.map," + dir + "/ru.map")) err = sim.conv.layouts.err;
+    if (!dir.empty()) std::system(("rm -rf " + dir).c_str());
+    if (!err.empty() || !sim.conv.layouts.has_models()) {
+        result.failures.push_back("failed to load the models: " + err);
+        results.push_back(result);
+        return;
+    }
+    sim.conv.auto_convert = true;
+
+    // "привет" typed in us, "hello" typed in ru after the switch, "world" typed in us
+    const std::vector<std::vector<int> > words = {
+        {KEY_G, KEY_H, KEY_B, KEY_D, KEY_T, KEY_N},
+        {KEY_H, KEY_E, KEY_L, KEY_L, KEY_O},
+        {KEY_W, KEY_O, KEY_R, KEY_L, KEY_D},
+    };
+    const size_t expected[] = {1, 2, 2};
+    const size_t layouts[] = {1, 0, 0};
+
+    long long t = sim.now() + 100 * MS;
+    for (size_t i = 0; i < words.size(); ++i) {
+        for (int code: words[i]) {
+            t = sim.tap(KBD, t, code) + 50 * MS;
+        }
+        // the next word starts while the first conversion is being written
+        t = sim.tap(KBD, t, KEY_SPACE) + (i == 0 ? 20 : 1000) * MS;
+        sim.run(t);
+        check(result, "conversions after word " + std::to_string(i), expected[i], sim.pipeline.conversions);
+        check(result, "layout after word " + std::to_string(i), layouts[i], sim.conv.get_layout());
+    }
+
+    // the first conversion is written whole, the keys typed meanwhile were held back by the grab
+    std::vector<int> expected_output(7, KEY_BACKSPACE);
+    expected_output.insert(expected_output.end(), words[0].begin(), words[0].end());
+    expected_output.push_back(KEY_SPACE);
+    auto keys = sim.keys();
+    size_t first = 0;
+    while (first < keys.size() && keys[first].ev.code != KEY_BACKSPACE) ++first;
+    size_t matching = 0;
+    for (size_t i = 0; i < expected_output.size() && first + 2 * i + 1 < keys.size(); ++i) {
+        const auto &down = keys[first + 2 * i].ev;
+        const auto &up = keys[first + 2 * i + 1].ev;
+        if (down.code != expected_output[i] || down.value != 1 || up.code != expected_output[i] || up.value != 0) break;
+        ++matching;
+    }
+    check(result, "keys of the first conversion written in one piece", expected_output.size(), matching);
+    check(result, "events past the grab", 0, sim.input.direct_events);
+
+    result.summary = std::to_string(sim.pipeline.conversions) + " of " + std::to_string(words.size())
+                     + " words converted automatically";
+    results.push_back(result);
+}
+
+// Runs a typing session with double shifts every 50 words and, every 40 words, a shift tapped
+// again a few seconds after the last one. Returns the conversions and the output keys.
+static bool run_triggers(int window, int words, int &triggers, int &spurious,
+                         unsigned long &conversions, size_t &output_keys) {
+    Sim sim(false);
+    if (!sim.start_with_keyboard()) return false;
+    sim.conv.trigger_window = window;
+
+    std::mt19937 rng(1);
+    long long t = sim.now() + 100 * MS;
+    triggers = 0;
+    spurious = 0;
+    for (int i = 1; i <= words; ++i) {
+        int length = 2 + rng() % 7;
+        for (int k = 0; k < length; ++k) {
+            if (k == 0 && i % 7 == 0) {
+                // a capital letter
+                sim.input.schedule(KBD, t, KEY_LEFTSHIFT, 1);
+                t = sim.tap(KBD, t + 60 * MS, Letters[rng() % 26], 30 * MS) + 40 * MS;
+                sim.input.schedule(KBD, t, KEY_LEFTSHIFT, 0);
+                t += 60 * MS;
+                continue;
+            }
+            t = sim.tap(KBD, t, Letters[rng() % 26], 20 * MS) + 20 * MS;
+        }
+        if (i % 50 == 0) {
+            t = sim.trigger(KBD, t) + 1000 * MS;
+            ++triggers;
+        } else if (i % 40 == 0) {
+            // shift tapped and tapped again after a pause, two taps that aren't a double shift
+            t = sim.tap(KBD, t, KEY_LEFTSHIFT, 80 * MS) + (2000 + rng() % 2000) * MS;
+            t = sim.tap(KBD, t, KEY_LEFTSHIFT, 80 * MS) + 1000 * MS;
+            ++spurious;
+        } else {
+            t = sim.tap(KBD, t, KEY_SPACE, 20 * MS) + 20 * MS;
+        }
+    }
+    sim.run(t + 2000 * MS);
+
+    conversions = sim.pipeline.conversions;
+    output_keys = sim.keys().size();
+    return true;
+}
+
+// Two words typed in the wrong layout after a line of right ones: the second trigger adds the
+// first word, retyping only it, and the undos take the words back one at a time.
+void scenario_expand() {
+    Result result{"expand", "", {}};
+    Sim sim(false);
+    if (!sim.start_with_keyboard(result)) return;
+    sim.conv.undo_key = KEY_PAUSE;
+    sim.conv.expand_window = 1500;
+
+    // "the quick brown fox", then "привет мир" typed in us
+    const std::vector<std::vector<int> > words = {
+        {KEY_T, KEY_H, KEY_E}, {KEY_Q, KEY_U, KEY_I, KEY_C, KEY_K}, {KEY_B, KEY_R, KEY_O, KEY_W, KEY_N},
+        {KEY_F, KEY_O, KEY_X}, {KEY_G, KEY_H, KEY_B, KEY_D, KEY_T, KEY_N}, {KEY_V, KEY_B, KEY_H}
+    };
+    long long t = sim.now() + 100 * MS;
+    size_t line = 0;
+    for (size_t i = 0; i < words.size(); ++i) {
+        if (i > 0) t = sim.tap(KBD, t, KEY_SPACE) + 50 * MS;
+        for (int code: words[i]) {
+            t = sim.tap(KBD, t, code) + 50 * MS;
+        }
+        line += words[i].size() + (i > 0 ? 1 : 0);
+    }
+    const size_t first = words[4].size(), last = words[5].size();
+
+    size_t before = 0;
+    auto step = [&](const std::string &what, long long until, size_t expected, size_t layout) {
+        sim.run(until);
+        size_t written = sim.keys().size() - before;
+        before += written;
+        check(result, what + " output keys", expected, written);
+        check(result, what + " layout", layout, sim.conv.get_layout());
+        return written;
+    };
+
+    t = sim.trigger(KBD, t);
+    step("conversion", t + 500 * MS, 2 + 4 * last, 1);
+    t = sim.trigger(KBD, t + 500 * MS);
+    size_t expanded = step("expansion", t + 1000 * MS, 4 * (last + 1) + 4 * first, 1);
+    auto keys = sim.keys();
+    if (expanded == 4 * (last + 1) + 4 * first) {
+        size_t at = keys.size() - expanded, moves = 2 * (last + 1);
+        check(result, "cursor moved back", KEY_LEFT, keys[at].ev.code);
+        check(result, "first word erased", KEY_BACKSPACE, keys[at + moves].ev.code);
+        check(result, "first word replayed", words[4][0], keys[at + moves + 2 * first].ev.code);
+        check(result, "cursor moved forward", KEY_RIGHT, keys.back().ev.code);
+    }
+    t = sim.tap(KBD, t + 1000 * MS, KEY_PAUSE);
+    step("undo of the expansion", t + 1000 * MS, 4 * (last + 1) + 4 * first + 4, 1);
+    t = sim.tap(KBD, t + 1000 * MS, KEY_PAUSE);
+    step("undo of the conversion", t + 1000 * MS, 2 + 4 * last, 0);
+
+    // a trigger after the window converts the last word again
+    t = sim.trigger(KBD, t + 1000 * MS);
+    step("first trigger again", t + 2000 * MS, 2 + 4 * last, 1);
+    t = sim.trigger(KBD, t + 2000 * MS);
+    step("trigger after the window", t + 1000 * MS, 2 + 4 * last, 0);
+
+    // expanding is off by default, a quick trigger converts the last word back
+    sim.conv.expand_window = DEFAULT_EXPAND_WINDOW;
+    t = sim.trigger(KBD, t + 1000 * MS);
+    step("trigger with the default window", t + 500 * MS, 2 + 4 * last, 1);
+    t = sim.trigger(KBD, t + 500 * MS);
+    step("quick trigger with the default window", t + 1000 * MS, 2 + 4 * last, 0);
+
+    result.summary = "the second word added with " + std::to_string(expanded) + " output keys, "
+                     + std::to_string(2 + 4 * line) + " to convert the line";
+    results.push_back(result);
+}
+
+// Double shifts made of taps seconds apart: without a trigger window they convert and replay
+// the last word for nothing, with the default window only the real double shifts convert.
+void scenario_triggers() {
+    Result result{"triggers", "", {}};
+    const int WORDS = 2000;
+    int triggers = 0, spurious = 0;
+    unsigned long before = 0, after = 0;
+    size_t keys_before = 0, keys_after = 0;
+    if (!run_triggers(0, WORDS, triggers, spurious, before, keys_before) ||
+        !run_triggers(Converter().trigger_window, WORDS, triggers, spurious, after, keys_after)) {
+        result.failures.push_back("failed to start");
+        results.push_back(result);
+        return;
+    }
+
+    check(result, "conversions without a window", triggers + spurious, before);
+    check(result, "conversions with the window", triggers, after);
+
+    // the window times the taps only: a shift held for longer around them still converts the line
+    Sim sim(false);
+    if (!sim.start_with_keyboard(result)) return;
+    long long t = sim.now() + 100 * MS;
+    for (int code: {KEY_G, KEY_H, KEY_B, KEY_SPACE, KEY_D, KEY_T, KEY_N}) {
+        t = sim.tap(KBD, t, code) + 50 * MS;
+    }
+    sim.input.schedule(KBD, t, KEY_RIGHTSHIFT, 1);
+    t = sim.trigger(KBD, t + 2000 * MS);
+    sim.input.schedule(KBD, t + 1000 * MS, KEY_RIGHTSHIFT, 0);
+    sim.run(t + 3000 * MS);
+    size_t backspaces = 0;
+    for (const auto &w: sim.keys()) {
+        if (w.ev.code == KEY_BACKSPACE && w.ev.value == 1) ++backspaces;
+    }
+    check(result, "conversions with a long-held shift", 1, sim.pipeline.conversions);
+    check(result, "line converted with a long-held shift", 7, backspaces);
+
+    long long wasted_ms = (long long) (keys_before - keys_after) * DELAY_MS;
+    long long false_before = (long long) before - triggers;
+    long long false_after = (long long) after - triggers;
+    result.summary = "false triggers " + std::to_string(false_before) + " of " + std::to_string(before)
+                     + " without a window, " + std::to_string(false_after) + " of " + std::to_string(after)
+                     + " with it; " + std::to_string(wasted_ms) + " ms of replay saved";
+    results.push_back(result);
+}
+
+// --filter: a converted word and its undo go through a pipe. Everything but the undo key events
+// passes through in order, the output comes right after its trigger.
+void scenario_filter() {
+    Result result{"filter", "", {}};
+
+    std::vector<input_event> in;
+    long long t = 1000 * MS;
+    auto key = [&](int code, int value) {
+        input_event ev{};
+        ev.time.tv_sec = t / 1000000;
+        ev.time.tv_usec = t % 1000000;
+        ev.type = EV_MSC;
+        ev.code = MSC_SCAN;
+        ev.value = code;
+        in.push_back(ev);
+        ev.type = EV_KEY;
+        ev.code = code;
+        ev.value = value;
+        in.push_back(ev);
+        ev.type = EV_SYN;
+        ev.code = SYN_REPORT;
+        ev.value = 0;
+        in.push_back(ev);
+        t += 30 * MS;
+    };
+    const int word[] = {KEY_G, KEY_H, KEY_B, KEY_D, KEY_T, KEY_N};
+    for (int code: word) {
+        key(code, 1);
+        key(code, 0);
+    }
+    for (int i = 0; i < 2; ++i) {
+        key(KEY_LEFTSHIFT, 1);
+        key(KEY_LEFTSHIFT, 0);
+    }
+    size_t trigger = in.size() - 1; // SYN_REPORT of the trigger's last event
+    key(KEY_PAUSE, 1);
+    key(KEY_PAUSE, 0);
+
+    int fds[2];
+    FILE *out = tmpfile();
+    if (pipe(fds) == -1 || !out) {
+        result.failures.push_back("failed to create the pipe");
+        results.push_back(result);
+        return;
+    }
+    ssize_t written = write(fds[1], in.data(), in.size() * sizeof(input_event));
+    close(fds[1]);
+
+    Converter conv;
+    conv.ls_keys[0] = LS_KEY;
+    conv.undo_key = KEY_PAUSE;
+    SimClock clock;
+    StreamFilter stream(conv);
+    stream.clock = &clock;
+    stream.delay = DELAY_MS;
+    long long started = clock.now_us();
+    bool ok = written == (ssize_t) (in.size() * sizeof(input_event)) && stream.run(fds[0], fileno(out));
+    close(fds[0]);
+    if (!ok) {
+        result.failures.push_back("filter failed: " + stream.err);
+        fclose(out);
+        results.push_back(result);
+        return;
+    }
+
+    std::vector<input_event> output(in.size() * 4);
+    rewind(out);
+    output.resize(fread(output.data(), sizeof(input_event), output.size(), out));
+    fclose(out);
+
+    const size_t n = sizeof(word) / sizeof(word[0]);
+    const size_t plan = 2 + 4 * n;
+    check(result, "conversions", 2, stream.conversions);
+    check(result, "output events", in.size() - 2 + 4 * plan, output.size());
+    check(result, "time spent in delays, us", 2 * plan * DELAY_MS * MS, clock.now_us() - started);
+    if (output.size() == in.size() - 2 + 4 * plan) {
+        // the trigger's last key event, then the conversion, then the SYN_REPORT it was waiting for
+        for (size_t i = 0; i < trigger; ++i) {
+            check(result, "passed through event " + std::to_string(i), in[i].code, output[i].code);
+        }
+        check(result, "layout switch", LS_KEY, output[trigger].code);
+        check(result, "replayed key", word[n - 1], output[trigger + 2 * (plan - 2)].code);
+        check(result, "trigger's SYN_REPORT", EV_SYN, output[trigger + 2 * plan].type);
+        size_t undo_key = 0;
+        for (const auto &ev: output) {
+            if (ev.type == EV_KEY && ev.code == KEY_PAUSE) ++undo_key;
+        }
+        check(result, "undo key events passed", 0, undo_key);
+    }
+
+    result.summary = std::to_string(in.size()) + " events in, " + std::to_string(output.size()) + " out, "
+                     + std::to_string(stream.conversions) + " conversions";
+    results.push_back(result);
+}
+
+// Converter alone, fed a recorded-like trace one event at a time and with push_batch():
+// both must take the same actions and leave the same buffer, the batch one faster.
+void scenario_batch(int words) {
+    Result result{"batch", "", {}};
+
+    std::mt19937 rng(1);
+    std::vector<KeyEvent> trace;
+    long long t = 100 * MS;
+    auto key = [&](int code, int value) {
+        trace.push_back({code, value, t});
+        t += 20 * MS;
+    };
+    for (int i = 1; i <= words; ++i) {
+        int length = 2 + rng() % 7;
+        for (int k = 0; k < length; ++k) {
+            int code = Letters[rng() % 26];
+            bool capital = k == 0 && i % 7 == 0;
+            if (capital) key(KEY_LEFTSHIFT, 1);
+            key(code, 1);
+            if (rng() % 20 == 0) key(code, 2);
+            key(code, 0);
+            if (capital) key(KEY_LEFTSHIFT, 0);
+        }
+        if (rng() % 10 == 0) {
+            key(KEY_BACKSPACE, 1);
+            key(KEY_BACKSPACE, 0);
+        }
+        if (rng() % 100 == 0) {
+            key(KEY_CAPSLOCK, 1);
+            key(KEY_CAPSLOCK, 0);
+        }
+        if (rng() % 200 == 0) {
+            key(BTN_LEFT, 1);
+            key(BTN_LEFT, 0);
+        }
+        if (i % 50 == 0) {
+            key(KEY_LEFTSHIFT, 1);
+            key(KEY_LEFTSHIFT, 0);
+            key(KEY_LEFTSHIFT, 1);
+            key(KEY_LEFTSHIFT, 0);
+        } else {
+            key(KEY_SPACE, 1);
+            key(KEY_SPACE, 0);
+        }
+    }
+
+    Converter single, batch;
+    single.ls_keys[0] = batch.ls_keys[0] = LS_KEY;
+    std::vector<KeyEvent> plan;
+    plan.reserve(PLAN_SIZE);
+    std::vector<std::pair<int, size_t> > actions_single, actions_batch;
+
+    auto started = std::chrono::steady_clock::now();
+    for (const auto &ev: trace) {
+        if (!single.push(ev.code, ev.value, ev.time_us)) continue;
+        Action action = single.process();
+        if (action == None) continue;
+        single.convert(action, plan);
+        actions_single.emplace_back(action, plan.size());
+    }
+    double single_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    started = std::chrono::steady_clock::now();
+    for (size_t done = 0; done < trace.size();) {
+        size_t consumed;
+        Action action = batch.push_batch(trace.data() + done, trace.size() - done, consumed);
+        done += consumed;
+        if (action == None) continue;
+        batch.convert(action, plan);
+        actions_batch.emplace_back(action, plan.size());
+    }
+    double batch_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    std::string dump_single, dump_batch;
+    single.get_buffer_dump(dump_single);
+    batch.get_buffer_dump(dump_batch);
+    check(result, "conversions", words / 50, actions_single.size());
+    check(result, "actions of push_batch", actions_single.size(), actions_batch.size());
+    check(result, "same actions and plans", 1, actions_single == actions_batch);
+    check(result, "same buffer", 1, dump_single == dump_batch);
+    check(result, "same layout", single.get_layout(), batch.get_layout());
+
+    auto rate = [&](double seconds) {
+        return std::to_string((long long) (trace.size() / (seconds > 0 ? seconds : 1e-9)));
+    };
+    result.summary = std::to_string(trace.size()) + " events, " + rate(single_s) + " events/s one at a time, "
+                     + rate(batch_s) + " events/s in batches";
+    results.push_back(result);
+}
+
+// A long typing session with regular conversions: every trigger converts,
+// and the pipeline doesn't allocate once it has warmed up.
+void scenario_replay(int words, int devices, bool use_counters) {
+    Result result{"replay", "", {}};
+    Sim sim(false);
+    // keys rotate across the keyboards, like --devices of easy-switcher-loadgen
+    std::vector<std::string> keyboards = {KBD};
+    for (int i = 1; i < devices; ++i) {
+        keyboards.push_back("/dev/input/event" + std::to_string(100 + i));
+        sim.hotplug.initial.push_back(keyboards.back());
+        sim.input.add_node(keyboards.back(), "Sim keyboard " + std::to_string(i + 1));
+    }
+    if (!sim.start_with_keyboard(result)) return;
+    check(result, "keyboards opened", devices, sim.reader.get_device_count());
+
+    std::mt19937 rng(1);
+    const int TRIGGER_EVERY = 50;
+    long long t = sim.now() + 100 * MS;
+    unsigned long keys = 0;
+    int triggers = 0;
+    for (int i = 1; i <= words; ++i) {
+        int length = 2 + rng() % 7;
+        for (int k = 0; k < length; ++k) {
+            t = sim.tap(keyboards[keys % devices], t, Letters[rng() % 26], 20 * MS) + 20 * MS;
+            ++keys;
+        }
+        if (i % TRIGGER_EVERY == 0) {
+            // wait for the output, keys typed meanwhile would be discarded
+            t = sim.trigger(keyboards[keys % devices], t) + 1000 * MS;
+            ++triggers;
+        } else {
+            t = sim.tap(keyboards[keys % devices], t, KEY_SPACE, 20 * MS) + 20 * MS;
+            ++keys;
+        }
+    }
+
+    // the first conversion warms up the buffers that grow on demand
+    sim.output.written.reserve(1 << 16);
+    long long warm_up = t / 2;
+    sim.run(warm_up);
+    sim.output.written.clear();
+    StageCounters counters;
+    if (use_counters) {
+        if (counters.open()) {
+            sim.pipeline.counters = &counters;
+            sim.vk.counters = &counters;
+        } else {
+            std::cerr << counters.err << std::endl;
+        }
+    }
+    LowLatency::count_allocations();
+    unsigned long allocations = LowLatency::allocations();
+
+    sim.daemon_time = std::chrono::nanoseconds(0);
+    auto started = std::chrono::steady_clock::now();
+    sim.run(t + 2000 * MS);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    double daemon_seconds = std::chrono::duration<double>(sim.daemon_time).count();
+    if (counters.enabled()) counters.print(std::cout);
+
+    check(result, "conversions", triggers, sim.pipeline.conversions);
+    check(result, "heap allocations after warm-up", 0, LowLatency::allocations() - allocations);
+
+    result.summary = std::to_string(keys) + " keys from " + std::to_string(devices) + " keyboards, "
+                     + std::to_string(triggers) + " conversions, "
+                     + std::to_string((long long) ((keys - keys / 2) / (seconds > 0 ? seconds : 1e-9)))
+                     + " keys/s simulated, "
+                     + std::to_string((long long) ((keys - keys / 2) / (daemon_seconds > 0 ? daemon_seconds : 1e-9)))
+                     + " keys/s through the daemon";
+    results.push_back(result);
+}
+
+void show_help() {
+    std::cout << "Easy Switcher simulator\n"
+            << "Usage: easy-switcher-sim [scenario...]\n"
+            << "Scenarios: typing, interleaved, combo, passthrough, hotplug, syn-dropped, layouts, cursor,\n"
+            << "           control, restart, handoff, auto, triggers, expand, filter, batch, replay\n"
+            << "           (all by default)\n"
+            << "   --words N    words typed in the batch and replay scenarios, default 20000\n"
+            << "   --devices N  keyboards typed on in turn in the replay scenario, default 1\n"
+            << "   --counters   print the stage counters of the replay scenario, see 'stage-counters'\n"
+            << "   -h, --help   show this help" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<std::string> scenarios;
+    int words = 20000;
+    int devices = 1;
+    bool counters = false;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            show_help();
+            return EXIT_SUCCESS;
+        } else if (arg == "--words" && i + 1 < argc) {
+            words = std::stoi(argv[++i]);
+        } else if (arg == "--devices" && i + 1 < argc) {
+            devices = std::max(1, std::stoi(argv[++i]));
+        } else if (arg == "--counters") {
+            counters = true;
+        } else {
+            scenarios.push_back(arg);
+        }
+    }
+    if (scenarios.empty()) {
+        scenarios = {"typing", "interleaved", "combo", "passthrough", "hotplug", "syn-dropped", "layouts", "cursor",
+                     "control", "restart", "handoff", "auto", "triggers", "expand", "filter", "batch", "replay"};
+    }
+
+    for (const auto &name: scenarios) {
+        if (name == "typing") scenario_typing();
+        else if (name == "interleaved") scenario_interleaved();
+        else if (name == "combo") scenario_combo();
+        else if (name == "passthrough") scenario_passthrough();
+        else if (name == "hotplug") scenario_hotplug();
+        else if (name == "syn-dropped") scenario_syn_dropped();
+        else if (name == "layouts") scenario_layouts();
+        else if (name == "cursor") scenario_cursor();
+        else if (name == "control") scenario_control();
+        else if (name == "restart") scenario_restart();
+        else if (name == "handoff") scenario_handoff();
+        else if (name == "auto") scenario_auto();
+        else if (name == "triggers") scenario_triggers();
+        else if (name == "expand") scenario_expand();
+        else if (name == "batch") scenario_batch(words);
+        else if (name == "filter") scenario_filter();
+        else if (name == "replay") scenario_replay(words, devices, counters);
+        else {
+            std::cerr << "Unknown scenario: " << name << std::endl;
+            show_help();
+            return EXIT_FAILURE;
+        }
+    }
+
+    bool failed = false;
+    for (const auto &result: results) {
+        if (result.failures.empty()) {
+            std::cout << "PASS " << result.name << ": " << result.summary << std::endl;
+        } else {
+            failed = true;
+            std::cout << "FAIL " << result.name << std::endl;
+            for (const auto &failure: result.failures) {
+                std::cout << "    " << failure << std::endl;
+            }
+        }
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,252 @@
+// Wake-up latency of Easy Switcher's event loop under CPU load.
+//
+// Runs the daemon's EventLoop and InputReader on pipes standing in for keyboards, read with
+// the epoll or the io_uring backend, optionally after LowLatency::apply() as in low latency mode.
+// A child process writes timestamped key events into the pipes in turn at a fixed interval
+// while busy processes compete for the CPU; the time from the write until the batch handler
+// takes the event is the delay the daemon adds before it sees a key. Needs no devices, root
+// only for the realtime priority. Run it under `strace -c -f` to compare the syscalls of the backends.
+
+#include <algorithm>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <sys/wait.h>
+#include <linux/input.h>
+
+#include "EventLoop.h"
+#include "InputReader.h"
+#include "LowLatency.h"
+#include "UringBackend.h"
+
+struct Options {
+    int events = 3000;      // events to measure
+    int interval = 1000;    // us between events
+    int devices = 1;        // pipes the events are written to in turn
+    int batch = 1;          // events written at once, to as many pipes
+    int cpu_load = 0;       // busy processes competing with the loop
+    bool uring = false;     // read with the io_uring backend instead of epoll
+    bool low_latency = false;
+    int priority = 50;      // SCHED_FIFO priority in low latency mode
+    int cpu = 0;            // CPU to pin to in low latency mode, -1 keeps the default affinity
+};
+
+// Pipes of input_events as keyboards.
+class PipeInput : public InputBackend {
+public:
+    int open(const std::string &, DeviceInfo &) override {
+        errno = ENOENT;
+        return -1;
+    }
+
+    int adopt(int fd, DeviceInfo &info) override {
+        info = {"Pipe keyboard", BUS_VIRTUAL, 0, 0, 0, true, false};
+        return fd;
+    }
+
+    void close(int fd) override {
+        ::close(fd);
+    }
+
+    size_t read(int fd, input_event *events, size_t max) override {
+        ssize_t len = ::read(fd, events, max * sizeof(input_event));
+        return len > 0 ? len / sizeof(input_event) : 0;
+    }
+
+    bool keys_down(int) override { return false; }
+
+    bool grab(int) override { return false; }
+};
+
+static Options opt;
+static EventLoop loop;
+static PipeInput pipes;
+static InputReader reader;
+static UringBackend uring;
+static std::vector<long long> latencies;
+
+static long long now_us() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void input_handler(int fd) {
+    reader.read(fd);
+}
+
+void uring_handler(int) {
+    uring.fetch(reader);
+}
+
+void batch_handler() {
+    long long now = now_us();
+    int fd;
+    input_event ev{};
+    bool grabbed;
+    while (reader.fetch_next(fd, ev, grabbed)) {
+        latencies.push_back(now - (ev.time.tv_sec * 1000000LL + ev.time.tv_usec));
+    }
+    if (latencies.size() >= (size_t) opt.events) loop.stop();
+}
+
+// Writes a batch of key events stamped with the current time every interval, each event
+// to the next pipe in turn, until the pipes close.
+pid_t start_writer(const std::vector<int> &fds) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+
+    for (size_t i = 0;;) {
+        usleep(opt.interval);
+        for (int k = 0; k < opt.batch; ++k, ++i) {
+            long long now = now_us();
+            input_event ev{};
+            ev.time.tv_sec = now / 1000000;
+            ev.time.tv_usec = now % 1000000;
+            ev.type = EV_KEY;
+            ev.code = KEY_A;
+            ev.value = i / fds.size() % 2;
+            if (write(fds[i % fds.size()], &ev, sizeof(ev)) != sizeof(ev)) _exit(0);
+        }
+    }
+}
+
+// Busy processes at the default priority, they take every CPU cycle the loop doesn't.
+std::vector<pid_t> start_cpu_load(int count) {
+    std::vector<pid_t> pids;
+    for (int i = 0; i < count; ++i) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            volatile unsigned long spin = 0;
+            while (true) ++spin;
+        }
+        if (pid > 0) pids.push_back(pid);
+    }
+    return pids;
+}
+
+void stop_processes(const std::vector<pid_t> &pids) {
+    for (pid_t pid: pids) kill(pid, SIGKILL);
+    for (pid_t pid: pids) waitpid(pid, nullptr, 0);
+}
+
+// Creates the pipes and hands their read ends to the reader and the backend.
+bool add_devices(std::vector<int> &write_fds) {
+    for (int i = 0; i < opt.devices; ++i) {
+        int fds[2];
+        if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+            std::cerr << "Failed to create pipe: " << strerror(errno) << std::endl;
+            return false;
+        }
+        write_fds.push_back(fds[1]);
+
+        if (reader.adopt_device("pipe" + std::to_string(i), fds[0], false) == -1) {
+            std::cerr << reader.err << std::endl;
+            return false;
+        }
+        if (opt.uring ? !uring.add_device(fds[0]) : !loop.add_handler(fds[0], input_handler)) {
+            std::cerr << (opt.uring ? uring.err : loop.err) << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+void show_help() {
+    std::cout << "Easy Switcher wake-up latency\n"
+            << "Usage: easy-switcher-wakeup [option value]...\n"
+            << "Options:\n"
+            << "   --events N              events to measure (default 3000)\n"
+            << "   --interval US           time between events (default 1000)\n"
+            << "   --devices N             pipes the events are written to in turn (default 1)\n"
+            << "   --batch N               events written at once, to N pipes (default 1)\n"
+            << "   --io-backend B          epoll or io_uring (default epoll)\n"
+            << "   --cpu-load N            keep N busy processes running (default 0)\n"
+            << "   --low-latency           run the loop as in low-latency mode\n"
+            << "   --realtime-priority N   SCHED_FIFO priority in low-latency mode, 0 to skip (default 50)\n"
+            << "   --cpu-affinity N        CPU to pin to in low-latency mode, -1 to skip (default 0)\n"
+            << "   -h, --help              show this help" << std::endl;
+}
+
+bool parse_options(int argc, char *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+        std::string option = argv[i];
+        if (option == "-h" || option == "--help") return false;
+        if (option == "--low-latency") {
+            opt.low_latency = true;
+            continue;
+        }
+        if (i + 1 >= argc) return false;
+
+        std::string value = argv[++i];
+        if (option == "--events") opt.events = std::max(1, atoi(value.c_str()));
+        else if (option == "--interval") opt.interval = std::max(1, atoi(value.c_str()));
+        else if (option == "--devices") opt.devices = std::max(1, atoi(value.c_str()));
+        else if (option == "--batch") opt.batch = std::max(1, atoi(value.c_str()));
+        else if (option == "--io-backend" && (value == "epoll" || value == "io_uring")) opt.uring = value == "io_uring";
+        else if (option == "--cpu-load") opt.cpu_load = std::max(0, atoi(value.c_str()));
+        else if (option == "--realtime-priority") opt.priority = atoi(value.c_str());
+        else if (option == "--cpu-affinity") opt.cpu = atoi(value.c_str());
+        else return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    if (!parse_options(argc, argv)) {
+        show_help();
+        return EXIT_FAILURE;
+    }
+
+    reader.input = &pipes;
+    latencies.reserve(opt.events + opt.batch + 16);
+    if (!reader.init() || !loop.init()) {
+        std::cerr << loop.err << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (opt.uring && (!uring.init() || !loop.add_handler(uring.get_fd(), uring_handler))) {
+        std::cerr << (uring.err.empty() ? loop.err : uring.err) << std::endl;
+        return EXIT_FAILURE;
+    }
+    loop.set_batch_handler(batch_handler);
+
+    std::vector<int> write_fds;
+    if (!add_devices(write_fds)) return EXIT_FAILURE;
+
+    std::vector<pid_t> load = start_cpu_load(opt.cpu_load);
+    pid_t writer = start_writer(write_fds);
+    for (int fd: write_fds) close(fd);
+
+    bool ok = true;
+    if (opt.low_latency) {
+        LowLatency low_latency;
+        low_latency.priority = opt.priority;
+        low_latency.cpu = opt.cpu;
+        if (!low_latency.apply()) {
+            std::cerr << low_latency.err << std::endl;
+            ok = false;
+        }
+    }
+    if (ok && !loop.run()) {
+        std::cerr << loop.err << std::endl;
+        ok = false;
+    }
+
+    stop_processes({writer});
+    stop_processes(load);
+    if (!ok || latencies.empty()) return EXIT_FAILURE;
+
+    std::sort(latencies.begin(), latencies.end());
+    size_t n = latencies.size();
+    std::cout << (opt.low_latency ? "Low latency mode" : "Default mode") << ", "
+            << (opt.uring ? "io_uring" : "epoll") << ", " << opt.devices << " devices, " << opt.cpu_load
+            << " busy processes, " << n << " events: p50 " << latencies[n / 2]
+            << " us, p99 " << latencies[n * 99 / 100] << " us, max " << latencies.back() << " us" << std::endl;
+    return EXIT_SUCCESS;
+}